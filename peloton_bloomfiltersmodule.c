@@ -7,12 +7,19 @@
 #include<stdlib.h>
 #include<limits.h>
 #include<assert.h>
+#include<errno.h>
 #include<string.h>
 #include<sys/file.h>
 #include<sys/mman.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<pthread.h>
+#include<sched.h>
+#include<time.h>
 #include<unistd.h>
+#ifdef __linux__
+#include<sys/vfs.h>
+#endif
 
 #if PY_MAJOR_VERSION >= 3
 #define IS_PY3K
@@ -39,18 +46,87 @@
 #define MAP_HASSEMAPHORE 0
 #endif
 
-#ifdef __GNUC__
-#define __atomic_or_fetch(X, Y, Z) __sync_or_and_fetch(X, Y)
-#define __atomic_fetch_sub(X, Y, Z) __sync_fetch_and_sub(X, Y)
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* Free-threaded builds (3.13t) call into one filter from many threads at
+   once.  The counters every type keeps are then updated atomically, even
+   where the bits are not, and the few structures that change shape take
+   the object's critical section, which is a no-op under the GIL. */
+#ifdef Py_GIL_DISABLED
+#define FREE_THREADED 1
+#else
+#define FREE_THREADED 0
+#endif
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
 #endif
 
 
 #ifdef IS_PY3K
 #define TPFLAGS Py_TPFLAGS_DEFAULT
 #else
-#define TPFLAGS Py_TPFLAGS_HAVE_SEQUENCE_IN
+#define TPFLAGS (Py_TPFLAGS_HAVE_SEQUENCE_IN | Py_TPFLAGS_HAVE_INPLACEOPS | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER)
 #endif
 
+/* Bit array layouts.  LAYOUT_SCATTER spreads every probe over the whole
+   array; LAYOUT_BLOCKED picks one cache line with the first hash and keeps
+   the remaining probes inside it, trading a slightly higher false positive
+   rate for a single cache miss per operation. */
+#define LAYOUT_SCATTER 0
+#define LAYOUT_BLOCKED 1
+
+#define BLOCK_WORDS 8 /* 64 byte cache line */
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define BLOCK_BIT_WIDTH 9 /* log2(BLOCK_BITS) */
+#define BLOCK_PROBES_PER_HASH (64 / BLOCK_BIT_WIDTH)
+
+/* Item hashing.  HASH_PYTHON uses PyObject_Hash, which is salted per
+   process for str and bytes.  HASH_STABLE runs a seeded xxh64 over the
+   bytes or UTF-8 of str/bytes items so that every process agrees; other
+   items keep PyObject_Hash, which is not salted for ints. */
+#define HASH_PYTHON 0
+#define HASH_STABLE 1
+
+/* Probe sequences.  PROBE_CHAIN derives each probe from the previous one
+   with xxh64; PROBE_DOUBLE derives all of them from one 128 bit hash. */
+#define PROBE_CHAIN 0
+#define PROBE_DOUBLE 1
+
+/* Sizing.  SIZING_EXACT uses the bits the error rate asks for;
+   SIZING_POW2 rounds them up to a power of two so that positions reduce
+   with a mask or a shift. */
+#define SIZING_EXACT 0
+#define SIZING_POW2 1
+
+/* Rotating shared filters keep this many live generations at most, plus
+   one spare that is being reset. */
+#define MAX_GENERATIONS 64
+
+typedef struct {
+  int layout;
+  int hash;
+  uint64_t seed;
+  int probing;
+  int sizing;
+  int huge_pages; // madvise(MADV_HUGEPAGE), 2MB aligned mappings
+  int populate;   // pre-fault the whole mapping
+  int lock;       // mlock the bits
+  int generations; // live generations of a rotating shared filter
+  int counter_bits; // 4 or 8 for a counting filter, 0 otherwise
+  uint64_t window_ns; // time each generation of an expiring filter covers, 0 otherwise
+  int track_pages;    // keep a bitmap of the pages changed since the last flush
+} bloomfilter_options_t;
+
 struct magicu_info {
   uint64_t multiplier; // the "magic number" multiplier
   uint64_t pre_shift; // shift for the dividend before multiplying
@@ -59,12 +135,37 @@ struct magicu_info {
 };
 
 
-typedef struct {
+typedef struct bloomfilter bloomfilter_t;
+
+/* Counters of the hot paths for stats().  A shared file keeps them in its
+   header, a cache line apart, and every process adds what it counted
+   there every STATS_FLUSH operations, so lookups and adds never touch a
+   line other processes write. */
+#define STAT_ADDS 0
+#define STAT_LOOKUPS 1
+#define STAT_POSITIVES 2
+#define STAT_CLEARS 3
+#define STAT_ROTATIONS 4
+#define STAT_CLEAR_NS 5
+#define STAT_COUNT 6
+#define STATS_STRIDE 8
+#define STATS_FLUSH 4096
+
+struct bloomfilter {
   int fd;
   uint64_t capacity;
   double error_rate;
   uint64_t length;
   int probes;
+  int layout;
+  int hash;
+  uint64_t seed;
+  int probing;
+  int sizing;
+  int shift; // 64 - log2 of the bit count, for power of two filters
+  void (*insert)(bloomfilter_t *bf, uint64_t hash, int atomic);
+  int (*lookup)(bloomfilter_t *bf, uint64_t hash);
+  int (*test_insert)(bloomfilter_t *bf, uint64_t hash, int atomic); // insert, 1 if the key was absent
   void *mmap;
   size_t mmap_size;
   uint64_t *bits;
@@ -72,15 +173,33 @@ typedef struct {
   uint64_t local_counter;
   int invert;
   struct magicu_info divisor;
-} bloomfilter_t;
+  int generations;       // live generations, 1 unless rotating
+  uint64_t stride;       // words from one generation to the next
+  uint64_t *epoch;       // shared epoch of a rotating filter, NULL otherwise
+  uint64_t *reset_epoch; // the epoch whose spare generation is all zero
+  uint64_t window_ns;    // generations advance on time rather than capacity when nonzero
+  uint64_t window_origin; // CLOCK_REALTIME of epoch 0, in ns
+  int counter_bits;      // width of the counters of a counting filter, 0 otherwise
+  uint64_t stats[STAT_COUNT]; // totals of a private filter, the unflushed counts of a shared one
+  uint64_t stats_pending;     // operations counted since the last flush
+  uint64_t *shared_stats;     // STATS_STRIDE words apart in the header, NULL for private filters
+  uint64_t *dirty;            // one bit per page changed since the marks were last taken, NULL when untracked
+  uint64_t *dirty_base;       // the bits pages are numbered from, the first generation's
+  size_t dirty_offset;        // of the page bitmap in the file, 0 when untracked
+};
+
+static void bloomfilter_select_probes(bloomfilter_t *bf);
 
 
 typedef struct _peloton_bloomfilter_object SharedMemoryBloomfilterObject;
 typedef struct _peloton_bloomfilter_object ThreadSafeBloomfilterObject;
 typedef struct _peloton_bloomfilter_object BloomfilterObject;
+typedef struct checkpoint checkpoint_t;
 struct _peloton_bloomfilter_object {
   PyObject HEAD;
   bloomfilter_t *bf;
+  PyObject *path; // file of a shared filter, NULL for a private one
+  checkpoint_t *checkpoint; // snapshot and flush state of a shared filter, NULL until first used
 };
 
 
@@ -89,7 +208,7 @@ static inline uint64_t rotl(uint64_t x, uint64_t r) {
   return ((x >> (64 - r)) | (x << r));
 }
 
-inline uint64_t xxh64(uint64_t k1) {
+static inline uint64_t xxh64(uint64_t k1) {
   uint64_t h64;
   h64  = PRIME_5 + 8;
 
@@ -106,6 +225,87 @@ inline uint64_t xxh64(uint64_t k1) {
   return h64;
 }
 
+// Full length XXH64 for hashing the contents of str and bytes items
+
+static inline uint64_t xxh64_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint32_t xxh64_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME_2;
+  acc = rotl(acc, 31);
+  return acc * PRIME_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME_1 + PRIME_4;
+}
+
+static uint64_t xxh64_bytes(const void *input, size_t len, uint64_t seed) {
+  const uint8_t *p = input;
+  const uint8_t *end = p + len;
+  uint64_t h64;
+
+  if (len >= 32) {
+    // Four independent lanes keep the multipliers busy on long keys
+    const uint8_t *limit = end - 32;
+    uint64_t v1 = seed + PRIME_1 + PRIME_2;
+    uint64_t v2 = seed + PRIME_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME_1;
+    do {
+      v1 = xxh64_round(v1, xxh64_read64(p));
+      v2 = xxh64_round(v2, xxh64_read64(p + 8));
+      v3 = xxh64_round(v3, xxh64_read64(p + 16));
+      v4 = xxh64_round(v4, xxh64_read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h64 = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h64 = xxh64_merge_round(h64, v1);
+    h64 = xxh64_merge_round(h64, v2);
+    h64 = xxh64_merge_round(h64, v3);
+    h64 = xxh64_merge_round(h64, v4);
+  } else {
+    h64 = seed + PRIME_5;
+  }
+  h64 += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h64 ^= xxh64_round(0, xxh64_read64(p));
+    h64 = rotl(h64, 27) * PRIME_1 + PRIME_4;
+  }
+  if (p + 4 <= end) {
+    h64 ^= (uint64_t)xxh64_read32(p) * PRIME_1;
+    h64 = rotl(h64, 23) * PRIME_2 + PRIME_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h64 ^= (*p) * PRIME_5;
+    h64 = rotl(h64, 11) * PRIME_1;
+  }
+  h64 ^= h64 >> 33;
+  h64 *= PRIME_2;
+  h64 ^= h64 >> 29;
+  h64 *= PRIME_3;
+  h64 ^= h64 >> 32;
+  return h64;
+}
+
 // https://raw.githubusercontent.com/ridiculousfish/libdivide/master/divide_by_constants_codegen_reference.c
 
 
@@ -174,7 +374,7 @@ struct magicu_info compute_unsigned_magic_info(uint64_t D, uint64_t num_bits) {
 
 
 
-inline int bloomfilter_probes(double error_rate) {
+static inline int bloomfilter_probes(double error_rate) {
   if ((error_rate <= 0) || (error_rate >= 1))
     return -1;
   return (int)(ceil(log(1 / error_rate) / log(2)));
@@ -188,108 +388,753 @@ size_t bloomfilter_size(uint64_t capacity, double error_rate) {
   return bits;
 }
 
-bloomfilter_t *create_private_bloomfilter(uint64_t capacity, double error_rate) {
+/* The optimum for `capacity` keys at `error_rate`, -n ln p / ln^2 2 bits.
+   bloomfilter_size() allots twice that, which the chained scatter kernel
+   needs: its mask (see scatter_mask) sets one of the low 31 bits of a word
+   or the upper 33 all at once, so half of every word carries no
+   information.  Double hashing uses every bit and is sized at the
+   optimum.  Blocked filters keep the doubled size: with every probe of a
+   key in one 512 bit block, the load of a block varies from key to key
+   and the rate at the optimum is above `error_rate` (1.2x at 1%, near 6x
+   at 0.01%); twice the optimum keeps it below with chained probes. */
+
+static size_t optimal_size(uint64_t capacity, double error_rate) {
+  uint64_t bits = ceil(capacity * fabs(log(error_rate)) / (log(2) * log(2)));
+  return (bits + 63) / 64 * 64;
+}
+
+static uint64_t bloomfilter_length(uint64_t bits, int layout, int sizing) {
+  uint64_t length = (bits + 63) / 64;
+  if (layout == LAYOUT_BLOCKED)
+    length = (length + BLOCK_WORDS - 1) / BLOCK_WORDS * BLOCK_WORDS;
+  if (sizing == SIZING_POW2 && (length & (length - 1)))
+    length = (uint64_t)1 << (64 - __builtin_clzll(length));
+  return length;
+}
+
+/* Counting filters keep one counter where a plain filter keeps one bit,
+   probed by double hashing over the whole array. */
+
+static uint64_t counting_length(uint64_t capacity, double error_rate, int counter_bits) {
+  return bloomfilter_size(capacity, error_rate) / 64 * counter_bits;
+}
+
+static uint64_t options_length(uint64_t capacity, double error_rate, const bloomfilter_options_t *options) {
+  if (options->counter_bits)
+    return counting_length(capacity, error_rate, options->counter_bits);
+  if (options->layout == LAYOUT_SCATTER && options->probing == PROBE_DOUBLE)
+    return bloomfilter_length(optimal_size(capacity, error_rate), options->layout, options->sizing);
+  return bloomfilter_length(bloomfilter_size(capacity, error_rate), options->layout, options->sizing);
+}
+
+// The scatter layout reduces over every bit, the blocked layout over whole blocks
+
+static struct magicu_info bloomfilter_divisor(uint64_t length, int layout) {
+  if (layout == LAYOUT_BLOCKED)
+    return compute_unsigned_magic_info(length / BLOCK_WORDS, 64);
+  return compute_unsigned_magic_info(length * 64, 64);
+}
+
+static size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+// The huge page size when fd lives on hugetlbfs, 0 otherwise
+
+static size_t hugetlbfs_page_size(int fd) {
+#ifdef __linux__
+  struct statfs fs;
+  if (!fstatfs(fd, &fs) && (unsigned long)fs.f_type == HUGETLBFS_MAGIC)
+    return fs.f_bsize;
+#endif
+  return 0;
+}
+
+/* Maps `size` bytes at an `align` aligned address.  Transparent huge pages
+   only back 2MB aligned ranges, and hugetlbfs requires the alignment. */
+
+static void *map_aligned(size_t size, size_t align, int flags, int fd) {
+  size_t reserve = size + align;
+  char *base, *aligned;
+  void *addr;
+
+  base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return MAP_FAILED;
+  aligned = (char *)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+  addr = mmap(aligned, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0);
+  if (addr == MAP_FAILED) {
+    munmap(base, reserve);
+    return MAP_FAILED;
+  }
+  if (aligned > base)
+    munmap(base, aligned - base);
+  if (base + reserve > aligned + size)
+    munmap(aligned + size, base + reserve - (aligned + size));
+  return addr;
+}
+
+/* Applies the huge page, pre-fault and mlock options to a fresh mapping.
+   With huge pages the mapping is pre-faulted only after the madvise, so
+   the faults can allocate huge pages; the fallback touches each page with
+   an atomic OR of zero, which is safe while other processes write. */
+
+static int bloomfilter_map_options(void *addr, size_t size, const bloomfilter_options_t *options) {
+  if (options->huge_pages) {
+  #ifdef MADV_HUGEPAGE
+    madvise(addr, size, MADV_HUGEPAGE);
+  #endif
+    if (options->populate) {
+    #ifdef MADV_POPULATE_WRITE
+      if (madvise(addr, size, MADV_POPULATE_WRITE))
+    #endif
+      {
+        char *page;
+        for (page = addr; page < (char *)addr + size; page += 4096)
+          __atomic_or_fetch((uint64_t *)page, 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  if (options->lock && mlock(addr, size))
+    return -1;
+  return 0;
+}
+
+static int map_flags(int flags, const bloomfilter_options_t *options) {
+  if (options->populate && !options->huge_pages)
+    flags |= MAP_POPULATE;
+  return flags;
+}
+
+/* Private bits up to a huge page come from posix_memalign.  Larger arrays,
+   or any array when huge pages are asked for, are anonymous mappings
+   aligned and rounded to HUGE_PAGE_SIZE. */
+
+static int allocate_private_bits(bloomfilter_t *bf, const bloomfilter_options_t *options) {
+  size_t size = bf->length * sizeof(uint64_t);
+
+  bf->mmap_size = 0;
+  bf->mmap = NULL;
+  if (size < HUGE_PAGE_SIZE && !options->huge_pages) {
+    if (posix_memalign((void **)&bf->bits, BLOCK_WORDS * sizeof(uint64_t), size))
+      return -1;
+    memset(bf->bits, 0, size);
+    if (options->lock && mlock(bf->bits, size)) {
+      free(bf->bits);
+      return -1;
+    }
+    return 0;
+  }
+
+  bf->mmap_size = round_up(size, HUGE_PAGE_SIZE);
+  bf->mmap = map_aligned(bf->mmap_size, HUGE_PAGE_SIZE, map_flags(MAP_PRIVATE | MAP_ANONYMOUS, options), -1);
+  if (bf->mmap == MAP_FAILED) {
+    bf->mmap = NULL;
+    return -1;
+  }
+  if (bloomfilter_map_options(bf->mmap, bf->mmap_size, options)) {
+    munmap(bf->mmap, bf->mmap_size);
+    bf->mmap = NULL;
+    return -1;
+  }
+  bf->bits = bf->mmap;
+  return 0;
+}
+
+bloomfilter_t *create_private_bloomfilter(uint64_t capacity, double error_rate, const bloomfilter_options_t *options) {
+  int layout = options->layout;
   bloomfilter_t *bloomfilter;
   int probes = bloomfilter_probes(error_rate);
-  if (probes == -1)
+  if (probes == -1) {
+    errno = EINVAL;
     return NULL;
+  }
 
   if (!(bloomfilter = malloc(sizeof(bloomfilter_t))))
     return NULL;
   bloomfilter->fd = 0;
   bloomfilter->capacity = capacity;
   bloomfilter->error_rate = error_rate;
-  bloomfilter->length = (bloomfilter_size(capacity, error_rate) + 63 ) / 64;
+  bloomfilter->layout = layout;
+  bloomfilter->hash = options->hash;
+  bloomfilter->seed = options->seed;
+  bloomfilter->probing = options->probing;
+  bloomfilter->sizing = options->sizing;
+  bloomfilter->length = options_length(capacity, error_rate, options);
+  bloomfilter->counter_bits = options->counter_bits;
   bloomfilter->probes = probes;
-  bloomfilter->mmap_size = 0;
-  bloomfilter->mmap = NULL;
-  if (!(bloomfilter->bits = calloc(sizeof(uint64_t), bloomfilter->length))) {
+  if (allocate_private_bits(bloomfilter, options)) {
     free(bloomfilter);
     return NULL;
   }
   bloomfilter->counter = &bloomfilter->local_counter;
 
   bloomfilter->local_counter = capacity;
+  memset(bloomfilter->stats, 0, sizeof(bloomfilter->stats));
+  bloomfilter->stats_pending = 0;
+  bloomfilter->shared_stats = NULL;
   bloomfilter->invert = 0;
-  bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
+  bloomfilter->generations = 1;
+  bloomfilter->stride = bloomfilter->length;
+  bloomfilter->epoch = NULL;
+  bloomfilter->reset_epoch = NULL;
+  bloomfilter->window_ns = 0;
+  bloomfilter->window_origin = 0;
+  bloomfilter->dirty = NULL;
+  bloomfilter->dirty_base = bloomfilter->bits;
+  bloomfilter->dirty_offset = 0;
+  bloomfilter->divisor = bloomfilter_divisor(bloomfilter->length, layout);
+  bloomfilter_select_probes(bloomfilter);
 
   return bloomfilter;
 }
 
 const char HEADER[] = "SharedMemory BloomFilter";
+const char HEADER_V2[] = "Peloton Bloom Filter v2";
+
+/* Version 1 header of a shared bloomfilter.  Files written before layouts
+   existed leave everything after `counter` zero, which reads back as the
+   scatter layout hashed with PyObject_Hash and probed by chaining.
+   The first release mapped its bits 104 bytes in, past three words it
+   never wrote, so the header is exactly that long.  Blocked filters start
+   their bits on the next cache line so that every block is a single
+   line.  Still read, no longer written. */
+typedef struct {
+  char magic[24];
+  uint64_t capacity;
+  double error_rate;
+  uint64_t counter;
+  uint64_t layout;
+  uint64_t hash;
+  uint64_t seed;
+  uint64_t probing;
+  uint64_t sizing;
+  uint64_t reserved[2];
+} shared_header_v1_t;
+
+#define SHARED_HEADER_V1_MIN_SIZE offsetof(shared_header_v1_t, layout)
+
+/* Version 2 header.  It carries the full geometry so that a reader never
+   has to recompute probes or bit count, the counter sits on a cache line
+   of its own and the bits start at `bits_offset`, a page boundary. */
+typedef struct {
+  char magic[24];
+  uint64_t version;
+  uint64_t bits_offset;
+  uint64_t capacity;
+  double error_rate;
+  uint64_t probes;
+  uint64_t bit_count;
+  uint64_t layout;
+  uint64_t hash;
+  uint64_t seed;
+  uint64_t probing;
+  uint64_t sizing;
+  uint64_t generations;
+  uint64_t epoch;
+  uint64_t counter;
+  uint64_t reset_epoch;
+  uint64_t counter_bits;
+  uint64_t stats_offset;
+  uint64_t window_ns;
+  uint64_t window_origin;
+  uint64_t dirty_offset;
+  uint64_t flushes; // times the page marks were taken, see take_dirty
+} shared_header_v2_t;
+
+#define SHARED_VERSION 2
+#define SHARED_PAGE_SIZE 4096
+#define SHARED_PAGE_WORDS (SHARED_PAGE_SIZE / sizeof(uint64_t))
+#define SHARED_STATS_OFFSET 256
+#define SHARED_STATS_SIZE (STAT_COUNT * STATS_STRIDE * sizeof(uint64_t))
+
+/* The generations of a rotating filter start on page boundaries, so a
+   retired one can be reset by punching a hole in the file. */
+static void bloomfilter_set_generations(bloomfilter_t *bf, uint64_t generations) {
+  bf->generations = generations > 1 ? generations : 1;
+  bf->stride = bf->generations > 1 ? round_up(bf->length, SHARED_PAGE_WORDS) : bf->length;
+}
+
+// Words mapped for the bits, including the spare of a rotating filter
+
+static uint64_t bloomfilter_words(const bloomfilter_t *bf) {
+  return bf->generations > 1 ? (bf->generations + 1) * bf->stride : bf->length;
+}
+
+/* Page tracking.  A shared filter created with track_pages keeps one bit
+   per SHARED_PAGE_SIZE of its bits, between the header and the bits, for
+   every page changed since the marks were last taken.  Writers mark a
+   page after setting its bits and a flush takes the marks before reading
+   the pages, so every change is either in what a flush writes or marked
+   for the next one.  Once a page is marked its word is only read, and the
+   bitmap lines stay shared between the cores that write the filter.
+
+   Every handle flushes to a snapshot of its own, so taking the marks
+   does not consume them: the taker stamps each marked page with the
+   number of the take, in a word per page after the bitmap, and a flush
+   writes the pages stamped since its previous take. */
+
+static uint64_t tracked_pages(const bloomfilter_t *bf) {
+  return (bloomfilter_words(bf) + SHARED_PAGE_WORDS - 1) / SHARED_PAGE_WORDS;
+}
+
+static size_t dirty_words(const bloomfilter_t *bf) {
+  return (tracked_pages(bf) + 63) / 64;
+}
+
+// The bitmap, then the stamps from the next cache line on
+
+static size_t dirty_size(const bloomfilter_t *bf) {
+  return round_up(dirty_words(bf) * sizeof(uint64_t), 64) + tracked_pages(bf) * sizeof(uint64_t);
+}
+
+static uint64_t *page_stamps(const bloomfilter_t *bf) {
+  return bf->dirty + round_up(dirty_words(bf) * sizeof(uint64_t), 64) / sizeof(uint64_t);
+}
+
+static inline void mark_dirty(const bloomfilter_t *bf, const uint64_t *word) {
+  uint64_t page, bit, *dirty;
+  if (likely(bf->dirty == NULL))
+    return;
+  page = (word - bf->dirty_base) / SHARED_PAGE_WORDS;
+  dirty = bf->dirty + page / 64;
+  bit = (uint64_t)1 << (page % 64);
+  // x86 orders this load after the locked OR that set the bits, elsewhere it takes a fence
+#if !defined(__x86_64__) && !defined(__i386__)
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+  if (!(__atomic_load_n(dirty, __ATOMIC_RELAXED) & bit))
+    __atomic_fetch_or(dirty, bit, __ATOMIC_SEQ_CST);
+}
+
+// Whole array operations mark every page they may have written
+
+static void mark_dirty_range(const bloomfilter_t *bf, const uint64_t *start, size_t words) {
+  uint64_t page, last, mask;
+  if (!bf->dirty || !words)
+    return;
+  page = (start - bf->dirty_base) / SHARED_PAGE_WORDS;
+  last = (start + words - 1 - bf->dirty_base) / SHARED_PAGE_WORDS;
+  for (; page <= last; page = (page | 63) + 1) {
+    mask = ~(uint64_t)0 << (page % 64);
+    if (page / 64 == last / 64)
+      mask &= ~(uint64_t)0 >> (63 - last % 64);
+    __atomic_fetch_or(bf->dirty + page / 64, mask, __ATOMIC_SEQ_CST);
+  }
+}
+
+static size_t shared_v1_bits_offset(int layout) {
+  if (layout == LAYOUT_BLOCKED)
+    return (sizeof(shared_header_v1_t) + 63) & ~(size_t)63;
+  return sizeof(shared_header_v1_t);
+}
+
+/* Back a sparse file with real blocks, so that a full disk fails here
+   rather than as SIGBUS on first touch.  File systems that cannot do
+   this without writing zeros are left sparse. */
+static int reserve_file(int fd, size_t size) {
+#ifdef __linux__
+  if (fallocate(fd, 0, 0, size) && errno != EOPNOTSUPP)
+    return -1;
+#endif
+  return 0;
+}
+
+/* Files that are replaced by renaming a copy over them get the copy
+   written under a name of its own, `path.<pid>.<n><suffix>`, so writers
+   racing to replace the same file never share one.  Returns the
+   descriptor, with the malloc'd name in *tmp_path, or -1. */
+static int open_temporary(const char *path, const char *suffix, mode_t mode, char **tmp_path) {
+  static unsigned long temporaries;
+  int fd, saved_errno;
+
+  if (!(*tmp_path = malloc(strlen(path) + strlen(suffix) + 48)))
+    return -1;
+  do {
+    sprintf(*tmp_path, "%s.%ld.%lu%s", path, (long)getpid(),
+            __atomic_add_fetch(&temporaries, 1, __ATOMIC_RELAXED), suffix);
+  } while ((fd = open(*tmp_path, O_WRONLY | O_CREAT | O_EXCL, mode)) == -1 && errno == EEXIST);
+  if (fd == -1) {
+    saved_errno = errno;
+    free(*tmp_path);
+    *tmp_path = NULL;
+    errno = saved_errno;
+  }
+  return fd;
+}
+
+/* Expiring filters number their windows from a wall clock time in the
+   header, so every process, and the next run, agrees on the current one.
+   The coarse clock is a few milliseconds behind at worst and is read
+   without a system call. */
+static uint64_t realtime_ns(void) {
+  struct timespec now;
+#ifdef CLOCK_REALTIME_COARSE
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+  clock_gettime(CLOCK_REALTIME, &now);
+#endif
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void init_shared_header(shared_header_v2_t *header, const bloomfilter_t *bf, uint64_t counter) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, HEADER_V2, sizeof(header->magic));
+  header->version = SHARED_VERSION;
+  header->bits_offset = SHARED_PAGE_SIZE;
+  header->capacity = bf->capacity;
+  header->error_rate = bf->error_rate;
+  header->probes = bf->probes;
+  header->bit_count = bf->length * 64;
+  header->layout = bf->layout;
+  header->hash = bf->hash;
+  header->seed = bf->seed;
+  header->probing = bf->probing;
+  header->sizing = bf->sizing;
+  header->generations = bf->generations > 1 ? bf->generations : 0;
+  header->counter_bits = bf->counter_bits;
+  header->counter = counter;
+  header->stats_offset = SHARED_STATS_OFFSET;
+  header->window_ns = bf->window_ns;
+  header->window_origin = bf->window_origin;
+}
+
+/* Read the geometry of a serialized filter, `size` bytes of header out of
+   `total_size`, into bf.  Returns the header version, or -1 with errno
+   set to EINVAL when the data is not a filter. */
+static int parse_shared_header(const void *data, ssize_t size, uint64_t total_size, bloomfilter_t *bf,
+                               size_t *bits_offset, size_t *counter_offset, size_t *stats_offset) {
+  union {
+    shared_header_v1_t v1;
+    shared_header_v2_t v2;
+  } header;
+  int version;
+
+  memset(&header, 0, sizeof(header));
+  if (size > (ssize_t)sizeof(header))
+    size = sizeof(header);
+  if (size > 0)
+    memcpy(&header, data, size);
+  if (size >= (ssize_t)sizeof(header.v2) && !strncmp(header.v2.magic, HEADER_V2, 24)) {
+    if (header.v2.version != SHARED_VERSION)
+      goto invalid;
+    version = SHARED_VERSION;
+    bf->capacity = header.v2.capacity;
+    bf->error_rate = header.v2.error_rate;
+    bf->layout = header.v2.layout;
+    bf->hash = header.v2.hash;
+    bf->seed = header.v2.seed;
+    bf->probing = header.v2.probing;
+    bf->sizing = header.v2.sizing;
+    bf->probes = header.v2.probes;
+    bf->length = header.v2.bit_count / 64;
+    if (header.v2.generations > MAX_GENERATIONS)
+      goto invalid;
+    bloomfilter_set_generations(bf, header.v2.generations);
+    bf->counter_bits = header.v2.counter_bits;
+    if (bf->counter_bits && (bf->counter_bits != 4 && bf->counter_bits != 8))
+      goto invalid;
+    if (bf->counter_bits && (bf->generations > 1 || header.v2.layout != LAYOUT_SCATTER ||
+                             header.v2.probing != PROBE_DOUBLE || header.v2.sizing != SIZING_EXACT))
+      goto invalid;
+    if (bf->counter_bits && header.v2.bit_count % (64 * bf->counter_bits))
+      goto invalid;
+    bf->window_ns = header.v2.window_ns;
+    bf->window_origin = header.v2.window_origin;
+    if (bf->window_ns && bf->generations < 2)
+      goto invalid;
+    *bits_offset = header.v2.bits_offset;
+    *counter_offset = offsetof(shared_header_v2_t, counter);
+    *stats_offset = header.v2.stats_offset;
+    // Files from before stats were kept have room for them in the gap before the bits
+    if (!*stats_offset && *bits_offset >= SHARED_STATS_OFFSET + SHARED_STATS_SIZE)
+      *stats_offset = SHARED_STATS_OFFSET;
+    if (*stats_offset && (*stats_offset < sizeof(header.v2) || *stats_offset % 64 ||
+                          *stats_offset + SHARED_STATS_SIZE > *bits_offset))
+      goto invalid;
+    if (!bf->probes || !bf->length || header.v2.bit_count % 64)
+      goto invalid;
+    if (*bits_offset < sizeof(header.v2) || *bits_offset % 64)
+      goto invalid;
+    if (bf->layout == LAYOUT_BLOCKED && bf->length % BLOCK_WORDS)
+      goto invalid;
+    if (bf->sizing == SIZING_POW2 && (bf->length & (bf->length - 1)))
+      goto invalid;
+    if (total_size < *bits_offset + bloomfilter_words(bf) * sizeof(uint64_t))
+      goto invalid;
+    // The page bitmap sits past the stats, and the pages it tracks start on a page boundary
+    bf->dirty_offset = header.v2.dirty_offset;
+    if (bf->dirty_offset && (bf->counter_bits || bf->dirty_offset % 64 || *bits_offset % SHARED_PAGE_SIZE ||
+                             bf->dirty_offset < (*stats_offset ? *stats_offset + SHARED_STATS_SIZE : sizeof(header.v2)) ||
+                             bf->dirty_offset + dirty_size(bf) > *bits_offset))
+      goto invalid;
+  } else if (size >= (ssize_t)SHARED_HEADER_V1_MIN_SIZE && !strncmp(header.v1.magic, HEADER, 24)) {
+    version = 1;
+    bf->capacity = header.v1.capacity;
+    bf->error_rate = header.v1.error_rate;
+    bf->layout = header.v1.layout;
+    bf->hash = header.v1.hash;
+    bf->seed = header.v1.seed;
+    bf->probing = header.v1.probing;
+    bf->sizing = header.v1.sizing;
+    if (-1 == bloomfilter_probes(bf->error_rate))
+      goto invalid;
+    bf->probes = bloomfilter_probes(bf->error_rate);
+    // Version 1 files were all sized the way the first release sized them
+    bf->length = bloomfilter_length(bloomfilter_size(bf->capacity, bf->error_rate), bf->layout, bf->sizing);
+    bloomfilter_set_generations(bf, 1);
+    bf->counter_bits = 0;
+    bf->window_ns = 0;
+    bf->window_origin = 0;
+    bf->dirty_offset = 0;
+    *bits_offset = shared_v1_bits_offset(bf->layout);
+    *counter_offset = offsetof(shared_header_v1_t, counter);
+    *stats_offset = 0;
+  } else {
+    goto invalid;
+  }
+  if (bf->layout != LAYOUT_SCATTER && bf->layout != LAYOUT_BLOCKED)
+    goto invalid;
+  if (bf->hash != HASH_PYTHON && bf->hash != HASH_STABLE)
+    goto invalid;
+  if (bf->probing != PROBE_CHAIN && bf->probing != PROBE_DOUBLE)
+    goto invalid;
+  if (bf->sizing != SIZING_EXACT && bf->sizing != SIZING_POW2)
+    goto invalid;
+  return version;
+
+ invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+// The same for the header of an open file
 
-static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error_rate) {
+static int read_shared_header(int fd, const struct stat *stats, bloomfilter_t *bf,
+                              size_t *bits_offset, size_t *counter_offset, size_t *stats_offset) {
+  shared_header_v2_t header;
+  ssize_t size = pread(fd, &header, sizeof(header), 0);
+  return parse_shared_header(&header, size, stats->st_size, bf, bits_offset, counter_offset, stats_offset);
+}
+
+static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error_rate, const bloomfilter_options_t *options) {
   bloomfilter_t *bloomfilter;
-  char magicbuffer[25];
-  uint64_t i;
-  uint64_t zero=0;
+  shared_header_v2_t header;
+  size_t bits_offset;
+  size_t counter_offset;
+  size_t stats_offset;
+  size_t file_size;
+  size_t huge_page_size = 0;
+  int header_pending = 0;
 
   if (fd == 0) {
-    return create_private_bloomfilter(capacity, error_rate);
+    return create_private_bloomfilter(capacity, error_rate, options);
   }
   struct stat stats;
-  if (-1 == bloomfilter_probes(error_rate))
+  if (-1 == bloomfilter_probes(error_rate)) {
+    errno = EINVAL;
     return NULL;
+  }
   if (!(bloomfilter = malloc(sizeof(bloomfilter_t))))
     return NULL;
+  huge_page_size = hugetlbfs_page_size(fd);
   flock(fd, LOCK_EX);
 
   if (fstat(fd, &stats)) 
     goto error;
   if (stats.st_size == 0) {
     bloomfilter->capacity = capacity;
+    bloomfilter->error_rate = error_rate;
+    bloomfilter->layout = options->layout;
+    bloomfilter->hash = options->hash;
+    bloomfilter->seed = options->seed;
+    bloomfilter->probing = options->probing;
+    bloomfilter->sizing = options->sizing;
     bloomfilter->probes = bloomfilter_probes(error_rate);
-    bloomfilter->length = (bloomfilter_size(capacity, error_rate) + 63) / 64;
-    bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
-    write(fd, HEADER, 24);
-    write(fd, &capacity, sizeof(uint64_t));
-    write(fd, &error_rate, sizeof(uint64_t));
-    write(fd, &capacity, sizeof(uint64_t));
-    for(i=0; i< bloomfilter->length; ++i)
-      write(fd, &zero, sizeof(uint64_t));
+    bloomfilter->length = options_length(capacity, error_rate, options);
+    bloomfilter->counter_bits = options->counter_bits;
+    bloomfilter_set_generations(bloomfilter, options->generations);
+    bloomfilter->window_ns = options->window_ns;
+    bloomfilter->window_origin = options->window_ns ? realtime_ns() : 0;
+    init_shared_header(&header, bloomfilter, capacity);
+    bloomfilter->dirty_offset = 0;
+    if (options->track_pages) {
+      bloomfilter->dirty_offset = header.dirty_offset = SHARED_PAGE_SIZE;
+      header.bits_offset = SHARED_PAGE_SIZE + round_up(dirty_size(bloomfilter), SHARED_PAGE_SIZE);
+    }
+    bits_offset = header.bits_offset;
+    counter_offset = offsetof(shared_header_v2_t, counter);
+    stats_offset = header.stats_offset;
+    file_size = bits_offset + bloomfilter_words(bloomfilter) * sizeof(uint64_t);
+    if (huge_page_size) {
+      // hugetlbfs files cannot be written, the header goes in through the mapping
+      if (ftruncate(fd, round_up(file_size, huge_page_size)))
+        goto error;
+      header_pending = 1;
+    } else {
+      if (options->huge_pages)
+        file_size = round_up(file_size, HUGE_PAGE_SIZE);
+      if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        goto error;
+      // The bits are a hole that reads back as zero pages
+      if (ftruncate(fd, file_size))
+        goto error;
+      if (options->populate && reserve_file(fd, file_size))
+        goto error;
+    }
   } else {
-    lseek(fd, 0, 0);
-    read(fd, magicbuffer, 24);
-    if (strncmp(magicbuffer, HEADER, 24)) 
-      goto error;
-
-    if (read(fd, &bloomfilter->capacity, sizeof(uint64_t)) < sizeof(uint64_t)) 
+    if (-1 == read_shared_header(fd, &stats, bloomfilter, &bits_offset, &counter_offset, &stats_offset))
       goto error;
-
-    if (read(fd, &bloomfilter->error_rate, sizeof(double)) < sizeof(double)) 
+    // A counting filter and a plain one cannot open each other's files
+    if (!bloomfilter->counter_bits != !options->counter_bits) {
+      errno = EINVAL;
       goto error;
-
-    bloomfilter->probes = bloomfilter_probes(bloomfilter->error_rate);
-    bloomfilter->length = (bloomfilter_size(bloomfilter->capacity, bloomfilter->error_rate) + 63) / 64;
-    bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
-
+    }
+    // Files from earlier releases stop short of the end of their bit array
+    if ((size_t)stats.st_size < bits_offset + bloomfilter->length * sizeof(uint64_t))
+      if (ftruncate(fd, bits_offset + bloomfilter->length * sizeof(uint64_t)))
+        goto error;
   }
-  flock(fd, LOCK_UN);
-  bloomfilter->mmap_size = 24 + sizeof(double) + sizeof(uint64_t)*3 + bloomfilter->length * sizeof(uint64_t);
-  bloomfilter->mmap = mmap(NULL,
-                           bloomfilter->mmap_size,
-                           PROT_READ | PROT_WRITE,
-                           MAP_SHARED | MAP_HASSEMAPHORE,
-                           fd,
-                           0);
-  if (!bloomfilter->mmap) 
+  bloomfilter->fd = fd;
+  bloomfilter->divisor = bloomfilter_divisor(bloomfilter->length, bloomfilter->layout);
+  bloomfilter_select_probes(bloomfilter);
+  bloomfilter->invert = 0;
+  bloomfilter->mmap_size = bits_offset + bloomfilter_words(bloomfilter) * sizeof(uint64_t);
+  if (huge_page_size)
+    bloomfilter->mmap_size = round_up(bloomfilter->mmap_size, huge_page_size);
+  if (huge_page_size || options->huge_pages)
+    bloomfilter->mmap = map_aligned(bloomfilter->mmap_size,
+                                    huge_page_size ? huge_page_size : HUGE_PAGE_SIZE,
+                                    map_flags(MAP_SHARED | MAP_HASSEMAPHORE, options),
+                                    fd);
+  else
+    bloomfilter->mmap = mmap(NULL,
+                             bloomfilter->mmap_size,
+                             PROT_READ | PROT_WRITE,
+                             map_flags(MAP_SHARED | MAP_HASSEMAPHORE, options),
+                             fd,
+                             0);
+  if (bloomfilter->mmap == MAP_FAILED)
     goto error;
+  if (header_pending)
+    memcpy(bloomfilter->mmap, &header, sizeof(header));
+  if (stats_offset)
+    ((shared_header_v2_t *)bloomfilter->mmap)->stats_offset = stats_offset;
+  flock(fd, LOCK_UN);
 
   madvise(bloomfilter->mmap, bloomfilter->mmap_size, MADV_RANDOM);
-  bloomfilter->counter = bloomfilter->mmap + 24 + sizeof(double) + sizeof(uint64_t);
-  bloomfilter->bits = bloomfilter->counter + sizeof(uint64_t);
+  if (bloomfilter_map_options(bloomfilter->mmap, bloomfilter->mmap_size, options)) {
+    munmap(bloomfilter->mmap, bloomfilter->mmap_size);
+    goto error_unlocked;
+  }
+  bloomfilter->counter = (uint64_t *)((char *)bloomfilter->mmap + counter_offset);
+  bloomfilter->bits = (uint64_t *)((char *)bloomfilter->mmap + bits_offset);
+  memset(bloomfilter->stats, 0, sizeof(bloomfilter->stats));
+  bloomfilter->stats_pending = 0;
+  bloomfilter->shared_stats = stats_offset ? (uint64_t *)((char *)bloomfilter->mmap + stats_offset) : NULL;
+  bloomfilter->dirty = bloomfilter->dirty_offset ? (uint64_t *)((char *)bloomfilter->mmap + bloomfilter->dirty_offset) : NULL;
+  bloomfilter->dirty_base = bloomfilter->bits;
+  bloomfilter->epoch = NULL;
+  bloomfilter->reset_epoch = NULL;
+  if (bloomfilter->generations > 1) {
+    bloomfilter->epoch = &((shared_header_v2_t *)bloomfilter->mmap)->epoch;
+    bloomfilter->reset_epoch = &((shared_header_v2_t *)bloomfilter->mmap)->reset_epoch;
+  }
   return bloomfilter;
 
  error:
   flock(fd, LOCK_UN);
+ error_unlocked:
   if (bloomfilter) free(bloomfilter);
   return NULL;
 
 }
 
+/* Rewrite a version 1 file as version 2.  The new file is built next to
+   the old one and renamed over it, so processes that still have the old
+   file mapped keep working on the old copy.  Returns 1 when the file was
+   upgraded, 0 when it already was version 2. */
+static int upgrade_shared_file(const char *path) {
+  bloomfilter_t bf;
+  shared_header_v2_t header;
+  struct stat stats;
+  char *tmp_path = NULL;
+  char *buffer = NULL;
+  size_t bits_offset, counter_offset, stats_offset, done, chunk;
+  uint64_t counter = 0;
+  ssize_t got;
+  int fd, tmp_fd = -1;
+  int version;
+  int saved_errno;
+
+  if ((fd = open(path, O_RDWR)) == -1)
+    return -1;
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &stats))
+    goto error;
+  if (-1 == (version = read_shared_header(fd, &stats, &bf, &bits_offset, &counter_offset, &stats_offset)))
+    goto error;
+  if (version == SHARED_VERSION) {
+    flock(fd, LOCK_UN);
+    close(fd);
+    return 0;
+  }
+  if (pread(fd, &counter, sizeof(counter), counter_offset) != sizeof(counter))
+    goto error;
+  init_shared_header(&header, &bf, counter);
+
+  if (!(tmp_path = malloc(strlen(path) + sizeof(".upgrade"))))
+    goto error;
+  sprintf(tmp_path, "%s.upgrade", path);
+  if (!(buffer = malloc(HUGE_PAGE_SIZE)))
+    goto error;
+  if ((tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, stats.st_mode & 07777)) == -1)
+    goto error;
+  // Short legacy files end in zero words, which the sparse tail supplies
+  if (ftruncate(tmp_fd, header.bits_offset + bf.length * sizeof(uint64_t)))
+    goto error;
+  if (pwrite(tmp_fd, &header, sizeof(header), 0) != sizeof(header))
+    goto error;
+  for (done = 0; done < bf.length * sizeof(uint64_t); done += got) {
+    chunk = bf.length * sizeof(uint64_t) - done;
+    if (chunk > HUGE_PAGE_SIZE)
+      chunk = HUGE_PAGE_SIZE;
+    if ((got = pread(fd, buffer, chunk, bits_offset + done)) == -1)
+      goto error;
+    if (got == 0)
+      break;
+    if (pwrite(tmp_fd, buffer, got, header.bits_offset + done) != got)
+      goto error;
+  }
+  if (fsync(tmp_fd) || rename(tmp_path, path))
+    goto error;
+  close(tmp_fd);
+  free(buffer);
+  free(tmp_path);
+  flock(fd, LOCK_UN);
+  close(fd);
+  return 1;
+
+ error:
+  saved_errno = errno;
+  if (tmp_fd != -1) {
+    close(tmp_fd);
+    unlink(tmp_path);
+  }
+  free(buffer);
+  free(tmp_path);
+  flock(fd, LOCK_UN);
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
 
 static void peloton_bloomfilter_destroy(bloomfilter_t *bloomfilter) {
-  free(bloomfilter->bits);
+  if (bloomfilter->mmap)
+    munmap(bloomfilter->mmap, bloomfilter->mmap_size);
+  else
+    free(bloomfilter->bits);
   free(bloomfilter);
 }
 
@@ -302,348 +1147,4315 @@ static void peloton_shared_memory_bloomfilter_destroy(bloomfilter_t *bloomfilter
   free(bloomfilter);
 }
 
-static PyObject *
-peloton_bloomfilter_clear(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
-  bloomfilter_t *bf = smbo->bf;
-  size_t length = bf->length;
-  size_t i;
-  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
-  for(i=0; i<length; ++i)
-    data[i] = 0;
-  *bf->counter = bf->capacity;
-  Py_RETURN_NONE;
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
+static void stats_flush(bloomfilter_t *bf) {
+  uint64_t count;
+  int stat;
+  if (bf->shared_stats) {
+    for (stat=0; stat<STAT_COUNT; ++stat) {
+      if ((count = __atomic_exchange_n(bf->stats + stat, 0, __ATOMIC_RELAXED)))
+        __atomic_fetch_add(bf->shared_stats + stat * STATS_STRIDE, count, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&bf->stats_pending, 0, __ATOMIC_RELAXED);
+}
 
-static PyObject *
-peloton_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
-  bloomfilter_t *bloomfilter = smbo->bf;
-  int probes = bloomfilter->probes;
-  size_t length = bloomfilter->length;
-  uint64_t hash = PyObject_Hash(item);
-  if (hash == (uint64_t)(-1))
-    return NULL;
+/* Adds and lookups are counted under the GIL, or atomically without one,
+   and reach a shared header in batches */
 
-  bloomfilter->counter -= 1;
-  uint64_t count = bloomfilter->counter;
-  uint64_t cleared = !count;
-  if (cleared || count > bloomfilter->capacity) {
-    Py_DECREF(peloton_bloomfilter_clear(smbo, NULL));
-  }
-  uint64_t *data = __builtin_assume_aligned(smbo->bf->bits, 16);
-  
-  #ifdef USE_MOD
-  while (1) {
-    data[(hash >> 6 ) % length] |= 1 << (hash & 0x3f);
-    if (!probes--) break;
-    hash = xxh64(hash);
-  }
-  #endif
+static inline uint64_t stats_add(uint64_t *counter, uint64_t n) {
+  if (FREE_THREADED)
+    return __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+  return *counter += n;
+}
 
-  #ifndef USE_MOD
-  uint64_t offset;
-  uint64_t multiplier = smbo->bf->divisor.multiplier;
-  uint64_t pre_shift = smbo->bf->divisor.pre_shift;
-  uint64_t post_shift = smbo->bf->divisor.post_shift;
-  uint64_t increment = smbo->bf->divisor.increment; 
+static inline void stats_note(bloomfilter_t *bf, int stat, uint64_t n) {
+  stats_add(bf->stats + stat, n);
+  if (bf->shared_stats && stats_add(&bf->stats_pending, n) >= STATS_FLUSH)
+    stats_flush(bf);
+}
 
-  while (probes--) {
-    offset = hash;
-    offset += increment;
-    offset >>= pre_shift;
-    if (likely(multiplier != 1)) 
-      offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
-    offset >>= post_shift;
-    offset = hash - offset * length * 64;
-    data[offset >> 6] |= 1 << (hash & 0x3f);
-    hash = xxh64(hash);
-  }
-  #endif
-  return PyBool_FromLong(cleared);
+static inline void stats_note_lookups(bloomfilter_t *bf, uint64_t n, uint64_t positives) {
+  stats_add(bf->stats + STAT_POSITIVES, positives);
+  stats_note(bf, STAT_LOOKUPS, n);
 }
 
+// Clears and rotations are rare, and may happen without the GIL
 
-static PyObject *
-peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
-  bloomfilter_t *bloomfilter = smbo->bf;
-  int probes = bloomfilter->probes;
-  size_t length = bloomfilter->length;
-  uint64_t hash = PyObject_Hash(item);
-  if (hash == (uint64_t)(-1))
-    return NULL;
+static void stats_event(bloomfilter_t *bf, int stat, uint64_t n) {
+  __atomic_fetch_add(bf->shared_stats ? bf->shared_stats + stat * STATS_STRIDE : bf->stats + stat,
+                     n, __ATOMIC_RELAXED);
+}
 
-  uint64_t count=(__atomic_fetch_sub(bloomfilter->counter, (uint64_t)1, 0));
-  uint64_t cleared = !count;
-  if (cleared || count > bloomfilter->capacity) {
-    Py_DECREF(peloton_bloomfilter_clear(smbo, NULL));
-  }
-  uint64_t *data = __builtin_assume_aligned(smbo->bf->bits, 16);
-  Py_BEGIN_ALLOW_THREADS
-  
-  #ifdef USE_MOD
-  while (1) {
-    __atomic_or_fetch(data + (hash >> 6 ) % length, 1 << (hash & 0x3f), 1);
-    if (!probes--) break;
-    hash = xxh64(hash);
+static void bloomfilter_clear(bloomfilter_t *bf) {
+  size_t length = bf->length;
+  size_t i, g;
+  uint64_t *data;
+  uint64_t start = monotonic_ns();
+  for (g=0; g * bf->stride < bloomfilter_words(bf); ++g) {
+    data = __builtin_assume_aligned(bf->bits + g * bf->stride, 16);
+    for(i=0; i<length; ++i)
+      data[i] = 0;
   }
-  #endif
+  mark_dirty_range(bf, bf->bits, bloomfilter_words(bf));
+  if (bf->epoch)
+    __atomic_store_n(bf->reset_epoch, __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  __atomic_store_n(bf->counter, bf->capacity, __ATOMIC_RELEASE);
+  stats_event(bf, STAT_CLEARS, 1);
+  stats_event(bf, STAT_CLEAR_NS, monotonic_ns() - start);
+}
 
-  #ifndef USE_MOD
-  uint64_t offset;
-  uint64_t multiplier = smbo->bf->divisor.multiplier;
-  uint64_t pre_shift = smbo->bf->divisor.pre_shift;
-  uint64_t post_shift = smbo->bf->divisor.post_shift;
-  uint64_t increment = smbo->bf->divisor.increment; 
+/* Rotating filters.  Generation `epoch % (generations + 1)` takes the
+   inserts, it and the generations - 1 before it answer lookups, and the
+   one after it is the spare: retired, being reset, and ignored by
+   everybody until it becomes current. */
 
-  while (probes--) {
-    offset = hash;
-    offset += increment;
-    offset >>= pre_shift;
-    if (likely(multiplier != 1)) 
-      offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
-    offset >>= post_shift;
-    offset = hash - offset * length * 64;
-    __atomic_or_fetch(data + (offset >> 6), 1<<(hash & 0x3f), 1);
-    hash = xxh64(hash);
-  }
-  #endif
-  Py_END_ALLOW_THREADS
-  return PyBool_FromLong(cleared);
+static inline uint64_t *generation_bits(const bloomfilter_t *bf, uint64_t epoch, int age) {
+  uint64_t slices = bf->generations + 1;
+  return bf->bits + ((epoch % slices + slices - age) % slices) * bf->stride;
 }
 
-PyObject *
-peloton_bloomfilter_population(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
-  size_t length = smbo->bf->length;
-  size_t i;
-  uint64_t *data = __builtin_assume_aligned(smbo->bf->bits, 16);
-  uint64_t population = 0;
-  for(i=0; i<length; ++i)
-    population += __builtin_popcountll(data[i]);
-  #ifdef IS_PY3K
-  return PyLong_FromLong(population);
-  #else
-  return PyInt_FromLong(population);
+// A copy of bf that the probe kernels see as a plain filter over one generation
+
+static inline void generation_view(const bloomfilter_t *bf, uint64_t epoch, int age, bloomfilter_t *view) {
+  *view = *bf;
+  view->bits = generation_bits(bf, epoch, age);
+  view->generations = 1;
+  view->epoch = NULL;
+}
+
+// Zero a retired generation, handing its pages back when the file allows
+
+static void reset_generation(bloomfilter_t *bf, uint64_t *bits) {
+#ifdef __linux__
+  if (fallocate(bf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (char *)bits - (char *)bf->mmap, bf->stride * sizeof(uint64_t)))
+#endif
+    memset(bits, 0, bf->length * sizeof(uint64_t));
+  mark_dirty_range(bf, bits, bf->length);
+}
+
+/* The epoch switch is a single store, so no key is ever missing from every
+   live generation.  The spare was reset after the previous switch; if that
+   process has not finished yet, give it a moment and then do it here. */
+
+#define ROTATE_SPINS 1000
+
+static void bloomfilter_rotate(bloomfilter_t *bf) {
+  uint64_t epoch = __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE);
+  uint64_t start = monotonic_ns();
+  uint64_t *retired;
+  int spins;
+
+  for (spins=0; __atomic_load_n(bf->reset_epoch, __ATOMIC_ACQUIRE) != epoch; ++spins) {
+    if (spins == ROTATE_SPINS) {
+      reset_generation(bf, generation_bits(bf, epoch + 1, 0));
+      break;
+    }
+    sched_yield();
+  }
+  __atomic_store_n(bf->epoch, epoch + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(bf->counter, bf->capacity, __ATOMIC_RELEASE);
+
+  retired = generation_bits(bf, epoch + 2, 0);
+  Py_BEGIN_ALLOW_THREADS
+  reset_generation(bf, retired);
+  Py_END_ALLOW_THREADS
+  __atomic_store_n(bf->reset_epoch, epoch + 1, __ATOMIC_RELEASE);
+  stats_event(bf, STAT_ROTATIONS, 1);
+  stats_event(bf, STAT_CLEAR_NS, monotonic_ns() - start);
+}
+
+/* Expiring filters.  Epoch e covers the window_ns starting at
+   window_origin + e * window_ns, so a key added now stays visible for
+   between generations - 1 and generations windows.  Whoever first sees
+   the clock past the current window advances the epoch with a compare
+   and swap and resets the retired generation; the others go on with the
+   new epoch.  After a gap longer than the filter remembers every
+   generation has been reset, and whole turns of the ring are skipped in
+   one step, which leaves each generation where it was. */
+
+static uint64_t window_epoch(const bloomfilter_t *bf) {
+  uint64_t now = realtime_ns();
+  return now > bf->window_origin ? (now - bf->window_origin) / bf->window_ns : 0;
+}
+
+static void bloomfilter_expire(bloomfilter_t *bf) {
+  uint64_t slices = bf->generations + 1;
+  uint64_t due = window_epoch(bf);
+  uint64_t epoch = __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE);
+  uint64_t first = epoch;
+  uint64_t start, step;
+  int spins = 0;
+
+  while (epoch < due) {
+    if (__atomic_load_n(bf->reset_epoch, __ATOMIC_ACQUIRE) != epoch) {
+      if (++spins < ROTATE_SPINS) {
+        sched_yield();
+        epoch = __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE);
+        continue;
+      }
+      reset_generation(bf, generation_bits(bf, epoch + 1, 0));
+    }
+    spins = 0;
+    start = monotonic_ns();
+    step = epoch - first >= slices && due - epoch >= slices ? (due - epoch) / slices * slices : 1;
+    if (!__atomic_compare_exchange_n(bf->epoch, &epoch, epoch + step, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      continue;
+    __atomic_store_n(bf->counter, bf->capacity, __ATOMIC_RELEASE);
+    if (step == 1)
+      reset_generation(bf, generation_bits(bf, epoch + 2, 0));
+    epoch += step;
+    __atomic_store_n(bf->reset_epoch, epoch, __ATOMIC_RELEASE);
+    stats_event(bf, STAT_ROTATIONS, 1);
+    stats_event(bf, STAT_CLEAR_NS, monotonic_ns() - start);
+  }
+}
+
+// The epoch to insert into and look up from, advanced first if its window has passed
+
+static inline uint64_t bloomfilter_epoch(bloomfilter_t *bf) {
+  if (bf->window_ns)
+    bloomfilter_expire(bf);
+  return __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE);
+}
+
+static PyObject *
+peloton_bloomfilter_clear(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  bloomfilter_clear(smbo->bf);
+  Py_RETURN_NONE;
+}
+
+// Charge one insertion against the capacity, clearing once it runs out
+
+static inline int bloomfilter_count(bloomfilter_t *bf, int atomic) {
+  uint64_t count;
+  if (atomic || FREE_THREADED)
+    count = __atomic_fetch_sub(bf->counter, (uint64_t)1, __ATOMIC_RELAXED);
+  else
+    count = (*bf->counter)--;
+  // Counting filters drop keys with remove, they never clear
+  if (bf->counter_bits)
+    return 0;
+  // Expiring filters rotate on time, the counter only tracks the current window
+  if (bf->window_ns) {
+    if (!count || count > bf->capacity) {
+      if (atomic || FREE_THREADED)
+        __atomic_fetch_add(bf->counter, (uint64_t)1, __ATOMIC_RELAXED);
+      else
+        ++*bf->counter;
+    }
+    return 0;
+  }
+  if (!count || count > bf->capacity) {
+    // Latecomers to a rotation just insert into the new generation
+    if (bf->epoch) {
+      if (!count)
+        bloomfilter_rotate(bf);
+    } else {
+      bloomfilter_clear(bf);
+    }
+    return !count;
+  }
+  return 0;
+}
+
+
+// Returns (uint64_t)-1 with an exception set on failure, like PyObject_Hash
+
+static inline uint64_t bloomfilter_hash(bloomfilter_t *bf, PyObject *item) {
+  uint64_t hash;
+  const char *data;
+  Py_ssize_t size;
+
+  if (bf->hash != HASH_STABLE)
+    return PyObject_Hash(item);
+
+  #ifdef IS_PY3K
+  if (PyUnicode_Check(item)) {
+    if (!(data = PyUnicode_AsUTF8AndSize(item, &size)))
+      return (uint64_t)(-1);
+  } else if (PyBytes_Check(item)) {
+    data = PyBytes_AS_STRING(item);
+    size = PyBytes_GET_SIZE(item);
+  } else {
+    return PyObject_Hash(item);
+  }
+  hash = xxh64_bytes(data, size, bf->seed);
+  #else
+  if (PyUnicode_Check(item)) {
+    PyObject *utf8 = PyUnicode_AsUTF8String(item);
+    if (!utf8)
+      return (uint64_t)(-1);
+    hash = xxh64_bytes(PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8), bf->seed);
+    Py_DECREF(utf8);
+  } else if (PyString_Check(item)) {
+    data = PyString_AS_STRING(item);
+    size = PyString_GET_SIZE(item);
+    hash = xxh64_bytes(data, size, bf->seed);
+  } else {
+    return PyObject_Hash(item);
+  }
   #endif
+  if (hash == (uint64_t)(-1))
+    hash = (uint64_t)(-2);
+  return hash;
 }
 
-static Py_ssize_t
-BloomFilterObject_len(SharedMemoryBloomfilterObject* smbo)
-{
-    return smbo->bf->capacity - *smbo->bf->counter;
+static inline uint64_t bloomfilter_reduce(uint64_t hash, uint64_t range, const struct magicu_info *divisor) {
+  uint64_t offset = hash;
+  offset += divisor->increment;
+  offset >>= divisor->pre_shift;
+  if (likely(divisor->multiplier != 1))
+    offset = (((__uint128_t)offset * (__uint128_t)divisor->multiplier)) >> 64;
+  offset >>= divisor->post_shift;
+  return hash - offset * range;
 }
 
-int 
-BloomFilterObject_contains(SharedMemoryBloomfilterObject* smbo, PyObject *item)
-{
-  bloomfilter_t *bloomfilter = smbo->bf;
-  uint64_t *data = __builtin_assume_aligned(bloomfilter->bits, 16);
-  int probes = bloomfilter->probes;
-  size_t length = bloomfilter->length;
-  uint64_t hash = PyObject_Hash(item);
-  if (hash == (uint64_t)(-1)) {
-    return -1;
+/* The scatter layout has always produced its bit with an int typed
+   `1 << (hash & 0x3f)`, which x86 reduces modulo 32 and sign extends into
+   the upper half of the word.  Shared files depend on those exact bits, so
+   spell the same mask out without the undefined shift. */
+
+static inline uint64_t scatter_mask(uint64_t hash) {
+  return (uint64_t)(int64_t)(int32_t)((uint32_t)1 << (hash & 0x1f));
+}
+
+/* Kirsch-Mitzenmacher double hashing: two independent 64 bit hashes of the
+   item give every probe as h1 + i * h2, so no probe waits on the one
+   before it.  Positions are reduced with a multiply-shift, which needs no
+   divisor and uses the well mixed high bits. */
+
+static inline void double_hashes(uint64_t hash, uint64_t *h1, uint64_t *h2) {
+  *h1 = xxh64(hash);
+  *h2 = xxh64(hash ^ PRIME_3) | 1;
+}
+
+static inline uint64_t multiply_shift(uint64_t hash, uint64_t range) {
+  return ((__uint128_t)hash * range) >> 64;
+}
+
+// First hash picks the block, the rest are consumed 9 bits per probe
+
+static inline uint64_t *blocked_masks(bloomfilter_t *bf, uint64_t hash, uint64_t masks[BLOCK_WORDS]) {
+  int probes = bf->probes;
+  int i;
+  uint64_t bit;
+  uint64_t *block;
+
+  for (i=0; i<BLOCK_WORDS; ++i)
+    masks[i] = 0;
+
+  if (bf->probing == PROBE_DOUBLE) {
+    uint64_t h1, h2, step;
+    double_hashes(hash, &h1, &h2);
+    block = bf->bits + multiply_shift(h1, bf->length / BLOCK_WORDS) * BLOCK_WORDS;
+    step = rotl(h2, 32) | 1;
+    for (i=0; i<probes; ++i) {
+      bit = h2 >> (64 - BLOCK_BIT_WIDTH);
+      h2 += step;
+      masks[bit >> 6] |= (uint64_t)1 << (bit & 0x3f);
+    }
+    return block;
   }
-    
-  #ifdef USE_MOD
-  while (1) {
-    if (!(1<<(hash & 0x3f) & *(data + (hash >> 6) % length)))
+
+  hash = xxh64(hash);
+  block = bf->bits + bloomfilter_reduce(hash, bf->length / BLOCK_WORDS, &bf->divisor) * BLOCK_WORDS;
+  for (i=0; i<probes; ++i) {
+    if (i % BLOCK_PROBES_PER_HASH == 0)
+      hash = xxh64(hash);
+    bit = hash & (BLOCK_BITS - 1);
+    hash >>= BLOCK_BIT_WIDTH;
+    masks[bit >> 6] |= (uint64_t)1 << (bit & 0x3f);
+  }
+  return block;
+}
+
+static inline uint64_t *blocked_block(bloomfilter_t *bf, uint64_t hash) {
+  uint64_t h1, h2;
+  if (bf->probing == PROBE_DOUBLE) {
+    double_hashes(hash, &h1, &h2);
+    return bf->bits + multiply_shift(h1, bf->length / BLOCK_WORDS) * BLOCK_WORDS;
+  }
+  return bf->bits + bloomfilter_reduce(xxh64(hash), bf->length / BLOCK_WORDS, &bf->divisor) * BLOCK_WORDS;
+}
+
+static void blocked_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  uint64_t masks[BLOCK_WORDS];
+  uint64_t *block = blocked_masks(bf, hash, masks);
+  int i;
+  for (i=0; i<BLOCK_WORDS; ++i) {
+    if (!masks[i])
+      continue;
+    if (atomic)
+      __atomic_or_fetch(block + i, masks[i], __ATOMIC_RELAXED);
+    else
+      block[i] |= masks[i];
+  }
+  mark_dirty(bf, block);
+}
+
+static int blocked_lookup(bloomfilter_t *bf, uint64_t hash) {
+  uint64_t masks[BLOCK_WORDS];
+  uint64_t *block = blocked_masks(bf, hash, masks);
+  uint64_t missing = 0;
+  int i;
+  for (i=0; i<BLOCK_WORDS; ++i)
+    missing |= masks[i] & ~block[i];
+  return !missing;
+}
+
+static int blocked_test_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  uint64_t masks[BLOCK_WORDS];
+  uint64_t *block = blocked_masks(bf, hash, masks);
+  uint64_t missing = 0;
+  int i;
+  for (i=0; i<BLOCK_WORDS; ++i) {
+    if (!masks[i])
+      continue;
+    if (atomic) {
+      missing |= masks[i] & ~__atomic_fetch_or(block + i, masks[i], __ATOMIC_RELAXED);
+    } else {
+      missing |= masks[i] & ~block[i];
+      block[i] |= masks[i];
+    }
+  }
+  mark_dirty(bf, block);
+  return missing != 0;
+}
+
+/* Counting filters: counter_bits wide saturating counters packed into the
+   words from the low bits up.  Counters are updated with a compare and
+   swap of their word when atomic.  A counter that saturates stays there,
+   since it no longer knows how many keys share it. */
+
+static inline uint64_t *counting_word(bloomfilter_t *bf, uint64_t h, uint64_t slots, int *shift) {
+  uint64_t offset = multiply_shift(h, slots) * bf->counter_bits;
+  *shift = offset & 0x3f;
+  return bf->bits + (offset >> 6);
+}
+
+static inline void counting_update(uint64_t *word, int shift, uint64_t max, int delta, int atomic) {
+  uint64_t old = atomic ? __atomic_load_n(word, __ATOMIC_RELAXED) : *word;
+  uint64_t counter;
+  uint64_t new;
+  do {
+    counter = (old >> shift) & max;
+    if (counter == max || (delta < 0 && !counter))
+      return;
+    new = delta > 0 ? old + ((uint64_t)1 << shift) : old - ((uint64_t)1 << shift);
+    if (!atomic) {
+      *word = new;
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(word, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void counting_add(bloomfilter_t *bf, uint64_t hash, int delta, int atomic) {
+  uint64_t slots = bf->length * 64 / bf->counter_bits;
+  uint64_t max = ((uint64_t)1 << bf->counter_bits) - 1;
+  uint64_t h1, h2;
+  uint64_t *word;
+  int shift;
+  int i;
+  double_hashes(hash, &h1, &h2);
+  for (i=0; i<bf->probes; ++i) {
+    word = counting_word(bf, h1 + i * h2, slots, &shift);
+    counting_update(word, shift, max, delta, atomic);
+  }
+}
+
+static void counting_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  counting_add(bf, hash, 1, atomic);
+}
+
+static int counting_lookup(bloomfilter_t *bf, uint64_t hash) {
+  uint64_t slots = bf->length * 64 / bf->counter_bits;
+  uint64_t max = ((uint64_t)1 << bf->counter_bits) - 1;
+  uint64_t h1, h2;
+  uint64_t *word;
+  int shift;
+  int i;
+  double_hashes(hash, &h1, &h2);
+  for (i=0; i<bf->probes; ++i) {
+    word = counting_word(bf, h1 + i * h2, slots, &shift);
+    if (!((*word >> shift) & max))
       return 0;
-    if (!probes--)
-      return 1;
-    hash = xxh64(hash);
   }
-  #endif
+  return 1;
+}
+
+// A key that may be present keeps its counters as they are
+
+static int counting_test_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  if (counting_lookup(bf, hash))
+    return 0;
+  counting_add(bf, hash, 1, atomic);
+  return 1;
+}
+
+// Decrements the counters of a key that may be present, returns 0 if it is not
+
+static int counting_remove(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  if (!counting_lookup(bf, hash))
+    return 0;
+  counting_add(bf, hash, -1, atomic);
+  return 1;
+}
+
+static uint64_t counting_population(bloomfilter_t *bf) {
+  uint64_t max = ((uint64_t)1 << bf->counter_bits) - 1;
+  uint64_t population = 0;
+  uint64_t word;
+  size_t i;
+  int shift;
+  for (i=0; i<bf->length; ++i)
+    for (word = bf->bits[i], shift = 0; word && shift < 64; shift += bf->counter_bits)
+      population += !!((word >> shift) & max);
+  return population;
+}
 
-  #ifndef USE_MOD
+/* Scatter probing, written once and instantiated below with the probe
+   count, probing scheme and sizing as constants.  With a constant count
+   the loop unrolls completely; power of two filters reduce with a mask or
+   a shift instead of the magic division or 128 bit multiply. */
 
+#define always_inline inline __attribute__((always_inline))
+
+static always_inline void
+scatter_insert(bloomfilter_t *bf, uint64_t hash, int atomic, const int probes, const int probing, const int pow2) {
+  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
+  uint64_t range = bf->length * 64;
   uint64_t offset;
-  uint64_t multiplier = smbo->bf->divisor.multiplier;
-  uint64_t pre_shift = smbo->bf->divisor.pre_shift;
-  uint64_t post_shift = smbo->bf->divisor.post_shift;
-  uint64_t increment = smbo->bf->divisor.increment; 
+  int i;
 
-  while (probes--) {
-    offset = hash;
-    offset += increment;
-    offset >>= pre_shift;
-    if (multiplier != 1) 
-      offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
-    offset >>= post_shift;
-    offset = hash - offset * smbo->bf->length * 64;
-    if (!(1<<(offset & 0x3f) & *(data + (offset >> 6))))
+  if (probing == PROBE_DOUBLE) {
+    uint64_t h1, h2;
+    double_hashes(hash, &h1, &h2);
+    #pragma GCC unroll 24
+    for (i=0; i<probes; ++i) {
+      offset = pow2 ? (h1 + i * h2) >> bf->shift : multiply_shift(h1 + i * h2, range);
+      if (atomic)
+        __atomic_or_fetch(data + (offset >> 6), (uint64_t)1 << (offset & 0x3f), __ATOMIC_RELAXED);
+      else
+        data[offset >> 6] |= (uint64_t)1 << (offset & 0x3f);
+      mark_dirty(bf, data + (offset >> 6));
+    }
+    return;
+  }
+
+  #pragma GCC unroll 24
+  for (i=0; i<probes; ++i) {
+    offset = pow2 ? hash & (range - 1) : bloomfilter_reduce(hash, range, &bf->divisor);
+    if (atomic)
+      __atomic_or_fetch(data + (offset >> 6), scatter_mask(hash), __ATOMIC_RELAXED);
+    else
+      data[offset >> 6] |= scatter_mask(hash);
+    mark_dirty(bf, data + (offset >> 6));
+    hash = xxh64(hash);
+  }
+}
+
+static always_inline int
+scatter_lookup(bloomfilter_t *bf, uint64_t hash, const int probes, const int probing, const int pow2) {
+  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
+  uint64_t range = bf->length * 64;
+  uint64_t offset;
+  int i;
+
+  if (probing == PROBE_DOUBLE) {
+    uint64_t h1, h2;
+    double_hashes(hash, &h1, &h2);
+    #pragma GCC unroll 24
+    for (i=0; i<probes; ++i) {
+      offset = pow2 ? (h1 + i * h2) >> bf->shift : multiply_shift(h1 + i * h2, range);
+      if (!(((uint64_t)1 << (offset & 0x3f)) & data[offset >> 6]))
+        return 0;
+    }
+    return 1;
+  }
+
+  #pragma GCC unroll 24
+  for (i=0; i<probes; ++i) {
+    offset = pow2 ? hash & (range - 1) : bloomfilter_reduce(hash, range, &bf->divisor);
+    if (!(scatter_mask(offset) & data[offset >> 6]))
       return 0;
     hash = xxh64(hash);
   }
   return 1;
-  #endif
+}
 
+/* Inserts and reports whether any probe found its bit unset, from the
+   words the atomic ORs return, so the key is walked once.  Two processes
+   racing to add the same new key may both see it as absent, but never
+   both as present. */
+
+static always_inline int
+scatter_test_insert(bloomfilter_t *bf, uint64_t hash, int atomic, const int probes, const int probing, const int pow2) {
+  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
+  uint64_t range = bf->length * 64;
+  uint64_t offset, bit, missing = 0;
+  uint64_t h1, h2;
+  int i;
+
+  if (probing == PROBE_DOUBLE)
+    double_hashes(hash, &h1, &h2);
+  #pragma GCC unroll 24
+  for (i=0; i<probes; ++i) {
+    if (probing == PROBE_DOUBLE) {
+      offset = pow2 ? (h1 + i * h2) >> bf->shift : multiply_shift(h1 + i * h2, range);
+      bit = (uint64_t)1 << (offset & 0x3f);
+    } else {
+      // The range is whole words, so the offset keeps the hash's low six bits
+      offset = pow2 ? hash & (range - 1) : bloomfilter_reduce(hash, range, &bf->divisor);
+      bit = scatter_mask(offset);
+      hash = xxh64(hash);
+    }
+    if (atomic) {
+      missing |= bit & ~__atomic_fetch_or(data + (offset >> 6), bit, __ATOMIC_RELAXED);
+    } else {
+      missing |= bit & ~data[offset >> 6];
+      data[offset >> 6] |= bit;
+    }
+    mark_dirty(bf, data + (offset >> 6));
+  }
+  return missing != 0;
 }
 
+#define MAX_SPECIALIZED_PROBES 24
 
-static PySequenceMethods SharedMemoryBloomfilterObject_sequence_methods = {
-  BloomFilterObject_len, /* sq_length */
-  0,				/* sq_concat */
-  0,				/* sq_repeat */
-  0,				/* sq_item */
-  0,				/* sq_slice */
-  0,				/* sq_ass_item */
-  0,				/* sq_ass_slice */
-  (objobjproc)BloomFilterObject_contains,	/* sq_contains */
-};
+#define SCATTER_KERNEL(ID, PROBES, PROBING, POW2, NAME)                 \
+  static void insert_##NAME##_##ID(bloomfilter_t *bf, uint64_t hash, int atomic) { \
+    scatter_insert(bf, hash, atomic, PROBES, PROBING, POW2);            \
+  }                                                                     \
+  static int lookup_##NAME##_##ID(bloomfilter_t *bf, uint64_t hash) {   \
+    return scatter_lookup(bf, hash, PROBES, PROBING, POW2);             \
+  }                                                                     \
+  static int test_insert_##NAME##_##ID(bloomfilter_t *bf, uint64_t hash, int atomic) { \
+    return scatter_test_insert(bf, hash, atomic, PROBES, PROBING, POW2); \
+  }
 
+#define SCATTER_KERNELS(ID, PROBES)                                     \
+  SCATTER_KERNEL(ID, PROBES, PROBE_CHAIN, 0, chain)                     \
+  SCATTER_KERNEL(ID, PROBES, PROBE_CHAIN, 1, chain_pow2)                \
+  SCATTER_KERNEL(ID, PROBES, PROBE_DOUBLE, 0, double)                   \
+  SCATTER_KERNEL(ID, PROBES, PROBE_DOUBLE, 1, double_pow2)
 
-static PyMethodDef peloton_shared_memory_bloomfilter_methods[] = {
-  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
-  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
-  {"population", (PyCFunction)peloton_bloomfilter_population, METH_NOARGS, NULL},
-  {NULL, NULL}
-};
+#define SCATTER_KERNEL_ENTRY(ID)                                        \
+  {{{insert_chain_##ID, lookup_chain_##ID, test_insert_chain_##ID},     \
+    {insert_chain_pow2_##ID, lookup_chain_pow2_##ID, test_insert_chain_pow2_##ID}}, \
+   {{insert_double_##ID, lookup_double_##ID, test_insert_double_##ID},  \
+    {insert_double_pow2_##ID, lookup_double_pow2_##ID, test_insert_double_pow2_##ID}}}
 
-static PyMethodDef peloton_bloomfilter_methods[] = {
-  {"add", (PyCFunction)peloton_bloomfilter_add, METH_O, NULL},
-  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
-  {"population", (PyCFunction)peloton_bloomfilter_population, METH_NOARGS, NULL},
-  {NULL, NULL}
+SCATTER_KERNELS(any, bf->probes)
+SCATTER_KERNELS(1, 1)   SCATTER_KERNELS(2, 2)   SCATTER_KERNELS(3, 3)   SCATTER_KERNELS(4, 4)
+SCATTER_KERNELS(5, 5)   SCATTER_KERNELS(6, 6)   SCATTER_KERNELS(7, 7)   SCATTER_KERNELS(8, 8)
+SCATTER_KERNELS(9, 9)   SCATTER_KERNELS(10, 10) SCATTER_KERNELS(11, 11) SCATTER_KERNELS(12, 12)
+SCATTER_KERNELS(13, 13) SCATTER_KERNELS(14, 14) SCATTER_KERNELS(15, 15) SCATTER_KERNELS(16, 16)
+SCATTER_KERNELS(17, 17) SCATTER_KERNELS(18, 18) SCATTER_KERNELS(19, 19) SCATTER_KERNELS(20, 20)
+SCATTER_KERNELS(21, 21) SCATTER_KERNELS(22, 22) SCATTER_KERNELS(23, 23) SCATTER_KERNELS(24, 24)
+
+typedef struct {
+  void (*insert)(bloomfilter_t *bf, uint64_t hash, int atomic);
+  int (*lookup)(bloomfilter_t *bf, uint64_t hash);
+  int (*test_insert)(bloomfilter_t *bf, uint64_t hash, int atomic);
+} probe_kernel_t;
+
+// Indexed by probe count (0 for counts past MAX_SPECIALIZED_PROBES), probing and sizing
+
+static const probe_kernel_t scatter_kernels[MAX_SPECIALIZED_PROBES + 1][2][2] = {
+  SCATTER_KERNEL_ENTRY(any),
+  SCATTER_KERNEL_ENTRY(1),  SCATTER_KERNEL_ENTRY(2),  SCATTER_KERNEL_ENTRY(3),  SCATTER_KERNEL_ENTRY(4),
+  SCATTER_KERNEL_ENTRY(5),  SCATTER_KERNEL_ENTRY(6),  SCATTER_KERNEL_ENTRY(7),  SCATTER_KERNEL_ENTRY(8),
+  SCATTER_KERNEL_ENTRY(9),  SCATTER_KERNEL_ENTRY(10), SCATTER_KERNEL_ENTRY(11), SCATTER_KERNEL_ENTRY(12),
+  SCATTER_KERNEL_ENTRY(13), SCATTER_KERNEL_ENTRY(14), SCATTER_KERNEL_ENTRY(15), SCATTER_KERNEL_ENTRY(16),
+  SCATTER_KERNEL_ENTRY(17), SCATTER_KERNEL_ENTRY(18), SCATTER_KERNEL_ENTRY(19), SCATTER_KERNEL_ENTRY(20),
+  SCATTER_KERNEL_ENTRY(21), SCATTER_KERNEL_ENTRY(22), SCATTER_KERNEL_ENTRY(23), SCATTER_KERNEL_ENTRY(24),
 };
 
-static void peloton_bloomfilter_type_dealloc(SharedMemoryBloomfilterObject *smbo) {
-    Py_TRASHCAN_SAFE_BEGIN(smbo);
-  peloton_bloomfilter_destroy(smbo->bf);
+// Called once the geometry of a new or reopened filter is known
 
-  Py_TRASHCAN_SAFE_END(smbo);
+static void bloomfilter_select_probes(bloomfilter_t *bf) {
+  const probe_kernel_t *kernel;
+  bf->shift = 64 - __builtin_ctzll(bf->length * 64);
+  if (bf->counter_bits) {
+    bf->insert = counting_insert;
+    bf->lookup = counting_lookup;
+    bf->test_insert = counting_test_insert;
+    return;
+  }
+  if (bf->layout == LAYOUT_BLOCKED) {
+    bf->insert = blocked_insert;
+    bf->lookup = blocked_lookup;
+    bf->test_insert = blocked_test_insert;
+    return;
+  }
+  kernel = &scatter_kernels[bf->probes <= MAX_SPECIALIZED_PROBES ? bf->probes : 0][bf->probing][bf->sizing];
+  bf->insert = kernel->insert;
+  bf->lookup = kernel->lookup;
+  bf->test_insert = kernel->test_insert;
 }
 
-static void peloton_shared_memory_bloomfilter_type_dealloc(SharedMemoryBloomfilterObject *smbo) {
-  Py_TRASHCAN_SAFE_BEGIN(smbo);
-  peloton_shared_memory_bloomfilter_destroy(smbo->bf);
+static inline void bloomfilter_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  bloomfilter_t view;
+  if (unlikely(bf->epoch != NULL)) {
+    generation_view(bf, bloomfilter_epoch(bf), 0, &view);
+    view.insert(&view, hash, atomic);
+    return;
+  }
+  bf->insert(bf, hash, atomic);
+}
 
-  Py_TRASHCAN_SAFE_END(smbo);
+static inline int bloomfilter_lookup(bloomfilter_t *bf, uint64_t hash) {
+  bloomfilter_t view;
+  uint64_t epoch;
+  int age;
+  if (unlikely(bf->epoch != NULL)) {
+    epoch = bloomfilter_epoch(bf);
+    for (age=0; age<bf->generations; ++age) {
+      generation_view(bf, epoch, age, &view);
+      if (view.lookup(&view, hash))
+        return 1;
+    }
+    return 0;
+  }
+  return bf->lookup(bf, hash);
 }
 
-PyObject *
-make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate);
+/* A rotating filter inserts into the current generation and reports the
+   key as absent only if no older live generation holds it either, so a
+   key seen only in an older generation is carried into the current one. */
 
+static inline int bloomfilter_test_insert(bloomfilter_t *bf, uint64_t hash, int atomic) {
+  bloomfilter_t view;
+  uint64_t epoch;
+  int age;
+  if (unlikely(bf->epoch != NULL)) {
+    epoch = bloomfilter_epoch(bf);
+    generation_view(bf, epoch, 0, &view);
+    if (!view.test_insert(&view, hash, atomic))
+      return 0;
+    for (age=1; age<bf->generations; ++age) {
+      generation_view(bf, epoch, age, &view);
+      if (view.lookup(&view, hash))
+        return 0;
+    }
+    return 1;
+  }
+  return bf->test_insert(bf, hash, atomic);
+}
 
-static int 
-peloton_bloomfilter_init(SharedMemoryBloomfilterObject *self, PyObject *args, PyObject *kwargs) {
-  return 0;
+
+static inline void bloomfilter_prefetch(bloomfilter_t *bf, uint64_t hash, int write) {
+  uint64_t *data = bf->bits;
+  int probes = bf->probes;
+  uint64_t range = bf->length * 64;
+  uint64_t offset;
+  int i;
+
+  if (bf->layout == LAYOUT_BLOCKED) {
+    data = blocked_block(bf, hash);
+    if (write)
+      __builtin_prefetch(data, 1, 1);
+    else
+      __builtin_prefetch(data, 0, 1);
+    return;
+  }
+
+  if (bf->probing == PROBE_DOUBLE) {
+    uint64_t h1, h2;
+    double_hashes(hash, &h1, &h2);
+    for (i=0; i<probes; ++i) {
+      if (bf->counter_bits)
+        offset = multiply_shift(h1 + i * h2, range / bf->counter_bits) * bf->counter_bits;
+      else
+        offset = multiply_shift(h1 + i * h2, range);
+      if (write)
+        __builtin_prefetch(data + (offset >> 6), 1, 1);
+      else
+        __builtin_prefetch(data + (offset >> 6), 0, 1);
+    }
+    return;
+  }
+
+  while (probes--) {
+    offset = bloomfilter_reduce(hash, range, &bf->divisor);
+    if (write)
+      __builtin_prefetch(data + (offset >> 6), 1, 1);
+    else
+      __builtin_prefetch(data + (offset >> 6), 0, 1);
+    hash = xxh64(hash);
+  }
 }
 
+/* Batched probing.  The memory for key i + PREFETCH_DISTANCE is requested
+   while key i is probed, so a batch waits on DRAM roughly once per
+   PREFETCH_DISTANCE keys instead of once per key. */
 
-static PyObject *
-peloton_bloomfilter_compute_unsigned_magic_info
-(PyObject *self, PyObject *args, PyObject *kwargs) {
-  static char *kwlist[] = {"divisor", "number_of_bits", NULL};
-  uint64_t divisor;
-  uint64_t number_of_bits;
-  PyArg_ParseTupleAndKeywords
-    (args, 
-     kwargs,
-     "ll",
-     kwlist,
-     &divisor,
-     &number_of_bits);
+#define PREFETCH_DISTANCE 8
 
-  struct magicu_info magic = compute_unsigned_magic_info(divisor, number_of_bits);
+static void insert_many_scalar(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  Py_ssize_t i;
+  for (i=0; i<n && i<PREFETCH_DISTANCE; ++i)
+    bloomfilter_prefetch(bf, hashes[i], 1);
+  for (i=0; i<n; ++i) {
+    if (i + PREFETCH_DISTANCE < n)
+      bloomfilter_prefetch(bf, hashes[i + PREFETCH_DISTANCE], 1);
+    bloomfilter_insert(bf, hashes[i], atomic);
+  }
+}
 
-  PyObject *retval = PyTuple_New(4);
-  if (!retval)
-    return NULL;
-  #ifdef IS_PY3K
-  PyObject *multiplier = PyLong_FromSize_t(magic.multiplier);
-  #else
-  PyObject *multiplier = PyInt_FromSize_t(magic.multiplier);
-  #endif
-  if (!multiplier)
-    return NULL;
-  #ifdef IS_PY3K
-  PyObject *pre_shift = PyLong_FromLong(magic.pre_shift);
-  #else
-  PyObject *pre_shift = PyInt_FromLong(magic.pre_shift);
-  #endif
-  if (!pre_shift)
-    return NULL;
-  #ifdef IS_PY3K
-  PyObject *post_shift = PyLong_FromLong(magic.post_shift);
-  #else
-  PyObject *post_shift = PyInt_FromLong(magic.post_shift);
-  #endif
-  if (!post_shift)
-    return NULL;
-  PyObject *increment = PyBool_FromLong(magic.increment);
-  if (!increment)
-    return NULL;
+static void lookup_many_scalar(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  Py_ssize_t i;
+  for (i=0; i<n && i<PREFETCH_DISTANCE; ++i)
+    bloomfilter_prefetch(bf, hashes[i], 0);
+  for (i=0; i<n; ++i) {
+    if (i + PREFETCH_DISTANCE < n)
+      bloomfilter_prefetch(bf, hashes[i + PREFETCH_DISTANCE], 0);
+    out[i] = bloomfilter_lookup(bf, hashes[i]);
+  }
+}
 
-  PyTuple_SET_ITEM(retval, 0, multiplier);
-  PyTuple_SET_ITEM(retval, 1, pre_shift);
-  PyTuple_SET_ITEM(retval, 2, post_shift);
-  PyTuple_SET_ITEM(retval, 3, increment);
+/* Word-wise union and intersection of two filters with the same geometry.
+   Atomic merges leave the words they would not change alone, so a merge
+   into a live shared filter only contends on the words it actually sets
+   or clears, and never drops a bit another writer set meanwhile. */
+
+#define MERGE_OR 0
+#define MERGE_AND 1
+
+static inline void merge_word_atomic(uint64_t *dst, uint64_t src, int op) {
+  uint64_t word = __atomic_load_n(dst, __ATOMIC_RELAXED);
+  if (op == MERGE_OR) {
+    if (src & ~word)
+      __atomic_or_fetch(dst, src, __ATOMIC_RELAXED);
+  } else if (word & ~src) {
+    __atomic_and_fetch(dst, src, __ATOMIC_RELAXED);
+  }
+}
+
+static void merge_words_scalar(uint64_t *dst, const uint64_t *src, size_t n, int op, int atomic) {
+  size_t i;
+  if (atomic) {
+    for (i=0; i<n; ++i)
+      merge_word_atomic(dst + i, src[i], op);
+  } else if (op == MERGE_OR) {
+    for (i=0; i<n; ++i)
+      dst[i] |= src[i];
+  } else {
+    for (i=0; i<n; ++i)
+      dst[i] &= src[i];
+  }
+}
+
+/* Bits set in a, or in a | b or a & b when b is given. */
+
+static uint64_t popcount_words_scalar(const uint64_t *a, const uint64_t *b, size_t n, int op) {
+  uint64_t count = 0;
+  size_t i;
+  if (!b)
+    for (i=0; i<n; ++i)
+      count += __builtin_popcountll(a[i]);
+  else if (op == MERGE_OR)
+    for (i=0; i<n; ++i)
+      count += __builtin_popcountll(a[i] | b[i]);
+  else
+    for (i=0; i<n; ++i)
+      count += __builtin_popcountll(a[i] & b[i]);
+  return count;
+}
+
+/* SIMD batch kernels for the scatter layout with double hashing.  Each
+   lane carries one key: its xxh64 pair, multiply-shift positions and a
+   gather of the probed words.  Lookups drop a lane as soon as one of its
+   bits is clear.  Inserts hand the computed offsets to scalar ORs, since
+   lanes may collide on a word, one batch behind the prefetches issued for
+   them.  The kernels are compiled per ISA with target attributes and
+   picked at import time from cpuid. */
+
+#define KERNEL_MAX_PROBES 64
+
+static inline void set_offsets(bloomfilter_t *bf, const uint64_t *offsets, int count, int atomic) {
+  uint64_t *data = bf->bits;
+  int i;
+  for (i=0; i<count; ++i) {
+    if (atomic)
+      __atomic_or_fetch(data + (offsets[i] >> 6), (uint64_t)1 << (offsets[i] & 0x3f), __ATOMIC_RELAXED);
+    else
+      data[offsets[i] >> 6] |= (uint64_t)1 << (offsets[i] & 0x3f);
+    mark_dirty(bf, data + (offsets[i] >> 6));
+  }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx2,avx512f,avx512dq")))
+
+static AVX2_TARGET inline __m256i mullo_avx2(__m256i a, __m256i b) {
+  __m256i lo_lo = _mm256_mul_epu32(a, b);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                   _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(lo_lo, _mm256_slli_epi64(cross, 32));
+}
+
+static AVX2_TARGET inline __m256i mulhi_avx2(__m256i a, __m256i b) {
+  const __m256i low = _mm256_set1_epi64x(0xffffffffULL);
+  __m256i a_hi = _mm256_srli_epi64(a, 32);
+  __m256i b_hi = _mm256_srli_epi64(b, 32);
+  __m256i lo_lo = _mm256_mul_epu32(a, b);
+  __m256i hi_lo = _mm256_mul_epu32(a_hi, b);
+  __m256i lo_hi = _mm256_mul_epu32(a, b_hi);
+  __m256i hi_hi = _mm256_mul_epu32(a_hi, b_hi);
+  __m256i cross = _mm256_add_epi64(_mm256_srli_epi64(lo_lo, 32),
+                                   _mm256_add_epi64(_mm256_and_si256(hi_lo, low), _mm256_and_si256(lo_hi, low)));
+  return _mm256_add_epi64(_mm256_add_epi64(hi_hi, _mm256_srli_epi64(cross, 32)),
+                          _mm256_add_epi64(_mm256_srli_epi64(hi_lo, 32), _mm256_srli_epi64(lo_hi, 32)));
+}
+
+#define ROTL_AVX2(X, R) _mm256_or_si256(_mm256_slli_epi64((X), (R)), _mm256_srli_epi64((X), 64 - (R)))
+
+static AVX2_TARGET inline __m256i xxh64_avx2(__m256i k1) {
+  __m256i h64;
+  k1 = mullo_avx2(k1, _mm256_set1_epi64x(PRIME_2));
+  k1 = ROTL_AVX2(k1, 31);
+  k1 = mullo_avx2(k1, _mm256_set1_epi64x(PRIME_1));
+  h64 = _mm256_xor_si256(_mm256_set1_epi64x(PRIME_5 + 8), k1);
+  h64 = _mm256_add_epi64(mullo_avx2(ROTL_AVX2(h64, 27), _mm256_set1_epi64x(PRIME_1)), _mm256_set1_epi64x(PRIME_4));
+  h64 = _mm256_xor_si256(h64, _mm256_srli_epi64(h64, 33));
+  h64 = mullo_avx2(h64, _mm256_set1_epi64x(PRIME_2));
+  h64 = _mm256_xor_si256(h64, _mm256_srli_epi64(h64, 29));
+  h64 = mullo_avx2(h64, _mm256_set1_epi64x(PRIME_3));
+  return _mm256_xor_si256(h64, _mm256_srli_epi64(h64, 32));
+}
+
+static AVX2_TARGET void insert_many_avx2(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  uint64_t *data = bf->bits;
+  const __m256i range = _mm256_set1_epi64x(bf->length * 64);
+  const __m256i one = _mm256_set1_epi64x(1);
+  uint64_t offsets[2][KERNEL_MAX_PROBES * 4];
+  int count = bf->probes * 4;
+  int pending = 0;
+  int cur = 0;
+  Py_ssize_t i;
+  int p;
+
+  if (bf->probes > KERNEL_MAX_PROBES) {
+    insert_many_scalar(bf, hashes, n, atomic);
+    return;
+  }
+  for (i=0; i+4<=n; i+=4) {
+    __m256i h = _mm256_loadu_si256((const __m256i *)(hashes + i));
+    __m256i h1 = xxh64_avx2(h);
+    __m256i h2 = _mm256_or_si256(xxh64_avx2(_mm256_xor_si256(h, _mm256_set1_epi64x(PRIME_3))), one);
+    for (p=0; p<bf->probes; ++p) {
+      _mm256_storeu_si256((__m256i *)(offsets[cur] + p * 4), mulhi_avx2(h1, range));
+      h1 = _mm256_add_epi64(h1, h2);
+    }
+    for (p=0; p<count; ++p)
+      __builtin_prefetch(data + (offsets[cur][p] >> 6), 1, 1);
+    set_offsets(bf, offsets[cur ^ 1], pending, atomic);
+    pending = count;
+    cur ^= 1;
+  }
+  set_offsets(bf, offsets[cur ^ 1], pending, atomic);
+  insert_many_scalar(bf, hashes + i, n - i, atomic);
+}
+
+static AVX2_TARGET void lookup_many_avx2(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  const long long *data = (const long long *)bf->bits;
+  const __m256i range = _mm256_set1_epi64x(bf->length * 64);
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i low6 = _mm256_set1_epi64x(0x3f);
+  const __m256i zero = _mm256_setzero_si256();
+  Py_ssize_t i;
+  int p, j, live;
+
+  for (i=0; i+4<=n; i+=4) {
+    __m256i h = _mm256_loadu_si256((const __m256i *)(hashes + i));
+    __m256i h1 = xxh64_avx2(h);
+    __m256i h2 = _mm256_or_si256(xxh64_avx2(_mm256_xor_si256(h, _mm256_set1_epi64x(PRIME_3))), one);
+    __m256i lanes = _mm256_cmpeq_epi64(zero, zero);
+    for (p=0; p<bf->probes; ++p) {
+      __m256i offset = mulhi_avx2(h1, range);
+      __m256i word = _mm256_i64gather_epi64(data, _mm256_srli_epi64(offset, 6), 8);
+      __m256i bit = _mm256_sllv_epi64(one, _mm256_and_si256(offset, low6));
+      lanes = _mm256_andnot_si256(_mm256_cmpeq_epi64(_mm256_and_si256(word, bit), zero), lanes);
+      if (_mm256_testz_si256(lanes, lanes))
+        break;
+      h1 = _mm256_add_epi64(h1, h2);
+    }
+    live = _mm256_movemask_pd(_mm256_castsi256_pd(lanes));
+    for (j=0; j<4; ++j)
+      out[i + j] = (live >> j) & 1;
+  }
+  lookup_many_scalar(bf, hashes + i, n - i, out + i);
+}
+
+// testc(a, b) is set when b has no bits outside a, i.e. the merge is a no-op
+
+static AVX2_TARGET void merge_words_avx2(uint64_t *dst, const uint64_t *src, size_t n, int op, int atomic) {
+  size_t i, j;
+  for (i=0; i+4<=n; i+=4) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (atomic) {
+      if (op == MERGE_OR ? _mm256_testc_si256(d, s) : _mm256_testc_si256(s, d))
+        continue;
+      for (j=i; j<i+4; ++j)
+        merge_word_atomic(dst + j, src[j], op);
+    } else {
+      _mm256_storeu_si256((__m256i *)(dst + i), op == MERGE_OR ? _mm256_or_si256(d, s) : _mm256_and_si256(d, s));
+    }
+  }
+  merge_words_scalar(dst + i, src + i, n - i, op, atomic);
+}
+
+/* Popcount by nibble lookup (Mula): vpshufb counts the bits of every
+   nibble, vpsadbw sums the byte counts into the 64 bit lanes. */
+
+static AVX2_TARGET inline __m256i popcount_avx2(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                                   _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+  return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+static AVX2_TARGET uint64_t popcount_words_avx2(const uint64_t *a, const uint64_t *b, size_t n, int op) {
+  __m256i total = _mm256_setzero_si256();
+  __m256i v;
+  uint64_t lanes[4];
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    v = _mm256_loadu_si256((const __m256i *)(a + i));
+    if (b)
+      v = op == MERGE_OR ? _mm256_or_si256(v, _mm256_loadu_si256((const __m256i *)(b + i)))
+                         : _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *)(b + i)));
+    total = _mm256_add_epi64(total, popcount_avx2(v));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_words_scalar(a + i, b ? b + i : NULL, n - i, op);
+}
+
+static AVX512_TARGET inline __m512i mulhi_avx512(__m512i a, __m512i b) {
+  const __m512i low = _mm512_set1_epi64(0xffffffffULL);
+  __m512i a_hi = _mm512_srli_epi64(a, 32);
+  __m512i b_hi = _mm512_srli_epi64(b, 32);
+  __m512i lo_lo = _mm512_mul_epu32(a, b);
+  __m512i hi_lo = _mm512_mul_epu32(a_hi, b);
+  __m512i lo_hi = _mm512_mul_epu32(a, b_hi);
+  __m512i hi_hi = _mm512_mul_epu32(a_hi, b_hi);
+  __m512i cross = _mm512_add_epi64(_mm512_srli_epi64(lo_lo, 32),
+                                   _mm512_add_epi64(_mm512_and_si512(hi_lo, low), _mm512_and_si512(lo_hi, low)));
+  return _mm512_add_epi64(_mm512_add_epi64(hi_hi, _mm512_srli_epi64(cross, 32)),
+                          _mm512_add_epi64(_mm512_srli_epi64(hi_lo, 32), _mm512_srli_epi64(lo_hi, 32)));
+}
+
+static AVX512_TARGET inline __m512i xxh64_avx512(__m512i k1) {
+  __m512i h64;
+  k1 = _mm512_mullo_epi64(k1, _mm512_set1_epi64(PRIME_2));
+  k1 = _mm512_rol_epi64(k1, 31);
+  k1 = _mm512_mullo_epi64(k1, _mm512_set1_epi64(PRIME_1));
+  h64 = _mm512_xor_si512(_mm512_set1_epi64(PRIME_5 + 8), k1);
+  h64 = _mm512_add_epi64(_mm512_mullo_epi64(_mm512_rol_epi64(h64, 27), _mm512_set1_epi64(PRIME_1)), _mm512_set1_epi64(PRIME_4));
+  h64 = _mm512_xor_si512(h64, _mm512_srli_epi64(h64, 33));
+  h64 = _mm512_mullo_epi64(h64, _mm512_set1_epi64(PRIME_2));
+  h64 = _mm512_xor_si512(h64, _mm512_srli_epi64(h64, 29));
+  h64 = _mm512_mullo_epi64(h64, _mm512_set1_epi64(PRIME_3));
+  return _mm512_xor_si512(h64, _mm512_srli_epi64(h64, 32));
+}
+
+static AVX512_TARGET void insert_many_avx512(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  uint64_t *data = bf->bits;
+  const __m512i range = _mm512_set1_epi64(bf->length * 64);
+  const __m512i one = _mm512_set1_epi64(1);
+  uint64_t offsets[2][KERNEL_MAX_PROBES * 8];
+  int count = bf->probes * 8;
+  int pending = 0;
+  int cur = 0;
+  Py_ssize_t i;
+  int p;
+
+  if (bf->probes > KERNEL_MAX_PROBES) {
+    insert_many_scalar(bf, hashes, n, atomic);
+    return;
+  }
+  for (i=0; i+8<=n; i+=8) {
+    __m512i h = _mm512_loadu_si512(hashes + i);
+    __m512i h1 = xxh64_avx512(h);
+    __m512i h2 = _mm512_or_si512(xxh64_avx512(_mm512_xor_si512(h, _mm512_set1_epi64(PRIME_3))), one);
+    for (p=0; p<bf->probes; ++p) {
+      _mm512_storeu_si512(offsets[cur] + p * 8, mulhi_avx512(h1, range));
+      h1 = _mm512_add_epi64(h1, h2);
+    }
+    for (p=0; p<count; ++p)
+      __builtin_prefetch(data + (offsets[cur][p] >> 6), 1, 1);
+    set_offsets(bf, offsets[cur ^ 1], pending, atomic);
+    pending = count;
+    cur ^= 1;
+  }
+  set_offsets(bf, offsets[cur ^ 1], pending, atomic);
+  insert_many_scalar(bf, hashes + i, n - i, atomic);
+}
+
+static AVX512_TARGET void lookup_many_avx512(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  const uint64_t *data = bf->bits;
+  const __m512i range = _mm512_set1_epi64(bf->length * 64);
+  const __m512i one = _mm512_set1_epi64(1);
+  const __m512i low6 = _mm512_set1_epi64(0x3f);
+  Py_ssize_t i;
+  int p, j;
+  __mmask8 live;
+
+  for (i=0; i+8<=n; i+=8) {
+    __m512i h = _mm512_loadu_si512(hashes + i);
+    __m512i h1 = xxh64_avx512(h);
+    __m512i h2 = _mm512_or_si512(xxh64_avx512(_mm512_xor_si512(h, _mm512_set1_epi64(PRIME_3))), one);
+    live = 0xff;
+    for (p=0; p<bf->probes && live; ++p) {
+      __m512i offset = mulhi_avx512(h1, range);
+      __m512i word = _mm512_i64gather_epi64(_mm512_srli_epi64(offset, 6), data, 8);
+      __m512i bit = _mm512_sllv_epi64(one, _mm512_and_si512(offset, low6));
+      live = _mm512_mask_test_epi64_mask(live, word, bit);
+      h1 = _mm512_add_epi64(h1, h2);
+    }
+    for (j=0; j<8; ++j)
+      out[i + j] = (live >> j) & 1;
+  }
+  lookup_many_scalar(bf, hashes + i, n - i, out + i);
+}
+
+static AVX512_TARGET void merge_words_avx512(uint64_t *dst, const uint64_t *src, size_t n, int op, int atomic) {
+  size_t i;
+  int j;
+  __mmask8 changed;
+  for (i=0; i+8<=n; i+=8) {
+    __m512i d = _mm512_loadu_si512(dst + i);
+    __m512i s = _mm512_loadu_si512(src + i);
+    if (atomic) {
+      changed = op == MERGE_OR ? _mm512_test_epi64_mask(_mm512_andnot_si512(d, s), s)
+                               : _mm512_test_epi64_mask(_mm512_andnot_si512(s, d), d);
+      for (j=0; changed; ++j, changed >>= 1)
+        if (changed & 1)
+          merge_word_atomic(dst + i + j, src[i + j], op);
+    } else {
+      _mm512_storeu_si512(dst + i, op == MERGE_OR ? _mm512_or_si512(d, s) : _mm512_and_si512(d, s));
+    }
+  }
+  merge_words_scalar(dst + i, src + i, n - i, op, atomic);
+}
+
+// VPOPCNTDQ came after the rest of AVX-512, CPUs without it count with AVX2
+
+#define VPOPCNT_TARGET __attribute__((target("avx2,avx512f,avx512vpopcntdq")))
+
+static int have_vpopcntdq;
+
+static VPOPCNT_TARGET uint64_t popcount_words_vpopcnt(const uint64_t *a, const uint64_t *b, size_t n, int op) {
+  __m512i total = _mm512_setzero_si512();
+  __m512i v;
+  size_t i;
+  for (i=0; i+8<=n; i+=8) {
+    v = _mm512_loadu_si512(a + i);
+    if (b)
+      v = op == MERGE_OR ? _mm512_or_si512(v, _mm512_loadu_si512(b + i)) : _mm512_and_si512(v, _mm512_loadu_si512(b + i));
+    total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+  }
+  return _mm512_reduce_add_epi64(total) + popcount_words_scalar(a + i, b ? b + i : NULL, n - i, op);
+}
+
+static uint64_t popcount_words_avx512(const uint64_t *a, const uint64_t *b, size_t n, int op) {
+  if (have_vpopcntdq)
+    return popcount_words_vpopcnt(a, b, n, op);
+  return popcount_words_avx2(a, b, n, op);
+}
+
+#endif
+
+typedef struct {
+  const char *name;
+  void (*insert_many)(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic);
+  void (*lookup_many)(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out);
+  void (*merge_words)(uint64_t *dst, const uint64_t *src, size_t n, int op, int atomic);
+  uint64_t (*popcount_words)(const uint64_t *a, const uint64_t *b, size_t n, int op);
+} bloomfilter_kernel_t;
+
+static const bloomfilter_kernel_t bloomfilter_kernels[] = {
+  {"scalar", insert_many_scalar, lookup_many_scalar, merge_words_scalar, popcount_words_scalar},
+#ifdef HAVE_X86_KERNELS
+  {"avx2", insert_many_avx2, lookup_many_avx2, merge_words_avx2, popcount_words_avx2},
+  {"avx512", insert_many_avx512, lookup_many_avx512, merge_words_avx512, popcount_words_avx512},
+#endif
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static const bloomfilter_kernel_t *bloomfilter_kernel = bloomfilter_kernels;
+
+static int bloomfilter_kernel_supported(const bloomfilter_kernel_t *kernel) {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (!strcmp(kernel->name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if (!strcmp(kernel->name, "avx512"))
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+  return 1;
+}
+
+// Picks the widest kernel the CPU supports
+
+static void bloomfilter_select_kernel(void) {
+  const bloomfilter_kernel_t *kernel;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  have_vpopcntdq = __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+  for (kernel = bloomfilter_kernels; kernel->name; ++kernel)
+    if (bloomfilter_kernel_supported(kernel))
+      bloomfilter_kernel = kernel;
+}
+
+static void bloomfilter_insert_many(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  bloomfilter_t view;
+  if (bf->epoch) {
+    generation_view(bf, bloomfilter_epoch(bf), 0, &view);
+    bf = &view;
+  }
+  if (bf->layout == LAYOUT_SCATTER && bf->probing == PROBE_DOUBLE && !bf->counter_bits)
+    bloomfilter_kernel->insert_many(bf, hashes, n, atomic);
+  else
+    insert_many_scalar(bf, hashes, n, atomic);
+}
+
+static void kernel_lookup_many(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  if (bf->layout == LAYOUT_SCATTER && bf->probing == PROBE_DOUBLE && !bf->counter_bits)
+    bloomfilter_kernel->lookup_many(bf, hashes, n, out);
+  else
+    lookup_many_scalar(bf, hashes, n, out);
+}
+
+// Rotating filters look the batch up in every live generation and OR the answers
+
+static void bloomfilter_lookup_many(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  bloomfilter_t view;
+  uint64_t epoch;
+  char *older;
+  Py_ssize_t i;
+  int age;
+
+  if (!bf->epoch) {
+    kernel_lookup_many(bf, hashes, n, out);
+    return;
+  }
+  epoch = bloomfilter_epoch(bf);
+  generation_view(bf, epoch, 0, &view);
+  kernel_lookup_many(&view, hashes, n, out);
+  older = malloc(n ? n : 1);
+  for (age=1; age<bf->generations; ++age) {
+    generation_view(bf, epoch, age, &view);
+    if (older) {
+      kernel_lookup_many(&view, hashes, n, older);
+      for (i=0; i<n; ++i)
+        out[i] |= older[i];
+    } else {
+      for (i=0; i<n; ++i)
+        if (!out[i])
+          out[i] = view.lookup(&view, hashes[i]);
+    }
+  }
+  free(older);
+}
+
+// Hashes every item of an iterable into a PyMem_Malloc'd array
+
+static uint64_t *bloomfilter_hash_items(bloomfilter_t *bf, PyObject *iterable, Py_ssize_t *n) {
+  PyObject *seq = PySequence_Fast(iterable, "argument must be iterable");
+  PyObject **items;
+  uint64_t *hashes;
+  Py_ssize_t i;
+
+  if (!seq)
+    return NULL;
+  *n = PySequence_Fast_GET_SIZE(seq);
+  items = PySequence_Fast_ITEMS(seq);
+  if (!(hashes = PyMem_Malloc(sizeof(uint64_t) * (*n ? *n : 1)))) {
+    Py_DECREF(seq);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (i=0; i<*n; ++i) {
+    hashes[i] = bloomfilter_hash(bf, items[i]);
+    if (hashes[i] == (uint64_t)(-1)) {
+      PyMem_Free(hashes);
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+  Py_DECREF(seq);
+  return hashes;
+}
+
+
+// Adds one hashed key, returning 1 if that cleared or rotated the filter
+
+static int bloomfilter_add_one(bloomfilter_t *bloomfilter, uint64_t hash, int atomic) {
+  int cleared = bloomfilter_count(bloomfilter, atomic);
+  // Without a GIL to hand over, detaching costs more than the probes
+#if FREE_THREADED
+  bloomfilter_insert(bloomfilter, hash, atomic);
+#else
+  if (atomic) {
+    Py_BEGIN_ALLOW_THREADS
+    bloomfilter_insert(bloomfilter, hash, 1);
+    Py_END_ALLOW_THREADS
+  } else {
+    bloomfilter_insert(bloomfilter, hash, 0);
+  }
+#endif
+  stats_note(bloomfilter, STAT_ADDS, 1);
+  return cleared;
+}
+
+/* Adds a key unless it may already be present, in one walk of its probes,
+   and returns 1 if it was absent.  Only absent keys are charged against
+   the capacity; one that clears or rotates the filter goes in again. */
+
+static int bloomfilter_add_if_absent(bloomfilter_t *bloomfilter, uint64_t hash, int atomic) {
+  int added = bloomfilter_test_insert(bloomfilter, hash, atomic);
+  if (added && bloomfilter_count(bloomfilter, atomic))
+    bloomfilter_insert(bloomfilter, hash, atomic);
+  stats_note_lookups(bloomfilter, 1, !added);
+  if (added)
+    stats_note(bloomfilter, STAT_ADDS, 1);
+  return added;
+}
+
+static PyObject *
+peloton_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(smbo->bf, item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_one(smbo->bf, hash, 0));
+}
+
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(smbo->bf, item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_one(smbo->bf, hash, 1));
+}
+
+static PyObject *
+peloton_bloomfilter_add_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(smbo->bf, item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_if_absent(smbo->bf, hash, 0));
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(smbo->bf, item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_if_absent(smbo->bf, hash, 1));
+}
+
+/* add_hash and contains_hash take a hash the caller computed, as one int
+   taken modulo 2**64, so that add_hash(hash(x)) matches add(x) for a
+   filter hashing with hash(). */
+
+static int bloomfilter_arg_hash(PyObject *obj, uint64_t *hash) {
+  *hash = PyLong_AsUnsignedLongLongMask(obj);
+  return *hash == (uint64_t)(-1) && PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *
+peloton_bloomfilter_add_hash(SharedMemoryBloomfilterObject *smbo, PyObject *obj) {
+  uint64_t hash;
+  if (bloomfilter_arg_hash(obj, &hash))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_one(smbo->bf, hash, 0));
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_hash(SharedMemoryBloomfilterObject *smbo, PyObject *obj) {
+  uint64_t hash;
+  if (bloomfilter_arg_hash(obj, &hash))
+    return NULL;
+  return PyBool_FromLong(bloomfilter_add_one(smbo->bf, hash, 1));
+}
+
+static PyObject *
+peloton_bloomfilter_contains_hash(SharedMemoryBloomfilterObject *smbo, PyObject *obj) {
+  uint64_t hash;
+  int found;
+  if (bloomfilter_arg_hash(obj, &hash))
+    return NULL;
+  found = bloomfilter_lookup(smbo->bf, hash);
+  stats_note_lookups(smbo->bf, 1, found);
+  return PyBool_FromLong(found);
+}
+
+static PyObject *
+bloomfilter_remove(SharedMemoryBloomfilterObject *smbo, PyObject *item, int atomic) {
+  bloomfilter_t *bloomfilter = smbo->bf;
+  uint64_t hash = bloomfilter_hash(bloomfilter, item);
+  int removed;
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  removed = counting_remove(bloomfilter, hash, atomic);
+  if (removed) {
+    if (atomic || FREE_THREADED)
+      __atomic_fetch_add(bloomfilter->counter, (uint64_t)1, __ATOMIC_RELAXED);
+    else
+      ++*bloomfilter->counter;
+  }
+  return PyBool_FromLong(removed);
+}
+
+static PyObject *
+peloton_counting_bloomfilter_remove(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  return bloomfilter_remove(smbo, item, 0);
+}
+
+static PyObject *
+peloton_shared_memory_counting_bloomfilter_remove(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  return bloomfilter_remove(smbo, item, 1);
+}
+
+/* Batches are charged against the capacity up front.  Keys counted before
+   a clear would have been wiped by it, so only the keys from the last clear
+   onward are inserted.  A rotation wipes nothing live, so rotating filters
+   insert the whole batch into the new generation. */
+
+static int
+bloomfilter_add_batch(bloomfilter_t *bloomfilter, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  Py_ssize_t i, start = 0;
+  int cleared = 0;
+
+  for (i=0; i<n; ++i) {
+    if (bloomfilter_count(bloomfilter, atomic)) {
+      cleared = 1;
+      if (!bloomfilter->epoch)
+        start = i;
+    }
+  }
+  if (atomic) {
+    Py_BEGIN_ALLOW_THREADS
+    bloomfilter_insert_many(bloomfilter, hashes + start, n - start, 1);
+    Py_END_ALLOW_THREADS
+  } else {
+    bloomfilter_insert_many(bloomfilter, hashes + start, n - start, 0);
+  }
+  stats_note(bloomfilter, STAT_ADDS, n);
+  return cleared;
+}
+
+static PyObject *
+bloomfilter_add_many(SharedMemoryBloomfilterObject *smbo, PyObject *iterable, int atomic) {
+  Py_ssize_t n;
+  int cleared;
+  uint64_t *hashes = bloomfilter_hash_items(smbo->bf, iterable, &n);
+  if (!hashes)
+    return NULL;
+
+  cleared = bloomfilter_add_batch(smbo->bf, hashes, n, atomic);
+  PyMem_Free(hashes);
+  return PyBool_FromLong(cleared);
+}
+
+static PyObject *
+peloton_bloomfilter_add_many(SharedMemoryBloomfilterObject *smbo, PyObject *iterable) {
+  return bloomfilter_add_many(smbo, iterable, 0);
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_many(SharedMemoryBloomfilterObject *smbo, PyObject *iterable) {
+  return bloomfilter_add_many(smbo, iterable, 1);
+}
+
+/* Batch lookups are shared by every filter type: `hasher` hashes the items
+   and `lookup_many` answers them with the GIL released. */
+
+typedef void (*lookup_many_fn)(PyObject *self, const uint64_t *hashes, Py_ssize_t n, char *out);
+
+static void plain_lookup_many(PyObject *self, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  bloomfilter_lookup_many(((SharedMemoryBloomfilterObject *)self)->bf, hashes, n, out);
+}
+
+// Counts the batch answered by lookup_many into the stats of a plain or counting filter
+
+static void stats_note_batch(PyObject *self, lookup_many_fn lookup_many, const char *out, Py_ssize_t n) {
+  Py_ssize_t i;
+  uint64_t positives = 0;
+  if (lookup_many != plain_lookup_many)
+    return;
+  for (i=0; i<n; ++i)
+    positives += out[i] != 0;
+  stats_note_lookups(((SharedMemoryBloomfilterObject *)self)->bf, n, positives);
+}
+
+// Returns one byte per item, 1 if the item may be present and 0 if not
+
+static PyObject *
+bloomfilter_contains_many(PyObject *self, bloomfilter_t *hasher, PyObject *iterable, lookup_many_fn lookup_many) {
+  Py_ssize_t n;
+  PyObject *result;
+  uint64_t *hashes = bloomfilter_hash_items(hasher, iterable, &n);
+  if (!hashes)
+    return NULL;
+
+  #ifdef IS_PY3K
+  result = PyBytes_FromStringAndSize(NULL, n);
+  #else
+  result = PyString_FromStringAndSize(NULL, n);
+  #endif
+  if (!result) {
+    PyMem_Free(hashes);
+    return NULL;
+  }
+  #ifdef IS_PY3K
+  char *out = PyBytes_AS_STRING(result);
+  #else
+  char *out = PyString_AS_STRING(result);
+  #endif
+  Py_BEGIN_ALLOW_THREADS
+  lookup_many(self, hashes, n, out);
+  Py_END_ALLOW_THREADS
+  stats_note_batch(self, lookup_many, out, n);
+  PyMem_Free(hashes);
+  return result;
+}
+
+static PyObject *
+peloton_bloomfilter_contains_many(SharedMemoryBloomfilterObject *smbo, PyObject *iterable) {
+  return bloomfilter_contains_many((PyObject *)smbo, smbo->bf, iterable, plain_lookup_many);
+}
+
+/* add_hashes and contains_hashes take precomputed 64 bit hashes from any
+   C contiguous buffer (array('Q'), numpy uint64, memoryview).  Each hash
+   goes through the same probe sequence as the value returned by
+   PyObject_Hash, so add_hashes([x]) matches add(x) for small ints. */
+
+static int bloomfilter_get_hashes(PyObject *obj, Py_buffer *view) {
+  const char *format;
+
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1)
+    return -1;
+  format = view->format ? view->format : "B";
+  if (*format == '@' || *format == '=' || *format == '<')
+    format++;
+  if (view->itemsize != sizeof(uint64_t) || !strchr("qQlLnN", *format) || format[1]) {
+    PyErr_SetString(PyExc_TypeError, "expected a contiguous buffer of 64 bit integers");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *
+bloomfilter_add_hashes(SharedMemoryBloomfilterObject *smbo, PyObject *buffer, int atomic) {
+  Py_buffer view;
+  int cleared;
+
+  if (bloomfilter_get_hashes(buffer, &view))
+    return NULL;
+  cleared = bloomfilter_add_batch(smbo->bf, view.buf, view.len / sizeof(uint64_t), atomic);
+  PyBuffer_Release(&view);
+  return PyBool_FromLong(cleared);
+}
+
+static PyObject *
+peloton_bloomfilter_add_hashes(SharedMemoryBloomfilterObject *smbo, PyObject *buffer) {
+  return bloomfilter_add_hashes(smbo, buffer, 0);
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_hashes(SharedMemoryBloomfilterObject *smbo, PyObject *buffer) {
+  return bloomfilter_add_hashes(smbo, buffer, 1);
+}
+
+/* Batched add_if_absent.  The keys are test-inserted with prefetching and,
+   for shared and thread safe filters, without the GIL; the absent ones are
+   then charged against the capacity.  If that clears the filter, the
+   absent keys from the clearing one onward go in again. */
+
+static void test_insert_many(bloomfilter_t *bf, const uint64_t *hashes, Py_ssize_t n, int atomic, char *out) {
+  bloomfilter_t view, *target = bf;
+  Py_ssize_t i;
+  if (bf->epoch) {
+    generation_view(bf, bloomfilter_epoch(bf), 0, &view);
+    target = &view;
+  }
+  for (i=0; i<n && i<PREFETCH_DISTANCE; ++i)
+    bloomfilter_prefetch(target, hashes[i], 1);
+  for (i=0; i<n; ++i) {
+    if (i + PREFETCH_DISTANCE < n)
+      bloomfilter_prefetch(target, hashes[i + PREFETCH_DISTANCE], 1);
+    out[i] = bloomfilter_test_insert(bf, hashes[i], atomic);
+  }
+}
+
+static PyObject *
+bloomfilter_add_batch_if_absent(bloomfilter_t *bloomfilter, const uint64_t *hashes, Py_ssize_t n, int atomic) {
+  Py_ssize_t i, start = n, added = 0;
+  PyObject *result;
+  char *out;
+
+  #ifdef IS_PY3K
+  result = PyBytes_FromStringAndSize(NULL, n);
+  #else
+  result = PyString_FromStringAndSize(NULL, n);
+  #endif
+  if (!result)
+    return NULL;
+  #ifdef IS_PY3K
+  out = PyBytes_AS_STRING(result);
+  #else
+  out = PyString_AS_STRING(result);
+  #endif
+  if (atomic) {
+    Py_BEGIN_ALLOW_THREADS
+    test_insert_many(bloomfilter, hashes, n, 1, out);
+    Py_END_ALLOW_THREADS
+  } else {
+    test_insert_many(bloomfilter, hashes, n, 0, out);
+  }
+  for (i=0; i<n; ++i) {
+    if (!out[i])
+      continue;
+    ++added;
+    if (bloomfilter_count(bloomfilter, atomic) && !bloomfilter->epoch)
+      start = i;
+  }
+  for (i=start; i<n; ++i)
+    if (out[i])
+      bloomfilter_insert(bloomfilter, hashes[i], atomic);
+  stats_note_lookups(bloomfilter, n, n - added);
+  stats_note(bloomfilter, STAT_ADDS, added);
+  return result;
+}
+
+static PyObject *
+bloomfilter_add_many_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *iterable, int atomic) {
+  Py_ssize_t n;
+  PyObject *result;
+  uint64_t *hashes = bloomfilter_hash_items(smbo->bf, iterable, &n);
+  if (!hashes)
+    return NULL;
+
+  result = bloomfilter_add_batch_if_absent(smbo->bf, hashes, n, atomic);
+  PyMem_Free(hashes);
+  return result;
+}
+
+static PyObject *
+peloton_bloomfilter_add_many_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *iterable) {
+  return bloomfilter_add_many_if_absent(smbo, iterable, 0);
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_many_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *iterable) {
+  return bloomfilter_add_many_if_absent(smbo, iterable, 1);
+}
+
+static PyObject *
+bloomfilter_add_hashes_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *buffer, int atomic) {
+  Py_buffer view;
+  PyObject *result;
+
+  if (bloomfilter_get_hashes(buffer, &view))
+    return NULL;
+  result = bloomfilter_add_batch_if_absent(smbo->bf, view.buf, view.len / sizeof(uint64_t), atomic);
+  PyBuffer_Release(&view);
+  return result;
+}
+
+static PyObject *
+peloton_bloomfilter_add_hashes_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *buffer) {
+  return bloomfilter_add_hashes_if_absent(smbo, buffer, 0);
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add_hashes_if_absent(SharedMemoryBloomfilterObject *smbo, PyObject *buffer) {
+  return bloomfilter_add_hashes_if_absent(smbo, buffer, 1);
+}
+
+/* Hot methods with keyword arguments take them as a vector where the
+   interpreter can pass one (3.7+), which saves a tuple and a dict per
+   call.  parse_fastcall() unpacks either calling convention into
+   `values`, leaving NULL for optional arguments that were not given. */
+
+#if defined(IS_PY3K) && PY_VERSION_HEX >= 0x03070000
+#define FASTCALL_PARAMS PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define FASTCALL_ARGS args, nargs, kwnames
+#define METH_FASTCALL_KEYWORDS (METH_FASTCALL | METH_KEYWORDS)
+
+static int parse_fastcall(FASTCALL_PARAMS, const char *name, char **kwlist, int required, PyObject **values) {
+  Py_ssize_t i, n, k;
+  PyObject *key;
+
+  for (n=0; kwlist[n]; ++n)
+    values[n] = NULL;
+  if (nargs > n) {
+    PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)", name, n, nargs);
+    return -1;
+  }
+  for (i=0; i<nargs; ++i)
+    values[i] = args[i];
+  for (i=0; kwnames && i<PyTuple_GET_SIZE(kwnames); ++i) {
+    key = PyTuple_GET_ITEM(kwnames, i);
+    for (k=0; k<n && PyUnicode_CompareWithASCIIString(key, kwlist[k]); ++k)
+      ;
+    if (k == n) {
+      PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", name, key);
+      return -1;
+    }
+    if (values[k]) {
+      PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", name, kwlist[k]);
+      return -1;
+    }
+    values[k] = args[nargs + i];
+  }
+  for (k=0; k<required; ++k) {
+    if (!values[k]) {
+      PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", name, kwlist[k]);
+      return -1;
+    }
+  }
+  return 0;
+}
+#else
+#define FASTCALL_PARAMS PyObject *args, PyObject *kwargs
+#define FASTCALL_ARGS args, kwargs
+#define METH_FASTCALL_KEYWORDS (METH_VARARGS | METH_KEYWORDS)
+
+static int parse_fastcall(FASTCALL_PARAMS, const char *name, char **kwlist, int required, PyObject **values) {
+  char format[32];
+  int n, k = 0;
+
+  for (n=0; kwlist[n]; ++n) {
+    values[n] = NULL;
+    if (n == required)
+      format[k++] = '|';
+    format[k++] = 'O';
+  }
+  sprintf(format + k, ":%s", name);
+  switch (n) {
+  case 1: return PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, values) ? 0 : -1;
+  case 2: return PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, values, values + 1) ? 0 : -1;
+  default: return PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, values, values + 1, values + 2) ? 0 : -1;
+  }
+}
+#endif
+
+// Writes one 0/1 byte per hash into `out`, or into a new bytes object
+
+static PyObject *
+bloomfilter_contains_hashes(PyObject *self, FASTCALL_PARAMS, lookup_many_fn lookup_many) {
+  static char *kwlist[] = {"hashes", "out", NULL};
+  PyObject *values[2];
+  PyObject *buffer;
+  PyObject *out;
+  PyObject *result;
+  Py_buffer view, out_view;
+  Py_ssize_t n;
+
+  if (parse_fastcall(FASTCALL_ARGS, "contains_hashes", kwlist, 1, values))
+    return NULL;
+  buffer = values[0];
+  out = values[1] ? values[1] : Py_None;
+  if (bloomfilter_get_hashes(buffer, &view))
+    return NULL;
+  n = view.len / sizeof(uint64_t);
+
+  if (out == Py_None) {
+    #ifdef IS_PY3K
+    result = PyBytes_FromStringAndSize(NULL, n);
+    #else
+    result = PyString_FromStringAndSize(NULL, n);
+    #endif
+    if (!result || PyObject_GetBuffer(result, &out_view, PyBUF_SIMPLE) == -1) {
+      Py_XDECREF(result);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+  } else {
+    if (PyObject_GetBuffer(out, &out_view, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) == -1) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+    if (out_view.itemsize != 1 || out_view.len != n) {
+      PyErr_SetString(PyExc_ValueError, "out must be a writable byte buffer with one element per hash");
+      PyBuffer_Release(&out_view);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+    Py_INCREF(out);
+    result = out;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  lookup_many(self, view.buf, n, out_view.buf);
+  Py_END_ALLOW_THREADS
+  stats_note_batch(self, lookup_many, out_view.buf, n);
+  PyBuffer_Release(&out_view);
+  PyBuffer_Release(&view);
+  return result;
+}
+
+static PyObject *
+peloton_bloomfilter_contains_hashes(SharedMemoryBloomfilterObject *smbo, FASTCALL_PARAMS) {
+  return bloomfilter_contains_hashes((PyObject *)smbo, FASTCALL_ARGS, plain_lookup_many);
+}
+
+/* Popcounts of large filters are split over up to `threads` threads,
+   each taking at least POPCOUNT_MIN_WORDS words, so that small filters
+   are not slowed down by starting threads. */
+
+#define MAX_POPCOUNT_THREADS 64
+#define POPCOUNT_MIN_WORDS ((size_t)1 << 20)
+
+typedef struct {
+  const uint64_t *a;
+  const uint64_t *b;
+  size_t n;
+  int op;
+  uint64_t count;
+} popcount_job_t;
+
+static void *popcount_job(void *arg) {
+  popcount_job_t *job = arg;
+  job->count = bloomfilter_kernel->popcount_words(job->a, job->b, job->n, job->op);
+  return NULL;
+}
+
+static uint64_t popcount_words(const uint64_t *a, const uint64_t *b, size_t n, int op, int threads) {
+  popcount_job_t jobs[MAX_POPCOUNT_THREADS];
+  pthread_t ids[MAX_POPCOUNT_THREADS];
+  int started[MAX_POPCOUNT_THREADS];
+  uint64_t count = 0;
+  size_t chunk, done;
+  int t;
+
+  if ((size_t)threads > n / POPCOUNT_MIN_WORDS)
+    threads = n / POPCOUNT_MIN_WORDS;
+  if (threads > MAX_POPCOUNT_THREADS)
+    threads = MAX_POPCOUNT_THREADS;
+  if (threads <= 1)
+    return bloomfilter_kernel->popcount_words(a, b, n, op);
+  chunk = round_up((n + threads - 1) / threads, BLOCK_WORDS);
+  for (t=0, done=0; t<threads; ++t, done+=chunk) {
+    jobs[t].a = a + done;
+    jobs[t].b = b ? b + done : NULL;
+    jobs[t].n = done < n ? (n - done < chunk ? n - done : chunk) : 0;
+    jobs[t].op = op;
+  }
+  // The first slice is counted here, and so is any slice whose thread could not start
+  for (t=1; t<threads; ++t)
+    started[t] = !pthread_create(ids + t, NULL, popcount_job, jobs + t);
+  popcount_job(jobs);
+  for (t=0; t<threads; ++t) {
+    if (t && started[t])
+      pthread_join(ids[t], NULL);
+    else if (t)
+      popcount_job(jobs + t);
+    count += jobs[t].count;
+  }
+  return count;
+}
+
+// Rotating filters count the bits of every live generation, counting filters their nonzero counters
+
+static uint64_t
+bloomfilter_population(bloomfilter_t *bf, int threads) {
+  int age;
+  uint64_t epoch = bf->epoch ? bloomfilter_epoch(bf) : 0;
+  uint64_t population = 0;
+  if (bf->counter_bits)
+    return counting_population(bf);
+  for (age=0; age<bf->generations; ++age)
+    population += popcount_words(bf->epoch ? generation_bits(bf, epoch, age) : bf->bits, NULL, bf->length, MERGE_OR, threads);
+  return population;
+}
+
+static int parse_threads(PyObject *args, PyObject *kwargs, const char *format, char **kwlist, PyObject **other, int *threads) {
+  *threads = 1;
+  if (!(other ? PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, other, threads)
+              : PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, threads)))
+    return -1;
+  if (*threads < 1) {
+    PyErr_SetString(PyExc_ValueError, "threads must be positive");
+    return -1;
+  }
+  return 0;
+}
+
+PyObject *
+peloton_bloomfilter_population(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"threads", NULL};
+  uint64_t population;
+  int threads;
+  if (parse_threads(args, kwargs, "|i", kwlist, NULL, &threads))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  population = bloomfilter_population(smbo->bf, threads);
+  Py_END_ALLOW_THREADS
+  #ifdef IS_PY3K
+  return PyLong_FromLong(population);
+  #else
+  return PyInt_FromLong(population);
+  #endif
+}
+
+/* stats() reports the counters, with those of every process for a shared
+   filter, next to estimates from the current popcount: a fill ratio X over
+   m cells gives about -m / (k * b) * ln(1 - X) keys per generation when
+   each of the k probes sets b bits, and an absent key tests present in one
+   generation with probability p^k, p being the chance that a probe passes.
+   Chained scatter probes OR scatter_mask, a single bit or one time in 32
+   a run of 33, so they set two bits on average and pass when any of their
+   bits is set. */
+
+static int chained_scatter(const bloomfilter_t *bf) {
+  return bf->layout == LAYOUT_SCATTER && bf->probing == PROBE_CHAIN && !bf->counter_bits;
+}
+
+static double probe_pass(const bloomfilter_t *bf, double fill) {
+  if (chained_scatter(bf))
+    return (31 * fill + 1 - pow(1 - fill, 33)) / 32;
+  return fill;
+}
+
+static double bloomfilter_cells(const bloomfilter_t *bf) {
+  return bf->counter_bits ? (double)bf->length * 64 / bf->counter_bits : (double)bf->length * 64;
+}
+
+static double bloomfilter_cardinality(const bloomfilter_t *bf, uint64_t population) {
+  double cells = bloomfilter_cells(bf);
+  double fill = population / (cells * bf->generations);
+  return fill < 1 ? -cells / (bf->probes * (chained_scatter(bf) ? 2 : 1)) * log(1 - fill) * bf->generations : INFINITY;
+}
+
+static PyObject *
+peloton_bloomfilter_estimate_cardinality(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"threads", NULL};
+  uint64_t population;
+  int threads;
+  if (parse_threads(args, kwargs, "|i", kwlist, NULL, &threads))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  population = bloomfilter_population(smbo->bf, threads);
+  Py_END_ALLOW_THREADS
+  return PyFloat_FromDouble(bloomfilter_cardinality(smbo->bf, population));
+}
+
+static PyObject *
+peloton_bloomfilter_stats(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  static const char *names[STAT_COUNT] = {"adds", "lookups", "positives", "clears", "rotations", NULL};
+  bloomfilter_t *bf = smbo->bf;
+  uint64_t counts[STAT_COUNT];
+  uint64_t population;
+  double fill;
+  PyObject *stats, *value;
+  int stat;
+
+  stats_flush(bf);
+  for (stat=0; stat<STAT_COUNT; ++stat)
+    counts[stat] = bf->shared_stats ? __atomic_load_n(bf->shared_stats + stat * STATS_STRIDE, __ATOMIC_RELAXED)
+                                    : __atomic_load_n(bf->stats + stat, __ATOMIC_RELAXED);
+  Py_BEGIN_ALLOW_THREADS
+  population = bloomfilter_population(bf, 1);
+  Py_END_ALLOW_THREADS
+  fill = population / (bloomfilter_cells(bf) * bf->generations);
+
+  if (!(stats = PyDict_New()))
+    return NULL;
+  for (stat=0; stat<STAT_COUNT; ++stat) {
+    if (!names[stat])
+      continue;
+    if (!(value = PyLong_FromUnsignedLongLong(counts[stat])) || PyDict_SetItemString(stats, names[stat], value))
+      goto error;
+    Py_DECREF(value);
+  }
+  if (!(value = PyFloat_FromDouble(counts[STAT_CLEAR_NS] / 1e9)) || PyDict_SetItemString(stats, "clear_seconds", value))
+    goto error;
+  Py_DECREF(value);
+  if (!(value = PyFloat_FromDouble(fill)) || PyDict_SetItemString(stats, "fill_ratio", value))
+    goto error;
+  Py_DECREF(value);
+  if (!(value = PyFloat_FromDouble(1 - pow(1 - pow(probe_pass(bf, fill), bf->probes), bf->generations))) ||
+      PyDict_SetItemString(stats, "estimated_fpr", value))
+    goto error;
+  Py_DECREF(value);
+  if (!(value = PyFloat_FromDouble(bloomfilter_cardinality(bf, population))) ||
+      PyDict_SetItemString(stats, "estimated_cardinality", value))
+    goto error;
+  Py_DECREF(value);
+  return stats;
+
+ error:
+  Py_XDECREF(value);
+  Py_DECREF(stats);
+  return NULL;
+}
+
+static Py_ssize_t
+BloomFilterObject_len(SharedMemoryBloomfilterObject* smbo)
+{
+    return smbo->bf->capacity - __atomic_load_n(smbo->bf->counter, __ATOMIC_RELAXED);
+}
+
+int 
+BloomFilterObject_contains(SharedMemoryBloomfilterObject* smbo, PyObject *item)
+{
+  uint64_t hash = bloomfilter_hash(smbo->bf, item);
+  int found;
+  if (hash == (uint64_t)(-1)) {
+    return -1;
+  }
+  found = bloomfilter_lookup(smbo->bf, hash);
+  stats_note_lookups(smbo->bf, 1, found);
+  return found;
+}
+
+
+static PySequenceMethods SharedMemoryBloomfilterObject_sequence_methods = {
+  BloomFilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)BloomFilterObject_contains,	/* sq_contains */
+};
+
+
+/* Set algebra.  Filters with the same geometry combine word by word: the
+   union answers for the keys of either filter, the intersection for the
+   keys of both (plus the false positives they share).  Counting and
+   rotating filters keep more than one bit per position and are refused. */
+
+extern PyTypeObject SharedMemoryBloomfilterType;
+extern PyTypeObject ThreadSafeBloomfilterType;
+extern PyTypeObject BloomfilterType;
+
+PyObject *
+make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate, const bloomfilter_options_t *options);
+
+static int is_plain_filter(PyObject *obj) {
+  return Py_TYPE(obj) == &BloomfilterType || Py_TYPE(obj) == &ThreadSafeBloomfilterType ||
+    Py_TYPE(obj) == &SharedMemoryBloomfilterType;
+}
+
+static int bloomfilter_compatible(const bloomfilter_t *a, const bloomfilter_t *b) {
+  return a->length == b->length && a->probes == b->probes && a->layout == b->layout &&
+    a->hash == b->hash && a->seed == b->seed && a->probing == b->probing && a->sizing == b->sizing &&
+    a->generations == 1 && b->generations == 1 && !a->counter_bits && !b->counter_bits;
+}
+
+static int check_compatible(const bloomfilter_t *a, const bloomfilter_t *b) {
+  if (!bloomfilter_compatible(a, b)) {
+    PyErr_SetString(PyExc_ValueError, "filters differ in length, probes, layout or hashing");
+    return -1;
+  }
+  return 0;
+}
+
+// Keys held, as len() counts them
+
+static uint64_t bloomfilter_used(const bloomfilter_t *bf) {
+  uint64_t counter = __atomic_load_n(bf->counter, __ATOMIC_RELAXED);
+  return counter > bf->capacity ? bf->capacity : bf->capacity - counter;
+}
+
+// A union holds the keys of both filters, an intersection at most those of the smaller
+
+static void merge_count(bloomfilter_t *bf, uint64_t used, uint64_t other_used, int op) {
+  if (op == MERGE_OR)
+    used += other_used;
+  else if (other_used < used)
+    used = other_used;
+  if (used > bf->capacity)
+    used = bf->capacity;
+  __atomic_store_n(bf->counter, bf->capacity - used, __ATOMIC_RELAXED);
+}
+
+static void bloomfilter_merge(bloomfilter_t *bf, const bloomfilter_t *other, int op, int atomic) {
+  uint64_t used = bloomfilter_used(bf);
+  bloomfilter_kernel->merge_words(bf->bits, other->bits, bf->length, op, atomic);
+  mark_dirty_range(bf, bf->bits, bf->length);
+  merge_count(bf, used, bloomfilter_used(other), op);
+}
+
+/* Merge the filter stored at path into bf.  The file is streamed through
+   a buffer that stays in cache rather than mapped or loaded into Python.
+   Returns 0, -1 with errno set, or -2 when the geometries differ. */
+static int merge_shared_file(bloomfilter_t *bf, const char *path, int op, int atomic) {
+  const size_t chunk_words = HUGE_PAGE_SIZE / sizeof(uint64_t);
+  bloomfilter_t other;
+  struct stat stats;
+  uint64_t *buffer = NULL;
+  uint64_t counter = 0;
+  uint64_t used = bloomfilter_used(bf);
+  size_t bits_offset, counter_offset, stats_offset, done, chunk;
+  ssize_t got;
+  int fd, saved_errno;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(fd, &stats))
+    goto error;
+  if (-1 == read_shared_header(fd, &stats, &other, &bits_offset, &counter_offset, &stats_offset))
+    goto error;
+  if (!bloomfilter_compatible(bf, &other)) {
+    close(fd);
+    return -2;
+  }
+  if (pread(fd, &counter, sizeof(counter), counter_offset) != sizeof(counter))
+    goto error;
+  other.counter = &counter;
+  if (!(buffer = malloc(chunk_words * sizeof(uint64_t))))
+    goto error;
+  for (done = 0; done < bf->length; done += chunk) {
+    chunk = bf->length - done < chunk_words ? bf->length - done : chunk_words;
+    if ((got = pread(fd, buffer, chunk * sizeof(uint64_t), bits_offset + done * sizeof(uint64_t))) == -1)
+      goto error;
+    // Short legacy files end in zero words
+    memset((char *)buffer + got, 0, chunk * sizeof(uint64_t) - got);
+    bloomfilter_kernel->merge_words(bf->bits + done, buffer, chunk, op, atomic);
+  }
+  mark_dirty_range(bf, bf->bits, bf->length);
+  merge_count(bf, used, bloomfilter_used(&other), op);
+  free(buffer);
+  close(fd);
+  return 0;
+
+ error:
+  saved_errno = errno;
+  free(buffer);
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+// Private and thread safe filters combine into their own type, shared ones into a private filter
+
+static PyObject *
+peloton_bloomfilter_combine(PyObject *a, PyObject *b, int op) {
+  bloomfilter_t *bf, *other, *result_bf;
+  PyTypeObject *type;
+  PyObject *result;
+
+  if (!is_plain_filter(a) || !is_plain_filter(b)) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+  }
+  bf = ((SharedMemoryBloomfilterObject *)a)->bf;
+  other = ((SharedMemoryBloomfilterObject *)b)->bf;
+  if (check_compatible(bf, other))
+    return NULL;
+  type = Py_TYPE(a) == &SharedMemoryBloomfilterType ? &BloomfilterType : Py_TYPE(a);
+
+  bloomfilter_options_t options = {
+    .layout = bf->layout,
+    .hash = bf->hash,
+    .seed = bf->seed,
+    .probing = bf->probing,
+    .sizing = bf->sizing,
+    .generations = 1,
+  };
+  if (!(result = make_new_peloton_bloomfilter(type, 0, bf->capacity, bf->error_rate, &options)))
+    return PyErr_Occurred() ? NULL : PyErr_NoMemory();
+  result_bf = ((SharedMemoryBloomfilterObject *)result)->bf;
+  if (result_bf->length != bf->length) {
+    Py_DECREF(result);
+    PyErr_SetString(PyExc_ValueError, "filter geometry does not match its capacity and error_rate");
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  memcpy(result_bf->bits, bf->bits, bf->length * sizeof(uint64_t));
+  bloomfilter_kernel->merge_words(result_bf->bits, other->bits, bf->length, op, 0);
+  merge_count(result_bf, bloomfilter_used(bf), bloomfilter_used(other), op);
+  Py_END_ALLOW_THREADS
+  return result;
+}
+
+// Shared and thread safe targets merge atomically, so other writers keep their bits
+
+static PyObject *
+peloton_bloomfilter_combine_inplace(PyObject *a, PyObject *b, int op) {
+  bloomfilter_t *bf, *other;
+  int atomic = Py_TYPE(a) != &BloomfilterType;
+
+  if (!is_plain_filter(a) || !is_plain_filter(b)) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+  }
+  bf = ((SharedMemoryBloomfilterObject *)a)->bf;
+  other = ((SharedMemoryBloomfilterObject *)b)->bf;
+  if (check_compatible(bf, other))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  bloomfilter_merge(bf, other, op, atomic);
+  Py_END_ALLOW_THREADS
+  Py_INCREF(a);
+  return a;
+}
+
+static PyObject *peloton_bloomfilter_or(PyObject *a, PyObject *b) {
+  return peloton_bloomfilter_combine(a, b, MERGE_OR);
+}
+
+static PyObject *peloton_bloomfilter_and(PyObject *a, PyObject *b) {
+  return peloton_bloomfilter_combine(a, b, MERGE_AND);
+}
+
+static PyObject *peloton_bloomfilter_inplace_or(PyObject *a, PyObject *b) {
+  return peloton_bloomfilter_combine_inplace(a, b, MERGE_OR);
+}
+
+static PyObject *peloton_bloomfilter_inplace_and(PyObject *a, PyObject *b) {
+  return peloton_bloomfilter_combine_inplace(a, b, MERGE_AND);
+}
+
+// merge() is |= that also takes the path of a shared filter file
+
+static PyObject *
+peloton_bloomfilter_merge(SharedMemoryBloomfilterObject *smbo, PyObject *other) {
+  PyObject *result;
+  const char *path;
+  int merged;
+
+  if (is_plain_filter(other)) {
+    if (!(result = peloton_bloomfilter_inplace_or((PyObject *)smbo, other)))
+      return NULL;
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+  }
+  if (!PyArg_Parse(other, "s", &path)) {
+    PyErr_SetString(PyExc_TypeError, "merge() takes a bloomfilter or the path of a shared one");
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  merged = merge_shared_file(smbo->bf, path, MERGE_OR, Py_TYPE(smbo) != &BloomfilterType);
+  Py_END_ALLOW_THREADS
+  if (merged == -2) {
+    PyErr_SetString(PyExc_ValueError, "filters differ in length, probes, layout or hashing");
+    return NULL;
+  }
+  if (merged == -1)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  Py_RETURN_NONE;
+}
+
+/* The union of two compatible filters holds the bits of a|b, so its size
+   is estimated from that popcount without building it; the intersection
+   follows by inclusion-exclusion, as does the Jaccard index |A&B|/|A|B|.
+   The bits of a&b would overestimate the intersection, since a bit set by
+   one key of each filter counts as shared. */
+
+static int union_estimates(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs,
+                           double *a, double *b, double *both) {
+  static char *kwlist[] = {"other", "threads", NULL};
+  bloomfilter_t *bf = smbo->bf, *other_bf;
+  uint64_t pop_a, pop_b, pop_both;
+  PyObject *other;
+  int threads;
+
+  if (parse_threads(args, kwargs, "O|i", kwlist, &other, &threads))
+    return -1;
+  if (!is_plain_filter(other)) {
+    PyErr_SetString(PyExc_TypeError, "expected a BloomFilter, ThreadSafeBloomFilter or SharedMemoryBloomFilter");
+    return -1;
+  }
+  other_bf = ((SharedMemoryBloomfilterObject *)other)->bf;
+  if (check_compatible(bf, other_bf))
+    return -1;
+  Py_BEGIN_ALLOW_THREADS
+  pop_a = bloomfilter_population(bf, threads);
+  pop_b = bloomfilter_population(other_bf, threads);
+  pop_both = popcount_words(bf->bits, other_bf->bits, bf->length, MERGE_OR, threads);
+  Py_END_ALLOW_THREADS
+  *a = bloomfilter_cardinality(bf, pop_a);
+  *b = bloomfilter_cardinality(other_bf, pop_b);
+  *both = bloomfilter_cardinality(bf, pop_both);
+  return 0;
+}
+
+static PyObject *
+peloton_bloomfilter_estimate_union_size(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  double a, b, both;
+  if (union_estimates(smbo, args, kwargs, &a, &b, &both))
+    return NULL;
+  return PyFloat_FromDouble(both);
+}
+
+static PyObject *
+peloton_bloomfilter_estimate_jaccard(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  double a, b, both, common;
+  if (union_estimates(smbo, args, kwargs, &a, &b, &both))
+    return NULL;
+  // Two empty filters are taken as equal, saturated ones give nan
+  if (both == 0)
+    return PyFloat_FromDouble(1.0);
+  common = a + b - both;
+  if (common < 0)
+    common = 0;
+  return PyFloat_FromDouble(common > both ? 1.0 : common / both);
+}
+
+static PyNumberMethods peloton_bloomfilter_number_methods = {
+  .nb_and = peloton_bloomfilter_and,
+  .nb_or = peloton_bloomfilter_or,
+  .nb_inplace_and = peloton_bloomfilter_inplace_and,
+  .nb_inplace_or = peloton_bloomfilter_inplace_or,
+};
+
+
+/* Serialization.  A serialized filter is a version 2 header followed
+   directly by the bits, so to_bytes() and from_bytes() are one copy of
+   the bits each.  Private filters pickle as their bytes; shared ones
+   pickle as their file, which the unpickling process maps again. */
+
+extern PyTypeObject SharedMemoryCountingBloomfilterType;
+extern PyTypeObject CountingBloomfilterType;
+
+static PyObject *
+peloton_bloomfilter_to_bytes(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  bloomfilter_t *bf = smbo->bf;
+  shared_header_v2_t header;
+  PyObject *result;
+  char *data;
+
+  if (bf->generations > 1) {
+    PyErr_SetString(PyExc_ValueError, "rotating filters cannot be serialized");
+    return NULL;
+  }
+  init_shared_header(&header, bf, __atomic_load_n(bf->counter, __ATOMIC_RELAXED));
+  header.bits_offset = sizeof(header);
+  header.stats_offset = 0;
+  #ifdef IS_PY3K
+  if (!(result = PyBytes_FromStringAndSize(NULL, sizeof(header) + bf->length * sizeof(uint64_t))))
+    return NULL;
+  data = PyBytes_AS_STRING(result);
+  #else
+  if (!(result = PyString_FromStringAndSize(NULL, sizeof(header) + bf->length * sizeof(uint64_t))))
+    return NULL;
+  data = PyString_AS_STRING(result);
+  #endif
+  memcpy(data, &header, sizeof(header));
+  Py_BEGIN_ALLOW_THREADS
+  memcpy(data + sizeof(header), bf->bits, bf->length * sizeof(uint64_t));
+  Py_END_ALLOW_THREADS
+  return result;
+}
+
+// A private filter of the given type, from any buffer to_bytes() or a shared filter file wrote
+
+static PyObject *
+peloton_bloomfilter_from_bytes(PyTypeObject *type, PyObject *data) {
+  bloomfilter_t geometry;
+  bloomfilter_t *bf;
+  size_t bits_offset, counter_offset, stats_offset;
+  Py_buffer view;
+  PyObject *obj;
+
+  if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) == -1)
+    return NULL;
+  if (-1 == parse_shared_header(view.buf, view.len, view.len, &geometry, &bits_offset, &counter_offset, &stats_offset) ||
+      geometry.generations > 1 || !geometry.counter_bits != (type != &CountingBloomfilterType) ||
+      (size_t)view.len < bits_offset + geometry.length * sizeof(uint64_t)) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "not a serialized filter of this type");
+    return NULL;
+  }
+
+  bloomfilter_options_t options = {
+    .layout = geometry.layout,
+    .hash = geometry.hash,
+    .seed = geometry.seed,
+    .probing = geometry.probing,
+    .sizing = geometry.sizing,
+    .generations = 1,
+    .counter_bits = geometry.counter_bits,
+  };
+  if (!(obj = make_new_peloton_bloomfilter(type, 0, geometry.capacity, geometry.error_rate, &options))) {
+    PyBuffer_Release(&view);
+    if (PyErr_Occurred())
+      return NULL;
+    return errno == ENOMEM ? PyErr_NoMemory() : PyErr_SetFromErrno(PyExc_OSError);
+  }
+  bf = ((SharedMemoryBloomfilterObject *)obj)->bf;
+  if (bf->length != geometry.length || bf->probes != geometry.probes) {
+    PyBuffer_Release(&view);
+    Py_DECREF(obj);
+    PyErr_SetString(PyExc_ValueError, "filter geometry does not match its capacity and error_rate");
+    return NULL;
+  }
+  memcpy(bf->counter, (char *)view.buf + counter_offset, sizeof(uint64_t));
+  Py_BEGIN_ALLOW_THREADS
+  memcpy(bf->bits, (char *)view.buf + bits_offset, bf->length * sizeof(uint64_t));
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return obj;
+}
+
+static PyObject *
+peloton_bloomfilter_reduce(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  bloomfilter_t *bf = smbo->bf;
+  PyObject *from_bytes, *data;
+
+  if (smbo->path && Py_TYPE(smbo) == &SharedMemoryCountingBloomfilterType)
+    return Py_BuildValue("O(OKdiiK)", Py_TYPE(smbo), smbo->path, (unsigned long long)bf->capacity, bf->error_rate,
+                         bf->counter_bits, bf->hash == HASH_STABLE, (unsigned long long)bf->seed);
+  if (smbo->path)
+    return Py_BuildValue("O(OKdiiKiiiiii)", Py_TYPE(smbo), smbo->path, (unsigned long long)bf->capacity, bf->error_rate,
+                         bf->layout == LAYOUT_BLOCKED, bf->hash == HASH_STABLE, (unsigned long long)bf->seed,
+                         bf->probing == PROBE_DOUBLE, bf->sizing == SIZING_POW2, 0, 0, 0, bf->generations);
+  if (!(from_bytes = PyObject_GetAttrString((PyObject *)Py_TYPE(smbo), "from_bytes")))
+    return NULL;
+  if (!(data = peloton_bloomfilter_to_bytes(smbo, NULL))) {
+    Py_DECREF(from_bytes);
+    return NULL;
+  }
+  return Py_BuildValue("N(N)", from_bytes, data);
+}
+
+/* Compressed transport.  Lightly filled filters are mostly zero words,
+   so export_compressed() writes the positions of the set bits in
+   Elias-Fano coding whenever that is smaller than the raw words: the low
+   `low_bits` bits of each position packed side by side, the rest in
+   unary as one set bit at (position >> low_bits) + i in a second bit
+   vector.  That is about 2 + log2(bit_count / population) bits per set
+   bit, against 64 / fill for the raw words.  import_compressed() ORs the
+   decoded positions straight into the bits of an existing filter. */
+
+#define COMPRESSED_RAW 0
+#define COMPRESSED_ELIAS_FANO 1
+#define COMPRESSED_RETRIES 3
+
+const char COMPRESSED_MAGIC[8] = "PBFZ v1";
+
+typedef struct {
+  char magic[8];
+  uint64_t encoding;
+  uint64_t bit_count;
+  uint64_t probes;
+  uint64_t layout;
+  uint64_t hash;
+  uint64_t seed;
+  uint64_t probing;
+  uint64_t sizing;
+  uint64_t used;
+  uint64_t population; // positions coded, Elias-Fano only
+  uint64_t low_bits;
+} compressed_header_t;
+
+static int elias_fano_low_bits(uint64_t universe, uint64_t n) {
+  uint64_t ratio = universe / (n ? n : 1);
+  return ratio ? 63 - __builtin_clzll(ratio) : 0;
+}
+
+static void elias_fano_words(uint64_t universe, uint64_t n, int low_bits, size_t *low_words, size_t *high_words) {
+  *low_words = (n * low_bits + 63) / 64;
+  *high_words = (n + (universe >> low_bits) + 1 + 63) / 64;
+}
+
+static inline void put_bits(uint64_t *words, uint64_t offset, uint64_t value, int width) {
+  if (!width)
+    return;
+  value &= ~(uint64_t)0 >> (64 - width);
+  words[offset >> 6] |= value << (offset & 63);
+  if ((offset & 63) + width > 64)
+    words[(offset >> 6) + 1] |= value >> (64 - (offset & 63));
+}
+
+static inline uint64_t get_bits(const uint64_t *words, uint64_t offset, int width) {
+  uint64_t value;
+  if (!width)
+    return 0;
+  value = words[offset >> 6] >> (offset & 63);
+  if ((offset & 63) + width > 64)
+    value |= words[(offset >> 6) + 1] << (64 - (offset & 63));
+  return value & (~(uint64_t)0 >> (64 - width));
+}
+
+/* Codes the first n set bits into the zeroed low and high arrays.  Returns
+   the number of set bits found, which differs from n when a writer set or
+   cleared bits after they were counted. */
+static uint64_t elias_fano_encode(const uint64_t *bits, size_t length, uint64_t n, int low_bits, uint64_t *low, uint64_t *high) {
+  uint64_t i = 0;
+  uint64_t position, word, high_position;
+  size_t w;
+  for (w=0; w<length; ++w) {
+    for (word = bits[w]; word; word &= word - 1) {
+      if (i == n)
+        return n + 1;
+      position = w * 64 + __builtin_ctzll(word);
+      put_bits(low, i * low_bits, position, low_bits);
+      high_position = (position >> low_bits) + i;
+      high[high_position >> 6] |= (uint64_t)1 << (high_position & 63);
+      ++i;
+    }
+  }
+  return i;
+}
+
+static inline void or_word(uint64_t *word, uint64_t bits, int atomic) {
+  if (atomic)
+    merge_word_atomic(word, bits, MERGE_OR);
+  else
+    *word |= bits;
+}
+
+// Sets the coded positions in bits, a word at a time.  -1 when the coding is corrupt.
+
+static int elias_fano_decode(uint64_t *bits, uint64_t universe, uint64_t n, int low_bits,
+                             const uint64_t *low, const uint64_t *high, size_t high_words, int atomic) {
+  uint64_t i = 0;
+  uint64_t position, word, pending = 0;
+  size_t w, current = 0;
+  for (w=0; w<high_words; ++w) {
+    for (word = high[w]; word; word &= word - 1) {
+      if (i == n)
+        return -1;
+      position = ((w * 64 + __builtin_ctzll(word) - i) << low_bits) | get_bits(low, i * low_bits, low_bits);
+      if (position >= universe)
+        return -1;
+      if (position >> 6 != current) {
+        if (pending)
+          or_word(bits + current, pending, atomic);
+        current = position >> 6;
+        pending = 0;
+      }
+      pending |= (uint64_t)1 << (position & 63);
+      ++i;
+    }
+  }
+  if (pending)
+    or_word(bits + current, pending, atomic);
+  return i == n ? 0 : -1;
+}
+
+static PyObject *
+peloton_bloomfilter_export_compressed(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  bloomfilter_t *bf = smbo->bf;
+  compressed_header_t header;
+  size_t low_words = 0, high_words = 0;
+  uint64_t universe = bf->length * 64;
+  uint64_t found = 0;
+  PyObject *result = NULL;
+  uint64_t *words;
+  char *data;
+  int retries;
+
+  if (bf->generations > 1) {
+    PyErr_SetString(PyExc_ValueError, "rotating filters cannot be compressed");
+    return NULL;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+  header.bit_count = universe;
+  header.probes = bf->probes;
+  header.layout = bf->layout;
+  header.hash = bf->hash;
+  header.seed = bf->seed;
+  header.probing = bf->probing;
+  header.sizing = bf->sizing;
+  header.used = bloomfilter_used(bf);
+
+  // Concurrent writers can change the population between counting and coding, then it is counted again
+  for (retries = 0; retries < COMPRESSED_RETRIES; ++retries) {
+    Py_BEGIN_ALLOW_THREADS
+    header.population = bloomfilter_population(bf, 1);
+    Py_END_ALLOW_THREADS
+    header.low_bits = elias_fano_low_bits(universe, header.population);
+    elias_fano_words(universe, header.population, header.low_bits, &low_words, &high_words);
+    if (low_words + high_words >= bf->length)
+      break;
+    header.encoding = COMPRESSED_ELIAS_FANO;
+    #ifdef IS_PY3K
+    if (!(result = PyBytes_FromStringAndSize(NULL, sizeof(header) + (low_words + high_words) * sizeof(uint64_t))))
+      return NULL;
+    data = PyBytes_AS_STRING(result);
+    #else
+    if (!(result = PyString_FromStringAndSize(NULL, sizeof(header) + (low_words + high_words) * sizeof(uint64_t))))
+      return NULL;
+    data = PyString_AS_STRING(result);
+    #endif
+    memcpy(data, &header, sizeof(header));
+    words = (uint64_t *)(data + sizeof(header));
+    Py_BEGIN_ALLOW_THREADS
+    memset(words, 0, (low_words + high_words) * sizeof(uint64_t));
+    found = elias_fano_encode(bf->bits, bf->length, header.population, header.low_bits, words, words + low_words);
+    Py_END_ALLOW_THREADS
+    if (found == header.population)
+      return result;
+    Py_CLEAR(result);
+  }
+
+  header.encoding = COMPRESSED_RAW;
+  header.population = 0;
+  header.low_bits = 0;
+  #ifdef IS_PY3K
+  if (!(result = PyBytes_FromStringAndSize(NULL, sizeof(header) + bf->length * sizeof(uint64_t))))
+    return NULL;
+  data = PyBytes_AS_STRING(result);
+  #else
+  if (!(result = PyString_FromStringAndSize(NULL, sizeof(header) + bf->length * sizeof(uint64_t))))
+    return NULL;
+  data = PyString_AS_STRING(result);
+  #endif
+  memcpy(data, &header, sizeof(header));
+  Py_BEGIN_ALLOW_THREADS
+  memcpy(data + sizeof(header), bf->bits, bf->length * sizeof(uint64_t));
+  Py_END_ALLOW_THREADS
+  return result;
+}
+
+static PyObject *
+peloton_bloomfilter_import_compressed(SharedMemoryBloomfilterObject *smbo, PyObject *data) {
+  bloomfilter_t *bf = smbo->bf;
+  bloomfilter_t other;
+  compressed_header_t header;
+  size_t low_words = 0, high_words = 0, words;
+  uint64_t *payload, *copy = NULL;
+  Py_buffer view;
+  int atomic = Py_TYPE(smbo) != &BloomfilterType;
+  int corrupt = 0;
+
+  if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) == -1)
+    return NULL;
+  if ((size_t)view.len < sizeof(header))
+    goto invalid;
+  memcpy(&header, view.buf, sizeof(header));
+  if (memcmp(header.magic, COMPRESSED_MAGIC, sizeof(header.magic)))
+    goto invalid;
+  memset(&other, 0, sizeof(other));
+  other.length = header.bit_count / 64;
+  other.probes = header.probes;
+  other.layout = header.layout;
+  other.hash = header.hash;
+  other.seed = header.seed;
+  other.probing = header.probing;
+  other.sizing = header.sizing;
+  other.generations = 1;
+  if (header.bit_count % 64 || check_compatible(bf, &other)) {
+    PyBuffer_Release(&view);
+    if (!PyErr_Occurred())
+      PyErr_SetString(PyExc_ValueError, "filters differ in length, probes, layout or hashing");
+    return NULL;
+  }
+  if (header.encoding == COMPRESSED_RAW) {
+    words = bf->length;
+  } else if (header.encoding == COMPRESSED_ELIAS_FANO) {
+    if (header.population > header.bit_count || header.low_bits > 63)
+      goto invalid;
+    elias_fano_words(header.bit_count, header.population, header.low_bits, &low_words, &high_words);
+    words = low_words + high_words;
+  } else {
+    goto invalid;
+  }
+  if ((size_t)view.len != sizeof(header) + words * sizeof(uint64_t))
+    goto invalid;
+  payload = (uint64_t *)((char *)view.buf + sizeof(header));
+  if ((uintptr_t)payload % sizeof(uint64_t)) {
+    if (!(copy = malloc(words * sizeof(uint64_t)))) {
+      PyBuffer_Release(&view);
+      return PyErr_NoMemory();
+    }
+    memcpy(copy, payload, words * sizeof(uint64_t));
+    payload = copy;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  if (header.encoding == COMPRESSED_RAW)
+    bloomfilter_kernel->merge_words(bf->bits, payload, bf->length, MERGE_OR, atomic);
+  else
+    corrupt = elias_fano_decode(bf->bits, header.bit_count, header.population, header.low_bits,
+                                payload, payload + low_words, high_words, atomic);
+  mark_dirty_range(bf, bf->bits, bf->length);
+  Py_END_ALLOW_THREADS
+  free(copy);
+  PyBuffer_Release(&view);
+  // A corrupt coding can only have set bits, so nothing added before is lost
+  if (corrupt) {
+    PyErr_SetString(PyExc_ValueError, "corrupt compressed filter");
+    return NULL;
+  }
+  merge_count(bf, bloomfilter_used(bf), header.used, MERGE_OR);
+  Py_RETURN_NONE;
+
+ invalid:
+  PyBuffer_Release(&view);
+  PyErr_SetString(PyExc_ValueError, "not a compressed filter");
+  return NULL;
+}
+
+/* Snapshots and flushes.  snapshot(path) copies a shared filter to a new
+   file and renames it over path, so the copy appears whole or not at all.
+   Bits are only ever set between clears and rotations, so a copy taken
+   while others add holds every key added before it started; one that a
+   clear or rotation overlapped is taken again, up to SNAPSHOT_RETRIES
+   times.  flush() then brings the last snapshot up to date in place,
+   writing only the pages changed since when the filter tracks them, or
+   syncs the filter's own file when there is no snapshot.  Either runs on
+   a thread of its own that never takes the GIL. */
+
+#define SNAPSHOT_RETRIES 3
+
+struct checkpoint {
+  bloomfilter_t *bf;
+  char *path;      // the last snapshot, which flush() updates; NULL to sync the filter's own file
+  char *target;    // the snapshot being taken, NULL for a flush
+  int incremental;
+  int running;
+  pthread_t thread;
+  int error;       // errno of the last job, 0 when it succeeded
+  uint64_t pages;  // pages the last job wrote
+  uint64_t taken;  // the take of the page marks that the snapshot, or the file, is up to date with
+  struct stat snapshot; // device and inode of the snapshot at path
+};
+
+static int pwrite_all(int fd, const void *data, size_t size, off_t offset) {
+  ssize_t written;
+  while (size) {
+    if ((written = pwrite(fd, data, size, offset)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data = (const char *)data + written;
+    size -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+static size_t bits_offset(const bloomfilter_t *bf) {
+  return (char *)bf->bits - (char *)bf->mmap;
+}
+
+// The header and stats, and the page bitmap and stamps, which a copy leaves zero
+
+static size_t header_size(const bloomfilter_t *bf) {
+  return bf->dirty_offset ? bf->dirty_offset : bits_offset(bf);
+}
+
+/* Clears the page marks into the stamps, under the file lock so that
+   takes from every handle are numbered in order.  The pages stamped
+   after `since` go into `taken` when given.  Returns the take's number. */
+
+static uint64_t take_dirty(bloomfilter_t *bf, uint64_t since, uint64_t *taken) {
+  shared_header_v2_t *header = bf->mmap;
+  uint64_t *stamps = page_stamps(bf);
+  uint64_t sequence, word, page;
+  size_t i;
+
+  flock(bf->fd, LOCK_EX);
+  sequence = ++header->flushes;
+  for (i=0; i<dirty_words(bf); ++i) {
+    word = __atomic_load_n(bf->dirty + i, __ATOMIC_RELAXED);
+    if (word)
+      word = __atomic_exchange_n(bf->dirty + i, 0, __ATOMIC_SEQ_CST);
+    for (; word; word &= word - 1)
+      stamps[i * 64 + __builtin_ctzll(word)] = sequence;
+  }
+  if (taken) {
+    memset(taken, 0, dirty_words(bf) * sizeof(uint64_t));
+    for (page=0; page<tracked_pages(bf); ++page)
+      if (stamps[page] > since)
+        taken[page / 64] |= (uint64_t)1 << (page % 64);
+  }
+  flock(bf->fd, LOCK_UN);
+  return sequence;
+}
+
+// Without `taken` every page that holds a bit is written, the others are left to the sparse file
+
+static int page_selected(const bloomfilter_t *bf, const uint64_t *taken, uint64_t page) {
+  const uint64_t *words = bf->bits + page * SHARED_PAGE_WORDS;
+  uint64_t n = bloomfilter_words(bf) - page * SHARED_PAGE_WORDS;
+  uint64_t any = 0;
+  uint64_t i;
+  if (taken)
+    return (taken[page / 64] >> (page % 64)) & 1;
+  if (n > SHARED_PAGE_WORDS)
+    n = SHARED_PAGE_WORDS;
+  for (i=0; i<n; ++i)
+    any |= words[i];
+  return any != 0;
+}
+
+/* The next run of selected pages from *page on, as a byte range of the
+   bits.  Returns 0 past the last one. */
+static int next_run(const bloomfilter_t *bf, const uint64_t *taken, uint64_t *page, size_t *start, size_t *size) {
+  uint64_t pages = tracked_pages(bf);
+  uint64_t end;
+  while (*page < pages && !page_selected(bf, taken, *page))
+    ++*page;
+  if (*page == pages)
+    return 0;
+  for (end = *page + 1; end < pages && page_selected(bf, taken, end); ++end)
+    ;
+  *start = *page * SHARED_PAGE_SIZE;
+  *size = (end == pages ? bloomfilter_words(bf) * sizeof(uint64_t) : end * SHARED_PAGE_SIZE) - *start;
+  *page = end;
+  return 1;
+}
+
+// The header goes last, so its counter and epoch are no older than the pages
+
+static int write_pages(int fd, const bloomfilter_t *bf, const uint64_t *taken, uint64_t *pages) {
+  uint64_t page = 0;
+  size_t start, size;
+  *pages = 0;
+  while (next_run(bf, taken, &page, &start, &size)) {
+    if (pwrite_all(fd, (char *)bf->bits + start, size, bits_offset(bf) + start))
+      return -1;
+    *pages += (size + SHARED_PAGE_SIZE - 1) / SHARED_PAGE_SIZE;
+  }
+  return pwrite_all(fd, bf->mmap, header_size(bf), 0);
+}
+
+// Clears and rotations so far, which a snapshot must not overlap
+
+static uint64_t bloomfilter_resets(const bloomfilter_t *bf) {
+  uint64_t resets = bf->epoch ? __atomic_load_n(bf->epoch, __ATOMIC_ACQUIRE) : 0;
+  if (bf->shared_stats)
+    resets += __atomic_load_n(bf->shared_stats + STAT_CLEARS * STATS_STRIDE, __ATOMIC_ACQUIRE);
+  return resets;
+}
+
+// The file written is identified in *written, for flushes to recognize it by
+
+static int write_snapshot(bloomfilter_t *bf, const char *path, uint64_t *taken, struct stat *written, uint64_t *pages) {
+  size_t size = bits_offset(bf) + bloomfilter_words(bf) * sizeof(uint64_t);
+  struct stat own, stats;
+  char *tmp_path = NULL;
+  uint64_t resets;
+  int fd = -1;
+  int retries;
+  int saved_errno;
+
+  if (fstat(bf->fd, &own))
+    return -1;
+  // Renamed over its own file, the filter would go on in a file nobody can open
+  if (!stat(path, &stats) && stats.st_dev == own.st_dev && stats.st_ino == own.st_ino) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((fd = open_temporary(path, ".snapshot", own.st_mode & 07777, &tmp_path)) == -1)
+    goto error;
+  for (retries = 0; retries < SNAPSHOT_RETRIES; ++retries) {
+    resets = bloomfilter_resets(bf);
+    if (ftruncate(fd, 0) || ftruncate(fd, size))
+      goto error;
+    if (bf->dirty)
+      *taken = take_dirty(bf, 0, NULL);
+    if (write_pages(fd, bf, NULL, pages))
+      goto error;
+    if (bloomfilter_resets(bf) == resets)
+      break;
+  }
+  if (fsync(fd) || fstat(fd, written) || rename(tmp_path, path))
+    goto error;
+  close(fd);
+  free(tmp_path);
+  return 0;
+
+ error:
+  saved_errno = errno;
+  if (fd != -1) {
+    close(fd);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  errno = saved_errno;
+  return -1;
+}
+
+/* Rewrite the pages of the snapshot at path stamped since the take
+   *taken, then moves *taken on to this one.  Cut short, it still holds
+   every key of the previous snapshot outside the generations that rotated
+   since.  A snapshot that is gone or was replaced by another file, even
+   one of the same size, is taken anew. */
+static int update_snapshot(bloomfilter_t *bf, const char *path, uint64_t *taken, struct stat *snapshot, uint64_t *pages) {
+  size_t size = bits_offset(bf) + bloomfilter_words(bf) * sizeof(uint64_t);
+  struct stat stats;
+  uint64_t *selected;
+  int fd, result, saved_errno;
+
+  if ((fd = open(path, O_WRONLY)) == -1)
+    return errno == ENOENT ? write_snapshot(bf, path, taken, snapshot, pages) : -1;
+  if (fstat(fd, &stats) || stats.st_dev != snapshot->st_dev || stats.st_ino != snapshot->st_ino ||
+      (size_t)stats.st_size != size) {
+    close(fd);
+    return write_snapshot(bf, path, taken, snapshot, pages);
+  }
+  if (!(selected = malloc(dirty_words(bf) * sizeof(uint64_t)))) {
+    close(fd);
+    return -1;
+  }
+  *taken = take_dirty(bf, *taken, selected);
+  result = write_pages(fd, bf, selected, pages) || fsync(fd) ? -1 : 0;
+  saved_errno = errno;
+  free(selected);
+  close(fd);
+  errno = saved_errno;
+  return result;
+}
+
+// msync works on whole system pages, which may be larger than SHARED_PAGE_SIZE
+
+static int sync_pages(bloomfilter_t *bf, int incremental, uint64_t *taken, uint64_t *pages) {
+  size_t system_page = sysconf(_SC_PAGESIZE);
+  uint64_t *selected;
+  uint64_t page = 0;
+  size_t start, size, skew;
+  int result = 0;
+  int saved_errno;
+
+  if (!incremental || !bf->dirty) {
+    if (bf->dirty)
+      *taken = take_dirty(bf, 0, NULL);
+    *pages = tracked_pages(bf);
+    return msync(bf->mmap, bf->mmap_size, MS_SYNC);
+  }
+  if (!(selected = malloc(dirty_words(bf) * sizeof(uint64_t))))
+    return -1;
+  *taken = take_dirty(bf, *taken, selected);
+  *pages = 0;
+  while (!result && next_run(bf, selected, &page, &start, &size)) {
+    skew = (bits_offset(bf) + start) % system_page;
+    result = msync((char *)bf->bits + start - skew, size + skew, MS_SYNC);
+    *pages += (size + SHARED_PAGE_SIZE - 1) / SHARED_PAGE_SIZE;
+  }
+  if (!result)
+    result = msync(bf->mmap, header_size(bf), MS_SYNC);
+  saved_errno = errno;
+  free(selected);
+  errno = saved_errno;
+  return result;
+}
+
+static void *checkpoint_job(void *arg) {
+  checkpoint_t *cp = arg;
+  bloomfilter_t *bf = cp->bf;
+  uint64_t taken = cp->taken;
+  struct stat snapshot = cp->snapshot;
+  int result;
+
+  if (cp->target)
+    result = write_snapshot(bf, cp->target, &taken, &snapshot, &cp->pages);
+  else if (cp->path && cp->incremental && bf->dirty)
+    result = update_snapshot(bf, cp->path, &taken, &snapshot, &cp->pages);
+  else if (cp->path)
+    result = write_snapshot(bf, cp->path, &taken, &snapshot, &cp->pages);
+  else
+    result = sync_pages(bf, cp->incremental, &taken, &cp->pages);
+  cp->error = result ? errno : 0;
+  // A job that failed leaves its pages to the next one, which selects them again
+  if (result)
+    return NULL;
+  cp->taken = taken;
+  cp->snapshot = snapshot;
+  if (cp->target) {
+    free(cp->path);
+    cp->path = cp->target;
+    cp->target = NULL;
+  }
+  return NULL;
+}
+
+static int checkpoint_join(checkpoint_t *cp) {
+  if (cp->running) {
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(cp->thread, NULL);
+    Py_END_ALLOW_THREADS
+    cp->running = 0;
+  }
+  return cp->error;
+}
+
+// A job left running by wait=False reports its failure to the next call
+
+static PyObject *checkpoint_error(SharedMemoryBloomfilterObject *smbo) {
+  checkpoint_t *cp = smbo->checkpoint;
+  errno = cp->error;
+  cp->error = 0;
+  if (cp->target) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, cp->target);
+    free(cp->target);
+    cp->target = NULL;
+    return NULL;
+  }
+  if (cp->path)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, cp->path);
+  return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, smbo->path);
+}
+
+// Snapshots to target, or flushes when it is NULL, once the previous job is done
+
+static PyObject *checkpoint_run(SharedMemoryBloomfilterObject *smbo, const char *target, int incremental, int wait) {
+  checkpoint_t *cp = smbo->checkpoint;
+
+  if (!cp) {
+    if (!(cp = smbo->checkpoint = calloc(1, sizeof(checkpoint_t))))
+      return PyErr_NoMemory();
+    cp->bf = smbo->bf;
+  }
+  if (checkpoint_join(cp))
+    return checkpoint_error(smbo);
+  if (target && !(cp->target = strdup(target)))
+    return PyErr_NoMemory();
+  cp->incremental = incremental;
+  // The header copied carries this process's counts too
+  stats_flush(smbo->bf);
+  if ((cp->error = pthread_create(&cp->thread, NULL, checkpoint_job, cp)))
+    return checkpoint_error(smbo);
+  cp->running = 1;
+  if (!wait)
+    Py_RETURN_NONE;
+  if (checkpoint_join(cp))
+    return checkpoint_error(smbo);
+  return PyLong_FromUnsignedLongLong(cp->pages);
+}
+
+static void checkpoint_free(checkpoint_t *cp) {
+  if (!cp)
+    return;
+  checkpoint_join(cp);
+  free(cp->path);
+  free(cp->target);
+  free(cp);
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_snapshot(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"path", "wait", NULL};
+  char *path;
+  int wait = 1;
+  PyObject *result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|i", kwlist, &path, &wait))
+    return NULL;
+  Py_BEGIN_CRITICAL_SECTION(smbo);
+  result = checkpoint_run(smbo, path, 0, wait);
+  Py_END_CRITICAL_SECTION();
+  return result;
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_flush(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"incremental", "wait", NULL};
+  int incremental = 1;
+  int wait = 1;
+  PyObject *result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &incremental, &wait))
+    return NULL;
+  Py_BEGIN_CRITICAL_SECTION(smbo);
+  result = checkpoint_run(smbo, NULL, incremental, wait);
+  Py_END_CRITICAL_SECTION();
+  return result;
+}
+
+// The bits, writable only for consumers that ask for a writable buffer
+
+static int
+peloton_bloomfilter_getbuffer(SharedMemoryBloomfilterObject *smbo, Py_buffer *view, int flags) {
+  bloomfilter_t *bf = smbo->bf;
+  return PyBuffer_FillInfo(view, (PyObject *)smbo, bf->bits, bloomfilter_words(bf) * sizeof(uint64_t),
+                           !(flags & PyBUF_WRITABLE), flags);
+}
+
+// Writes through a buffer are not seen page by page, so releasing a writable one marks them all
+
+static void
+peloton_bloomfilter_releasebuffer(SharedMemoryBloomfilterObject *smbo, Py_buffer *view) {
+  if (!view->readonly)
+    mark_dirty_range(smbo->bf, smbo->bf->bits, bloomfilter_words(smbo->bf));
+}
+
+static PyBufferProcs peloton_bloomfilter_buffer_procs = {
+  .bf_getbuffer = (getbufferproc)peloton_bloomfilter_getbuffer,
+  .bf_releasebuffer = (releasebufferproc)peloton_bloomfilter_releasebuffer,
+};
+
+
+static PyMethodDef peloton_shared_memory_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_shared_memory_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes, METH_O, NULL},
+  {"add_hash", (PyCFunction)peloton_shared_memory_bloomfilter_add_hash, METH_O, NULL},
+  {"add_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_if_absent, METH_O, NULL},
+  {"add_many_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_many_if_absent, METH_O, NULL},
+  {"add_hashes_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes_if_absent, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_hash", (PyCFunction)peloton_bloomfilter_contains_hash, METH_O, NULL},
+  {"contains_many", (PyCFunction)peloton_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"stats", (PyCFunction)peloton_bloomfilter_stats, METH_NOARGS, NULL},
+  {"estimate_cardinality", (PyCFunction)peloton_bloomfilter_estimate_cardinality, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"to_bytes", (PyCFunction)peloton_bloomfilter_to_bytes, METH_NOARGS, NULL},
+  {"from_bytes", (PyCFunction)peloton_bloomfilter_from_bytes, METH_O | METH_CLASS, NULL},
+  {"export_compressed", (PyCFunction)peloton_bloomfilter_export_compressed, METH_NOARGS, NULL},
+  {"import_compressed", (PyCFunction)peloton_bloomfilter_import_compressed, METH_O, NULL},
+  {"__reduce__", (PyCFunction)peloton_bloomfilter_reduce, METH_NOARGS, NULL},
+  {"merge", (PyCFunction)peloton_bloomfilter_merge, METH_O, NULL},
+  {"estimate_union_size", (PyCFunction)peloton_bloomfilter_estimate_union_size, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"estimate_jaccard", (PyCFunction)peloton_bloomfilter_estimate_jaccard, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"snapshot", (PyCFunction)peloton_shared_memory_bloomfilter_snapshot, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"flush", (PyCFunction)peloton_shared_memory_bloomfilter_flush, METH_VARARGS | METH_KEYWORDS, NULL},
+  {NULL, NULL}
+};
+
+// Atomic adds like a shared filter, but there is no file to snapshot or flush
+
+static PyMethodDef peloton_thread_safe_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_shared_memory_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes, METH_O, NULL},
+  {"add_hash", (PyCFunction)peloton_shared_memory_bloomfilter_add_hash, METH_O, NULL},
+  {"add_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_if_absent, METH_O, NULL},
+  {"add_many_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_many_if_absent, METH_O, NULL},
+  {"add_hashes_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes_if_absent, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_hash", (PyCFunction)peloton_bloomfilter_contains_hash, METH_O, NULL},
+  {"contains_many", (PyCFunction)peloton_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"stats", (PyCFunction)peloton_bloomfilter_stats, METH_NOARGS, NULL},
+  {"estimate_cardinality", (PyCFunction)peloton_bloomfilter_estimate_cardinality, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"to_bytes", (PyCFunction)peloton_bloomfilter_to_bytes, METH_NOARGS, NULL},
+  {"from_bytes", (PyCFunction)peloton_bloomfilter_from_bytes, METH_O | METH_CLASS, NULL},
+  {"export_compressed", (PyCFunction)peloton_bloomfilter_export_compressed, METH_NOARGS, NULL},
+  {"import_compressed", (PyCFunction)peloton_bloomfilter_import_compressed, METH_O, NULL},
+  {"__reduce__", (PyCFunction)peloton_bloomfilter_reduce, METH_NOARGS, NULL},
+  {"merge", (PyCFunction)peloton_bloomfilter_merge, METH_O, NULL},
+  {"estimate_union_size", (PyCFunction)peloton_bloomfilter_estimate_union_size, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"estimate_jaccard", (PyCFunction)peloton_bloomfilter_estimate_jaccard, METH_VARARGS | METH_KEYWORDS, NULL},
+  {NULL, NULL}
+};
+
+static PyMethodDef peloton_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_bloomfilter_add_hashes, METH_O, NULL},
+  {"add_hash", (PyCFunction)peloton_bloomfilter_add_hash, METH_O, NULL},
+  {"add_if_absent", (PyCFunction)peloton_bloomfilter_add_if_absent, METH_O, NULL},
+  {"add_many_if_absent", (PyCFunction)peloton_bloomfilter_add_many_if_absent, METH_O, NULL},
+  {"add_hashes_if_absent", (PyCFunction)peloton_bloomfilter_add_hashes_if_absent, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_hash", (PyCFunction)peloton_bloomfilter_contains_hash, METH_O, NULL},
+  {"contains_many", (PyCFunction)peloton_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"stats", (PyCFunction)peloton_bloomfilter_stats, METH_NOARGS, NULL},
+  {"estimate_cardinality", (PyCFunction)peloton_bloomfilter_estimate_cardinality, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"to_bytes", (PyCFunction)peloton_bloomfilter_to_bytes, METH_NOARGS, NULL},
+  {"from_bytes", (PyCFunction)peloton_bloomfilter_from_bytes, METH_O | METH_CLASS, NULL},
+  {"export_compressed", (PyCFunction)peloton_bloomfilter_export_compressed, METH_NOARGS, NULL},
+  {"import_compressed", (PyCFunction)peloton_bloomfilter_import_compressed, METH_O, NULL},
+  {"__reduce__", (PyCFunction)peloton_bloomfilter_reduce, METH_NOARGS, NULL},
+  {"merge", (PyCFunction)peloton_bloomfilter_merge, METH_O, NULL},
+  {"estimate_union_size", (PyCFunction)peloton_bloomfilter_estimate_union_size, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"estimate_jaccard", (PyCFunction)peloton_bloomfilter_estimate_jaccard, METH_VARARGS | METH_KEYWORDS, NULL},
+  {NULL, NULL}
+};
+
+static PyMethodDef peloton_counting_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_bloomfilter_add_hashes, METH_O, NULL},
+  {"add_hash", (PyCFunction)peloton_bloomfilter_add_hash, METH_O, NULL},
+  {"add_if_absent", (PyCFunction)peloton_bloomfilter_add_if_absent, METH_O, NULL},
+  {"add_many_if_absent", (PyCFunction)peloton_bloomfilter_add_many_if_absent, METH_O, NULL},
+  {"add_hashes_if_absent", (PyCFunction)peloton_bloomfilter_add_hashes_if_absent, METH_O, NULL},
+  {"remove", (PyCFunction)peloton_counting_bloomfilter_remove, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_hash", (PyCFunction)peloton_bloomfilter_contains_hash, METH_O, NULL},
+  {"contains_many", (PyCFunction)peloton_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"stats", (PyCFunction)peloton_bloomfilter_stats, METH_NOARGS, NULL},
+  {"estimate_cardinality", (PyCFunction)peloton_bloomfilter_estimate_cardinality, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"to_bytes", (PyCFunction)peloton_bloomfilter_to_bytes, METH_NOARGS, NULL},
+  {"from_bytes", (PyCFunction)peloton_bloomfilter_from_bytes, METH_O | METH_CLASS, NULL},
+  {"__reduce__", (PyCFunction)peloton_bloomfilter_reduce, METH_NOARGS, NULL},
+  {NULL, NULL}
+};
+
+static PyMethodDef peloton_shared_memory_counting_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_shared_memory_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes, METH_O, NULL},
+  {"add_hash", (PyCFunction)peloton_shared_memory_bloomfilter_add_hash, METH_O, NULL},
+  {"add_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_if_absent, METH_O, NULL},
+  {"add_many_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_many_if_absent, METH_O, NULL},
+  {"add_hashes_if_absent", (PyCFunction)peloton_shared_memory_bloomfilter_add_hashes_if_absent, METH_O, NULL},
+  {"remove", (PyCFunction)peloton_shared_memory_counting_bloomfilter_remove, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_hash", (PyCFunction)peloton_bloomfilter_contains_hash, METH_O, NULL},
+  {"contains_many", (PyCFunction)peloton_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"stats", (PyCFunction)peloton_bloomfilter_stats, METH_NOARGS, NULL},
+  {"estimate_cardinality", (PyCFunction)peloton_bloomfilter_estimate_cardinality, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"to_bytes", (PyCFunction)peloton_bloomfilter_to_bytes, METH_NOARGS, NULL},
+  {"__reduce__", (PyCFunction)peloton_bloomfilter_reduce, METH_NOARGS, NULL},
+  {NULL, NULL}
+};
+
+static void peloton_bloomfilter_type_dealloc(SharedMemoryBloomfilterObject *smbo) {
+  Py_TRASHCAN_SAFE_BEGIN(smbo);
+  peloton_bloomfilter_destroy(smbo->bf);
+  Py_TYPE(smbo)->tp_free((PyObject *)smbo);
+  Py_TRASHCAN_SAFE_END(smbo);
+}
+
+static void peloton_shared_memory_bloomfilter_type_dealloc(SharedMemoryBloomfilterObject *smbo) {
+  Py_TRASHCAN_SAFE_BEGIN(smbo);
+  checkpoint_free(smbo->checkpoint);
+  stats_flush(smbo->bf);
+  peloton_shared_memory_bloomfilter_destroy(smbo->bf);
+  Py_XDECREF(smbo->path);
+  Py_TYPE(smbo)->tp_free((PyObject *)smbo);
+  Py_TRASHCAN_SAFE_END(smbo);
+}
+
+PyObject *
+make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate, const bloomfilter_options_t *options);
+
+
+static int 
+peloton_bloomfilter_init(SharedMemoryBloomfilterObject *self, PyObject *args, PyObject *kwargs) {
+  return 0;
+}
+
+
+static PyObject *
+peloton_bloomfilter_compute_unsigned_magic_info
+(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"divisor", "number_of_bits", NULL};
+  uint64_t divisor;
+  uint64_t number_of_bits;
+  PyArg_ParseTupleAndKeywords
+    (args, 
+     kwargs,
+     "ll",
+     kwlist,
+     &divisor,
+     &number_of_bits);
+
+  struct magicu_info magic = compute_unsigned_magic_info(divisor, number_of_bits);
+
+  PyObject *retval = PyTuple_New(4);
+  if (!retval)
+    return NULL;
+  #ifdef IS_PY3K
+  PyObject *multiplier = PyLong_FromSize_t(magic.multiplier);
+  #else
+  PyObject *multiplier = PyInt_FromSize_t(magic.multiplier);
+  #endif
+  if (!multiplier)
+    return NULL;
+  #ifdef IS_PY3K
+  PyObject *pre_shift = PyLong_FromLong(magic.pre_shift);
+  #else
+  PyObject *pre_shift = PyInt_FromLong(magic.pre_shift);
+  #endif
+  if (!pre_shift)
+    return NULL;
+  #ifdef IS_PY3K
+  PyObject *post_shift = PyLong_FromLong(magic.post_shift);
+  #else
+  PyObject *post_shift = PyInt_FromLong(magic.post_shift);
+  #endif
+  if (!post_shift)
+    return NULL;
+  PyObject *increment = PyBool_FromLong(magic.increment);
+  if (!increment)
+    return NULL;
+
+  PyTuple_SET_ITEM(retval, 0, multiplier);
+  PyTuple_SET_ITEM(retval, 1, pre_shift);
+  PyTuple_SET_ITEM(retval, 2, post_shift);
+  PyTuple_SET_ITEM(retval, 3, increment);
+
+  return retval;
+}
+
+
+// Shared filters remember their file, to pickle as it
+
+static PyObject *set_filter_path(PyObject *smbo, const char *path) {
+  #ifdef IS_PY3K
+  ((SharedMemoryBloomfilterObject *)smbo)->path = PyUnicode_DecodeFSDefault(path);
+  #else
+  ((SharedMemoryBloomfilterObject *)smbo)->path = PyString_FromString(path);
+  #endif
+  if (!((SharedMemoryBloomfilterObject *)smbo)->path) {
+    Py_DECREF(smbo);
+    return NULL;
+  }
+  return smbo;
+}
+
+static PyObject *
+peloton_shared_memory_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+
+  int fd = 0;
+  char *path = NULL;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  int blocked = 0;
+  int stable_hash = 1;
+  unsigned long long seed = 0;
+  int double_hashing = 0;
+  int power_of_two = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+  int generations = 1;
+  double window = 0;
+  int track_pages = 0;
+  static char *kwlist[] = {"file", "capacity", "error_rate", "blocked", "stable_hash", "seed", "double_hashing", "power_of_two",
+                           "huge_pages", "populate", "lock", "generations", "window", "track_pages", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "s|ldiiKiiiiiidi",
+				   kwlist,
+				   &path,
+				   &capacity,
+				   &error_rate,
+				   &blocked,
+				   &stable_hash,
+				   &seed,
+				   &double_hashing,
+				   &power_of_two,
+				   &huge_pages,
+				   &populate,
+				   &lock,
+				   &generations,
+				   &window,
+				   &track_pages))
+    return NULL;
+
+  // Checked before the conversion to nanoseconds, which is undefined out of range
+  if (!isfinite(window) || window < 0) {
+    PyErr_SetString(PyExc_ValueError, "window must be at least a nanosecond");
+    return NULL;
+  }
+  if (window * 1e9 >= 18446744073709551616.0) {
+    PyErr_SetString(PyExc_ValueError, "window must be under 2**64 nanoseconds");
+    return NULL;
+  }
+
+  bloomfilter_options_t options = {
+    .layout = blocked ? LAYOUT_BLOCKED : LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = double_hashing ? PROBE_DOUBLE : PROBE_CHAIN,
+    .sizing = power_of_two ? SIZING_POW2 : SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = generations,
+    .window_ns = (uint64_t)(window * 1e9),
+    .track_pages = track_pages,
+  };
+
+  if (bloomfilter_probes(error_rate) == -1) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
+  }
+  if (generations < 1 || generations > MAX_GENERATIONS) {
+    PyErr_Format(PyExc_ValueError, "generations must be between 1 and %d", MAX_GENERATIONS);
+    return NULL;
+  }
+  if (window > 0 && !options.window_ns) {
+    PyErr_SetString(PyExc_ValueError, "window must be at least a nanosecond");
+    return NULL;
+  }
+  if (options.window_ns && generations < 2) {
+    PyErr_SetString(PyExc_ValueError, "an expiring filter needs at least 2 generations");
+    return NULL;
+  }
+
+  fd = open(path, O_CREAT|O_RDWR, ~0);
+  if (fd == -1) {
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  }
+  PyObject *smbo = make_new_peloton_bloomfilter(type, fd, capacity, error_rate, &options);
+  if (!smbo)
+    {
+    close(fd);
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    }
+  return set_filter_path(smbo, path);
+}
+
+static PyObject *
+peloton_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"capacity", "error_rate", "blocked", "stable_hash", "seed", "double_hashing", "power_of_two",
+                           "huge_pages", "populate", "lock", NULL};
+
+  uint64_t capacity;
+  double error_rate;
+  int blocked = 0;
+  int stable_hash = 0;
+  unsigned long long seed = 0;
+  int double_hashing = 0;
+  int power_of_two = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "ld|iiKiiiii",
+				   kwlist,
+				   &capacity,
+				   &error_rate,
+				   &blocked,
+				   &stable_hash,
+				   &seed,
+				   &double_hashing,
+				   &power_of_two,
+				   &huge_pages,
+				   &populate,
+				   &lock))
+    return NULL;
+
+  bloomfilter_options_t options = {
+    .layout = blocked ? LAYOUT_BLOCKED : LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = double_hashing ? PROBE_DOUBLE : PROBE_CHAIN,
+    .sizing = power_of_two ? SIZING_POW2 : SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = 1,
+  };
+  if (bloomfilter_probes(error_rate) == -1) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
+  }
+  PyObject *obj = make_new_peloton_bloomfilter(type, 0, capacity, error_rate, &options);
+  if (!obj && !PyErr_Occurred()) {
+    if (errno == ENOMEM)
+      PyErr_NoMemory();
+    else
+      PyErr_SetFromErrno(PyExc_OSError);
+  }
+  return obj;
+}
+
+/* Counting filters always probe by double hashing over an exactly sized
+   array, so they take no layout, probing or sizing arguments. */
+
+static int check_counter_bits(int counter_bits) {
+  if (counter_bits != 4 && counter_bits != 8) {
+    PyErr_SetString(PyExc_ValueError, "counter_bits must be 4 or 8");
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *
+peloton_shared_memory_counting_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"file", "capacity", "error_rate", "counter_bits", "stable_hash", "seed",
+                           "huge_pages", "populate", "lock", NULL};
+  int fd = 0;
+  char *path = NULL;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  int counter_bits = 4;
+  int stable_hash = 1;
+  unsigned long long seed = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "s|ldiiKiii",
+				   kwlist,
+				   &path,
+				   &capacity,
+				   &error_rate,
+				   &counter_bits,
+				   &stable_hash,
+				   &seed,
+				   &huge_pages,
+				   &populate,
+				   &lock))
+    return NULL;
+
+  bloomfilter_options_t options = {
+    .layout = LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = PROBE_DOUBLE,
+    .sizing = SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = 1,
+    .counter_bits = counter_bits,
+  };
+
+  if (bloomfilter_probes(error_rate) == -1) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
+  }
+  if (check_counter_bits(counter_bits))
+    return NULL;
+
+  fd = open(path, O_CREAT|O_RDWR, 0666);
+  if (fd == -1) {
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  }
+  PyObject *smbo = make_new_peloton_bloomfilter(type, fd, capacity, error_rate, &options);
+  if (!smbo)
+    {
+    close(fd);
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    }
+  return set_filter_path(smbo, path);
+}
+
+static PyObject *
+peloton_counting_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"capacity", "error_rate", "counter_bits", "stable_hash", "seed",
+                           "huge_pages", "populate", "lock", NULL};
+  uint64_t capacity;
+  double error_rate;
+  int counter_bits = 4;
+  int stable_hash = 0;
+  unsigned long long seed = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "ld|iiKiii",
+				   kwlist,
+				   &capacity,
+				   &error_rate,
+				   &counter_bits,
+				   &stable_hash,
+				   &seed,
+				   &huge_pages,
+				   &populate,
+				   &lock))
+    return NULL;
+
+  bloomfilter_options_t options = {
+    .layout = LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = PROBE_DOUBLE,
+    .sizing = SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = 1,
+    .counter_bits = counter_bits,
+  };
+  if (bloomfilter_probes(error_rate) == -1) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
+  }
+  if (check_counter_bits(counter_bits))
+    return NULL;
+  PyObject *obj = make_new_peloton_bloomfilter(type, 0, capacity, error_rate, &options);
+  if (!obj && !PyErr_Occurred()) {
+    if (errno == ENOMEM)
+      PyErr_NoMemory();
+    else
+      PyErr_SetFromErrno(PyExc_OSError);
+  }
+  return obj;
+}
+
+PyTypeObject SharedMemoryBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "peloton_bloomfilters.SharedMemoryBloomFilter", /* tp_name */
+  sizeof(SharedMemoryBloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_shared_memory_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  &peloton_bloomfilter_number_methods, /* tp_as_number */
+  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  &peloton_bloomfilter_buffer_procs, /* tp_as_buffer */
+  TPFLAGS,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_shared_memory_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0, /* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc)peloton_bloomfilter_init,		/* tp_init */
+  PyType_GenericAlloc,		/* tp_alloc */
+  peloton_shared_memory_bloomfilter_new,			/* tp_new */
+  0, 
+};
+
+PyTypeObject ThreadSafeBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "peloton_bloomfilters.ThreadSafeBloomFilter", /* tp_name */
+  sizeof(ThreadSafeBloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  &peloton_bloomfilter_number_methods, /* tp_as_number */
+  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  &peloton_bloomfilter_buffer_procs, /* tp_as_buffer */
+  TPFLAGS,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_thread_safe_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc)peloton_bloomfilter_init,		/* tp_init */
+  PyType_GenericAlloc,		/* tp_alloc */
+  peloton_bloomfilter_new,			/* tp_new */
+  0, 
+};
+
+PyTypeObject BloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "peloton_bloomfilters.BloomFilter", /* tp_name */
+  sizeof(BloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  &peloton_bloomfilter_number_methods, /* tp_as_number */
+  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  &peloton_bloomfilter_buffer_procs, /* tp_as_buffer */
+  TPFLAGS,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc)peloton_bloomfilter_init,		/* tp_init */
+  PyType_GenericAlloc,		/* tp_alloc */
+  peloton_bloomfilter_new,			/* tp_new */
+  0,
+};
+
+PyTypeObject SharedMemoryCountingBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "peloton_bloomfilters.SharedMemoryCountingBloomFilter", /* tp_name */
+  sizeof(SharedMemoryBloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_shared_memory_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  0, /* tp_as_number */
+  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  &peloton_bloomfilter_buffer_procs, /* tp_as_buffer */
+  TPFLAGS,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_shared_memory_counting_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0, /* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc)peloton_bloomfilter_init,		/* tp_init */
+  PyType_GenericAlloc,		/* tp_alloc */
+  peloton_shared_memory_counting_bloomfilter_new,			/* tp_new */
+  0, 
+};
+
+PyTypeObject CountingBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "peloton_bloomfilters.CountingBloomFilter", /* tp_name */
+  sizeof(BloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  0, /* tp_as_number */
+  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  &peloton_bloomfilter_buffer_procs, /* tp_as_buffer */
+  TPFLAGS,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_counting_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc)peloton_bloomfilter_init,		/* tp_init */
+  PyType_GenericAlloc,		/* tp_alloc */
+  peloton_counting_bloomfilter_new,			/* tp_new */
+  0,
+};
+
+
+PyObject *
+make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate, const bloomfilter_options_t *options) {
+  SharedMemoryBloomfilterObject *smbo = (SharedMemoryBloomfilterObject *)type->tp_alloc(type, 0);
+
+  if (!smbo)
+    return NULL;
+  if (!(smbo->bf= create_bloomfilter(fd, capacity, error_rate, options))) {
+    Py_TYPE(smbo)->tp_free((PyObject *)smbo);
+    return NULL;
+  }
+  return (PyObject *)smbo;
+}
+
+
+static PyObject *
+peloton_bloomfilter_upgrade_file(PyObject *self, PyObject *args) {
+  const char *path;
+  int upgraded;
+  if (!PyArg_ParseTuple(args, "s", &path))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS;
+  upgraded = upgrade_shared_file(path);
+  Py_END_ALLOW_THREADS;
+  if (upgraded == -1)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  return PyBool_FromLong(upgraded);
+}
+
+
+/* Scalable bloomfilters chain plain filters instead of clearing.  Segment i
+   holds capacity * growth^i keys at error_rate * (1 - tightening) *
+   tightening^i, so the false positive rate of the whole chain stays below
+   error_rate however far it grows.  A shared filter keeps segment 0 in
+   `path` and segment i in the sibling file `path.i`; every process opens
+   the next sibling once it finds the last one it knows full. */
+
+#define MAX_SEGMENTS 64
+
+typedef struct {
+  PyObject HEAD;
+  bloomfilter_t *segments[MAX_SEGMENTS];
+  int count;   // segments in use
+  int opened;  // segments mapped, more than count once a private filter is cleared
+  int current; // the first of them that is not full
+  int atomic;
+  char *path;  // NULL for a private filter
+  uint64_t capacity;
+  double error_rate;
+  double growth;
+  double tightening;
+  bloomfilter_options_t options;
+} ScalableBloomfilterObject;
+
+static void segment_geometry(ScalableBloomfilterObject *sbo, int i, uint64_t *capacity, double *error_rate) {
+  *capacity = (uint64_t)ceil(sbo->capacity * pow(sbo->growth, i));
+  *error_rate = sbo->error_rate * (1 - sbo->tightening) * pow(sbo->tightening, i);
+}
+
+// Opens segment i, creating it if asked to.  NULL with errno set on failure.
+
+static bloomfilter_t *open_segment(ScalableBloomfilterObject *sbo, int i, int create) {
+  bloomfilter_t *bf;
+  uint64_t capacity;
+  double error_rate;
+  char *path;
+  int fd;
+
+  segment_geometry(sbo, i, &capacity, &error_rate);
+  if (!sbo->path)
+    return create_private_bloomfilter(capacity, error_rate, &sbo->options);
+  if (!(path = malloc(strlen(sbo->path) + 16)))
+    return NULL;
+  if (i)
+    sprintf(path, "%s.%d", sbo->path, i);
+  else
+    strcpy(path, sbo->path);
+  fd = open(path, create ? O_CREAT|O_RDWR : O_RDWR, 0666);
+  free(path);
+  if (fd == -1)
+    return NULL;
+  if (!(bf = create_bloomfilter(fd, capacity, error_rate, &sbo->options)))
+    close(fd);
+  return bf;
+}
+
+static void close_segment(ScalableBloomfilterObject *sbo, bloomfilter_t *bf) {
+  if (sbo->path)
+    peloton_shared_memory_bloomfilter_destroy(bf);
+  else
+    peloton_bloomfilter_destroy(bf);
+}
+
+static inline int segment_full(bloomfilter_t *bf) {
+  uint64_t count = __atomic_load_n(bf->counter, __ATOMIC_RELAXED);
+  return !count || count > bf->capacity;
+}
+
+// Claims room for one key; a full segment's counter only ever goes down
+
+static inline int segment_reserve(bloomfilter_t *bf, int atomic) {
+  uint64_t count;
+  if (segment_full(bf))
+    return 0;
+  if (atomic || FREE_THREADED)
+    count = __atomic_fetch_sub(bf->counter, (uint64_t)1, __ATOMIC_RELAXED);
+  else
+    count = (*bf->counter)--;
+  return count && count <= bf->capacity;
+}
+
+/* The segment that takes the next key, opening or creating segments as the
+   current one fills.  Past MAX_SEGMENTS the last one is overfilled.  New
+   segments are published with a release store of `count`, so lookups
+   running alongside without a lock see them whole.  A cleared private
+   filter takes back the segments it kept mapped before creating more. */
+
+static bloomfilter_t *scalable_reserve(ScalableBloomfilterObject *sbo) {
+  bloomfilter_t *bf, *reserved = NULL;
+  Py_BEGIN_CRITICAL_SECTION(sbo);
+  while (!segment_reserve(sbo->segments[sbo->current], sbo->atomic)) {
+    if (sbo->current + 1 == sbo->count) {
+      if (sbo->count == MAX_SEGMENTS)
+        break;
+      if (sbo->count == sbo->opened) {
+        if (!(bf = open_segment(sbo, sbo->count, 1)))
+          goto done;
+        sbo->segments[sbo->opened++] = bf;
+      }
+      __atomic_store_n(&sbo->count, sbo->count + 1, __ATOMIC_RELEASE);
+    }
+    sbo->current++;
+  }
+  reserved = sbo->segments[sbo->current];
+ done:
+  Py_END_CRITICAL_SECTION();
+  return reserved;
+}
+
+// Picks up the segments other processes have added since
+
+static void scalable_refresh(ScalableBloomfilterObject *sbo) {
+  bloomfilter_t *bf;
+  int saved_errno = errno;
+  if (!sbo->path)
+    return;
+  Py_BEGIN_CRITICAL_SECTION(sbo);
+  while (sbo->count < MAX_SEGMENTS && segment_full(sbo->segments[sbo->count - 1]) &&
+         (bf = open_segment(sbo, sbo->count, 0))) {
+    sbo->segments[sbo->count] = bf;
+    sbo->opened = sbo->count + 1;
+    __atomic_store_n(&sbo->count, sbo->count + 1, __ATOMIC_RELEASE);
+  }
+  Py_END_CRITICAL_SECTION();
+  errno = saved_errno;
+}
+
+// Newest first, the largest segments hold the most keys
+
+static int scalable_lookup(ScalableBloomfilterObject *sbo, uint64_t hash) {
+  int i;
+  for (i=__atomic_load_n(&sbo->count, __ATOMIC_ACQUIRE); i--;)
+    if (bloomfilter_lookup(sbo->segments[i], hash))
+      return 1;
+  return 0;
+}
+
+static void scalable_lookup_many(PyObject *self, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  ScalableBloomfilterObject *sbo = (ScalableBloomfilterObject *)self;
+  int count = __atomic_load_n(&sbo->count, __ATOMIC_ACQUIRE);
+  char *found;
+  Py_ssize_t j;
+  int i;
+
+  bloomfilter_lookup_many(sbo->segments[count - 1], hashes, n, out);
+  found = malloc(n ? n : 1);
+  for (i=count - 1; i--;) {
+    if (found) {
+      bloomfilter_lookup_many(sbo->segments[i], hashes, n, found);
+      for (j=0; j<n; ++j)
+        out[j] |= found[j];
+    } else {
+      for (j=0; j<n; ++j)
+        if (!out[j])
+          out[j] = bloomfilter_lookup(sbo->segments[i], hashes[j]);
+    }
+  }
+  free(found);
+}
+
+/* Keys that may already be present are skipped, so duplicates do not grow
+   the filter.  The rest are inserted a segment's worth at a time. */
+
+static int scalable_add_batch(ScalableBloomfilterObject *sbo, const uint64_t *hashes, Py_ssize_t n) {
+  bloomfilter_t *bf, *target = NULL;
+  uint64_t *absent;
+  char *present;
+  Py_ssize_t i, m = 0, start = 0;
+
+  scalable_refresh(sbo);
+  present = PyMem_Malloc(n ? n : 1);
+  absent = PyMem_Malloc(sizeof(uint64_t) * (n ? n : 1));
+  if (!present || !absent) {
+    PyMem_Free(present);
+    PyMem_Free(absent);
+    PyErr_NoMemory();
+    return -1;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  scalable_lookup_many((PyObject *)sbo, hashes, n, present);
+  Py_END_ALLOW_THREADS
+  for (i=0; i<n; ++i)
+    if (!present[i])
+      absent[m++] = hashes[i];
+  PyMem_Free(present);
+
+  for (i=0; i<=m; ++i) {
+    bf = i < m ? scalable_reserve(sbo) : NULL;
+    if (i < m && !bf) {
+      PyMem_Free(absent);
+      PyErr_SetFromErrno(PyExc_IOError);
+      return -1;
+    }
+    if (bf == target && i < m)
+      continue;
+    if (target) {
+      Py_BEGIN_ALLOW_THREADS
+      bloomfilter_insert_many(target, absent + start, i - start, sbo->atomic);
+      Py_END_ALLOW_THREADS
+    }
+    target = bf;
+    start = i;
+  }
+  PyMem_Free(absent);
+  return 0;
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_add(ScalableBloomfilterObject *sbo, PyObject *item) {
+  bloomfilter_t *bf;
+  uint64_t hash = bloomfilter_hash(sbo->segments[0], item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  scalable_refresh(sbo);
+  if (scalable_lookup(sbo, hash))
+    Py_RETURN_FALSE;
+  if (!(bf = scalable_reserve(sbo)))
+    return PyErr_SetFromErrno(PyExc_IOError);
+  bloomfilter_insert(bf, hash, sbo->atomic);
+  Py_RETURN_FALSE;
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_add_many(ScalableBloomfilterObject *sbo, PyObject *iterable) {
+  Py_ssize_t n;
+  int failed;
+  uint64_t *hashes = bloomfilter_hash_items(sbo->segments[0], iterable, &n);
+  if (!hashes)
+    return NULL;
+
+  failed = scalable_add_batch(sbo, hashes, n);
+  PyMem_Free(hashes);
+  if (failed)
+    return NULL;
+  Py_RETURN_FALSE;
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_add_hashes(ScalableBloomfilterObject *sbo, PyObject *buffer) {
+  Py_buffer view;
+  int failed;
+
+  if (bloomfilter_get_hashes(buffer, &view))
+    return NULL;
+  failed = scalable_add_batch(sbo, view.buf, view.len / sizeof(uint64_t));
+  PyBuffer_Release(&view);
+  if (failed)
+    return NULL;
+  Py_RETURN_FALSE;
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_contains_many(ScalableBloomfilterObject *sbo, PyObject *iterable) {
+  scalable_refresh(sbo);
+  return bloomfilter_contains_many((PyObject *)sbo, sbo->segments[0], iterable, scalable_lookup_many);
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_contains_hashes(ScalableBloomfilterObject *sbo, FASTCALL_PARAMS) {
+  scalable_refresh(sbo);
+  return bloomfilter_contains_hashes((PyObject *)sbo, FASTCALL_ARGS, scalable_lookup_many);
+}
+
+/* A private filter goes back to one segment, a shared one clears them all
+   for everybody.  The private filter's extra segments are cleared but stay
+   mapped until it is freed, since lookups may still be reading them
+   without the GIL; it fills them again as it grows. */
+
+static PyObject *
+peloton_scalable_bloomfilter_clear(ScalableBloomfilterObject *sbo, PyObject *_) {
+  int i;
+  scalable_refresh(sbo);
+  Py_BEGIN_CRITICAL_SECTION(sbo);
+  if (!sbo->path)
+    __atomic_store_n(&sbo->count, 1, __ATOMIC_RELEASE);
+  for (i=0; i<sbo->opened; ++i)
+    bloomfilter_clear(sbo->segments[i]);
+  sbo->current = 0;
+  Py_END_CRITICAL_SECTION();
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_population(ScalableBloomfilterObject *sbo, PyObject *_) {
+  uint64_t population = 0;
+  int i;
+  scalable_refresh(sbo);
+  for (i=0; i<sbo->count; ++i)
+    population += bloomfilter_population(sbo->segments[i], 1);
+  #ifdef IS_PY3K
+  return PyLong_FromLong(population);
+  #else
+  return PyInt_FromLong(population);
+  #endif
+}
+
+static PyObject *
+peloton_scalable_bloomfilter_segments(ScalableBloomfilterObject *sbo, PyObject *_) {
+  scalable_refresh(sbo);
+  #ifdef IS_PY3K
+  return PyLong_FromLong(sbo->count);
+  #else
+  return PyInt_FromLong(sbo->count);
+  #endif
+}
 
-  return retval;
+static Py_ssize_t
+ScalableBloomFilterObject_len(ScalableBloomfilterObject *sbo) {
+  Py_ssize_t len = 0;
+  uint64_t count;
+  int i;
+  scalable_refresh(sbo);
+  for (i=0; i<sbo->count; ++i) {
+    count = __atomic_load_n(sbo->segments[i]->counter, __ATOMIC_RELAXED);
+    len += count > sbo->segments[i]->capacity ? sbo->segments[i]->capacity : sbo->segments[i]->capacity - count;
+  }
+  return len;
 }
 
+static int
+ScalableBloomFilterObject_contains(ScalableBloomfilterObject *sbo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(sbo->segments[0], item);
+  if (hash == (uint64_t)(-1))
+    return -1;
+  scalable_refresh(sbo);
+  return scalable_lookup(sbo, hash);
+}
 
-static PyObject *
-peloton_shared_memory_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+static PySequenceMethods ScalableBloomfilterObject_sequence_methods = {
+  (lenfunc)ScalableBloomFilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)ScalableBloomFilterObject_contains,	/* sq_contains */
+};
 
-  int fd = 0;
-  char *path = NULL;
-  uint64_t capacity = 1000;
-  double error_rate = 1.0 / 128.0;
-  static char *kwlist[] = {"file", "capacity", "error_rate", NULL};
+static PyMethodDef peloton_scalable_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_scalable_bloomfilter_add, METH_O, NULL},
+  {"add_many", (PyCFunction)peloton_scalable_bloomfilter_add_many, METH_O, NULL},
+  {"add_hashes", (PyCFunction)peloton_scalable_bloomfilter_add_hashes, METH_O, NULL},
+  {"contains_hashes", (PyCFunction)peloton_scalable_bloomfilter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_many", (PyCFunction)peloton_scalable_bloomfilter_contains_many, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_scalable_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_scalable_bloomfilter_population, METH_NOARGS, NULL},
+  {"segments", (PyCFunction)peloton_scalable_bloomfilter_segments, METH_NOARGS, NULL},
+  {NULL, NULL}
+};
 
-  PyArg_ParseTupleAndKeywords(args,
-			      kwargs,
-			      "s|ld",
-			      kwlist,
-			      &path,
-			      &capacity,
-			      &error_rate);
+static void peloton_scalable_bloomfilter_type_dealloc(ScalableBloomfilterObject *sbo) {
+  int i;
+  for (i=0; i<sbo->opened; ++i)
+    close_segment(sbo, sbo->segments[i]);
+  free(sbo->path);
+  Py_TYPE(sbo)->tp_free((PyObject *)sbo);
+}
 
-  fd = open(path, O_CREAT|O_RDWR, ~0);
-  if (fd == -1) {
-    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+static PyObject *
+make_new_scalable_bloomfilter(PyTypeObject *type, const char *path, uint64_t capacity, double error_rate,
+                              double growth, double tightening, const bloomfilter_options_t *options) {
+  ScalableBloomfilterObject *sbo;
+
+  if (bloomfilter_probes(error_rate) == -1) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
   }
-  PyObject *smbo = make_new_peloton_bloomfilter(type, fd, capacity, error_rate);
-  if (!smbo)
-    {
-    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
-    }
-  return (PyObject *)smbo;
+  if (!(growth >= 1)) {
+    PyErr_SetString(PyExc_ValueError, "growth must be at least 1");
+    return NULL;
+  }
+  if (!(tightening > 0 && tightening < 1)) {
+    PyErr_SetString(PyExc_ValueError, "tightening must be between 0 and 1");
+    return NULL;
+  }
+  if (!(sbo = (ScalableBloomfilterObject *)type->tp_alloc(type, 0)))
+    return NULL;
+  sbo->atomic = path != NULL;
+  sbo->capacity = capacity;
+  sbo->error_rate = error_rate;
+  sbo->growth = growth;
+  sbo->tightening = tightening;
+  sbo->options = *options;
+  if (path && !(sbo->path = strdup(path))) {
+    Py_DECREF(sbo);
+    return PyErr_NoMemory();
+  }
+  if (!(sbo->segments[0] = open_segment(sbo, 0, 1))) {
+    if (path)
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    else if (errno == ENOMEM)
+      PyErr_NoMemory();
+    else
+      PyErr_SetFromErrno(PyExc_OSError);
+    Py_DECREF(sbo);
+    return NULL;
+  }
+  sbo->count = sbo->opened = 1;
+  // An existing chain keeps the geometry it was created with
+  sbo->capacity = sbo->segments[0]->capacity;
+  sbo->error_rate = sbo->segments[0]->error_rate / (1 - tightening);
+  scalable_refresh(sbo);
+  return (PyObject *)sbo;
 }
 
 static PyObject *
-peloton_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
-  static char *kwlist[] = {"capacity", "error_rate", NULL};
-
+peloton_scalable_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"capacity", "error_rate", "growth", "tightening", "blocked", "stable_hash", "seed",
+                           "double_hashing", "power_of_two", "huge_pages", "populate", "lock", NULL};
   uint64_t capacity;
   double error_rate;
-  PyArg_ParseTupleAndKeywords(args,
-			      kwargs,
-			      "ld",
-			      kwlist,
-			      &capacity,
-			      &error_rate);
-
-  BloomfilterObject *obj = make_new_peloton_bloomfilter(type, NULL, capacity, error_rate);
-  if (!obj)
-    PyErr_NoMemory();
-  return (PyObject *)obj;
+  double growth = 2;
+  double tightening = 0.5;
+  int blocked = 0;
+  int stable_hash = 0;
+  unsigned long long seed = 0;
+  int double_hashing = 0;
+  int power_of_two = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "ld|ddiiKiiiii",
+				   kwlist,
+				   &capacity,
+				   &error_rate,
+				   &growth,
+				   &tightening,
+				   &blocked,
+				   &stable_hash,
+				   &seed,
+				   &double_hashing,
+				   &power_of_two,
+				   &huge_pages,
+				   &populate,
+				   &lock))
+    return NULL;
+
+  bloomfilter_options_t options = {
+    .layout = blocked ? LAYOUT_BLOCKED : LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = double_hashing ? PROBE_DOUBLE : PROBE_CHAIN,
+    .sizing = power_of_two ? SIZING_POW2 : SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = 1,
+  };
+  return make_new_scalable_bloomfilter(type, NULL, capacity, error_rate, growth, tightening, &options);
 }
 
-PyTypeObject SharedMemoryBloomfilterType = {
+static PyObject *
+peloton_shared_memory_scalable_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"file", "capacity", "error_rate", "growth", "tightening", "blocked", "stable_hash", "seed",
+                           "double_hashing", "power_of_two", "huge_pages", "populate", "lock", NULL};
+  char *path = NULL;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  double growth = 2;
+  double tightening = 0.5;
+  int blocked = 0;
+  int stable_hash = 1;
+  unsigned long long seed = 0;
+  int double_hashing = 0;
+  int power_of_two = 0;
+  int huge_pages = 0;
+  int populate = 0;
+  int lock = 0;
+  if (!PyArg_ParseTupleAndKeywords(args,
+				   kwargs,
+				   "s|ldddiiKiiiii",
+				   kwlist,
+				   &path,
+				   &capacity,
+				   &error_rate,
+				   &growth,
+				   &tightening,
+				   &blocked,
+				   &stable_hash,
+				   &seed,
+				   &double_hashing,
+				   &power_of_two,
+				   &huge_pages,
+				   &populate,
+				   &lock))
+    return NULL;
+
+  bloomfilter_options_t options = {
+    .layout = blocked ? LAYOUT_BLOCKED : LAYOUT_SCATTER,
+    .hash = stable_hash ? HASH_STABLE : HASH_PYTHON,
+    .seed = seed,
+    .probing = double_hashing ? PROBE_DOUBLE : PROBE_CHAIN,
+    .sizing = power_of_two ? SIZING_POW2 : SIZING_EXACT,
+    .huge_pages = huge_pages,
+    .populate = populate,
+    .lock = lock,
+    .generations = 1,
+  };
+  return make_new_scalable_bloomfilter(type, path, capacity, error_rate, growth, tightening, &options);
+}
+
+PyTypeObject SharedMemoryScalableBloomfilterType = {
   PyVarObject_HEAD_INIT(&PyType_Type, 0)
-  "SharedMemoryBloomFilter", /* tp_name */
-  sizeof(SharedMemoryBloomfilterObject), /* tp_basicsize */
+  "peloton_bloomfilters.SharedMemoryScalableBloomFilter", /* tp_name */
+  sizeof(ScalableBloomfilterObject), /* tp_basicsize */
   0, /* tp_itemsize */
-  (destructor)peloton_shared_memory_bloomfilter_type_dealloc, /* tp_dealloc */
+  (destructor)peloton_scalable_bloomfilter_type_dealloc, /* tp_dealloc */
   0, /* tp_print */
   0, /* tp_getattr */
   0, /* tp_setattr */
   0, /* tp_cmp */
   0, /* tp_repr */
   0, /* tp_as_number */
-  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  &ScalableBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
   0, 
   (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
   0, /* tp_call */
@@ -659,7 +5471,7 @@ PyTypeObject SharedMemoryBloomfilterType = {
   0, /* tp_weaklistoffset */
   0, /* tp_iter */
   0, /* tp_iternext */
-  peloton_shared_memory_bloomfilter_methods, /* tp_methods */
+  peloton_scalable_bloomfilter_methods, /* tp_methods */
   0, /* tp_members */
   0, /* tp_genset */
   0, /* tp_base */
@@ -669,23 +5481,23 @@ PyTypeObject SharedMemoryBloomfilterType = {
   0,				/* tp_dictoffset */
   (initproc)peloton_bloomfilter_init,		/* tp_init */
   PyType_GenericAlloc,		/* tp_alloc */
-  peloton_shared_memory_bloomfilter_new,			/* tp_new */
+  peloton_shared_memory_scalable_bloomfilter_new,			/* tp_new */
   0, 
 };
 
-PyTypeObject ThreadSafeBloomfilterType = {
+PyTypeObject ScalableBloomfilterType = {
   PyVarObject_HEAD_INIT(&PyType_Type, 0)
-  "ThreadSafeBloomFilter", /* tp_name */
-  sizeof(ThreadSafeBloomfilterObject), /* tp_basicsize */
+  "peloton_bloomfilters.ScalableBloomFilter", /* tp_name */
+  sizeof(ScalableBloomfilterObject), /* tp_basicsize */
   0, /* tp_itemsize */
-  (destructor)peloton_bloomfilter_type_dealloc, /* tp_dealloc */
+  (destructor)peloton_scalable_bloomfilter_type_dealloc, /* tp_dealloc */
   0, /* tp_print */
   0, /* tp_getattr */
   0, /* tp_setattr */
   0, /* tp_cmp */
   0, /* tp_repr */
   0, /* tp_as_number */
-  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  &ScalableBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
   0, 
   (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
   0, /* tp_call */
@@ -701,34 +5513,504 @@ PyTypeObject ThreadSafeBloomfilterType = {
   0, /* tp_weaklistoffset */
   0, /* tp_iter */
   0, /* tp_iternext */
-  peloton_shared_memory_bloomfilter_methods, /* tp_methods */
+  peloton_scalable_bloomfilter_methods, /* tp_methods */
   0, /* tp_members */
   0, /* tp_genset */
   0, /* tp_base */
   0, /* tp_dict */
-  0,				/* tp_descr_get */
+  0, /* tp_descr_get */
   0,				/* tp_descr_set */
   0,				/* tp_dictoffset */
   (initproc)peloton_bloomfilter_init,		/* tp_init */
   PyType_GenericAlloc,		/* tp_alloc */
-  peloton_bloomfilter_new,			/* tp_new */
-  0, 
+  peloton_scalable_bloomfilter_new,			/* tp_new */
+  0,
 };
 
-PyTypeObject BloomfilterType = {
+
+/* Frozen filters.  A set that is built once and then only queried fits a
+   binary fuse filter (Graf and Lemire): an 8 bit fingerprint per slot, a
+   little over 9 bits per key, a false positive rate of 1/256, and three
+   reads per lookup.  Each key hashes to one slot in each of three
+   consecutive segments, and construction peels keys that are alone in a
+   slot off a hypergraph, then assigns fingerprints in reverse order so
+   that the three slots of every key XOR to its fingerprint.  Keys go
+   through bloomfilter_hash, so a FrozenFilter answers for the same items
+   as a bloom filter with the same stable_hash and seed. */
+
+#define FUSE_MAX_ITERATIONS 100
+#define FUSE_MAX_SEGMENT_LENGTH 262144
+
+typedef struct {
+  uint64_t seed;
+  uint32_t segment_length;
+  uint32_t segment_length_mask;
+  uint32_t segment_count;
+  uint32_t segment_count_length;
+  uint32_t array_length;
+  uint64_t keys;
+  uint8_t *fingerprints;
+} binary_fuse_t;
+
+static inline uint64_t fuse_mix(uint64_t key, uint64_t seed) {
+  uint64_t h = key + seed;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t fuse_next_seed(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint8_t fuse_fingerprint(uint64_t hash) {
+  return (uint8_t)(hash ^ (hash >> 32));
+}
+
+// Slot of `hash` in segment h + index: the high bits pick h, the low 36 bits the offsets
+
+static inline uint32_t fuse_slot(const binary_fuse_t *fuse, uint64_t hash, int index) {
+  uint64_t h = ((unsigned __int128)hash * fuse->segment_count_length) >> 64;
+  h += (uint64_t)index * fuse->segment_length;
+  h ^= ((hash & (((uint64_t)1 << 36) - 1)) >> (36 - 18 * index)) & fuse->segment_length_mask;
+  return (uint32_t)h;
+}
+
+static inline int fuse_lookup(const binary_fuse_t *fuse, uint64_t key) {
+  uint64_t hash = fuse_mix(key, fuse->seed);
+  const uint8_t *fingerprints = fuse->fingerprints;
+  if (unlikely(!fuse->keys))
+    return 0;
+  return !(fuse_fingerprint(hash) ^ fingerprints[fuse_slot(fuse, hash, 0)] ^
+           fingerprints[fuse_slot(fuse, hash, 1)] ^ fingerprints[fuse_slot(fuse, hash, 2)]);
+}
+
+// Segments grow with the key count, and the slack shrinks from 1.5x at a thousand keys to 1.125x
+
+static void fuse_geometry(binary_fuse_t *fuse, uint64_t keys) {
+  double factor = keys <= 1 ? 0 : fmax(1.125, 0.875 + 0.25 * log(1000000) / log(keys));
+  uint64_t capacity = (uint64_t)round(keys * factor);
+  int64_t segments;
+
+  fuse->keys = keys;
+  fuse->segment_length = keys ? (uint32_t)1 << (int)floor(log(keys) / log(3.33) + 2.25) : 4;
+  if (fuse->segment_length > FUSE_MAX_SEGMENT_LENGTH)
+    fuse->segment_length = FUSE_MAX_SEGMENT_LENGTH;
+  fuse->segment_length_mask = fuse->segment_length - 1;
+  segments = (int64_t)((capacity + fuse->segment_length - 1) / fuse->segment_length) - 2;
+  fuse->segment_count = segments < 1 ? 1 : segments;
+  fuse->segment_count_length = fuse->segment_count * fuse->segment_length;
+  fuse->array_length = (fuse->segment_count + 2) * fuse->segment_length;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Fills fuse->fingerprints (array_length zeroed bytes) from n distinct
+   keys.  -1 with errno set when out of memory or, with odds far below
+   2^-100, when no seed gives a peelable hypergraph. */
+static int fuse_populate(binary_fuse_t *fuse, const uint64_t *keys, uint64_t n) {
+  uint64_t state = 0x726b2b9d438b9d4dULL;
+  uint32_t capacity = fuse->array_length;
+  uint64_t *order = calloc(n + 1, sizeof(uint64_t));
+  uint64_t *t2hash = calloc(capacity, sizeof(uint64_t));
+  uint32_t *alone = malloc(capacity * sizeof(uint32_t));
+  uint8_t *t2count = calloc(capacity, 1);
+  uint8_t *found_at = malloc(n ? n : 1);
+  uint32_t *start = NULL;
+  uint32_t block_bits = 1, block, slots[5], index, other, queue, stack;
+  uint64_t i, hash, segment;
+  int iteration, error, found, k, result = -1;
+
+  while (((uint32_t)1 << block_bits) < fuse->segment_count)
+    ++block_bits;
+  block = (uint32_t)1 << block_bits;
+  if (!order || !t2hash || !alone || !t2count || !found_at || !(start = malloc(block * sizeof(uint32_t)))) {
+    errno = ENOMEM;
+    goto done;
+  }
+
+  for (iteration=0; iteration<FUSE_MAX_ITERATIONS; ++iteration) {
+    fuse->seed = fuse_next_seed(&state);
+    // Bucket the hashes by segment so the counting pass below walks memory in order
+    memset(order, 0, (n + 1) * sizeof(uint64_t));
+    order[n] = 1;
+    for (i=0; i<block; ++i)
+      start[i] = (i * n) >> block_bits;
+    for (i=0; i<n; ++i) {
+      hash = fuse_mix(keys[i], fuse->seed);
+      for (segment = hash >> (64 - block_bits); order[start[segment]]; segment = (segment + 1) & (block - 1));
+      order[start[segment]++] = hash;
+    }
+    memset(t2count, 0, capacity);
+    memset(t2hash, 0, capacity * sizeof(uint64_t));
+    // Each slot counts its keys (<< 2), XORs their hashes and, in the low 2 bits, their indexes
+    for (i=0, error=0; i<n; ++i) {
+      hash = order[i];
+      for (k=0; k<3; ++k) {
+        index = fuse_slot(fuse, hash, k);
+        t2count[index] += 4;
+        t2count[index] ^= k;
+        t2hash[index] ^= hash;
+        error |= t2count[index] < 4;
+      }
+    }
+    if (error)
+      continue;
+
+    for (i=0, queue=0; i<capacity; ++i) {
+      alone[queue] = i;
+      queue += (t2count[i] >> 2) == 1;
+    }
+    stack = 0;
+    while (queue) {
+      index = alone[--queue];
+      if ((t2count[index] >> 2) != 1)
+        continue;
+      hash = t2hash[index];
+      slots[0] = fuse_slot(fuse, hash, 0);
+      slots[1] = fuse_slot(fuse, hash, 1);
+      slots[2] = fuse_slot(fuse, hash, 2);
+      slots[3] = slots[0];
+      slots[4] = slots[1];
+      found = t2count[index] & 3;
+      found_at[stack] = found;
+      order[stack++] = hash;
+      for (k=1; k<3; ++k) {
+        other = slots[found + k];
+        alone[queue] = other;
+        queue += (t2count[other] >> 2) == 2;
+        t2count[other] -= 4;
+        t2count[other] ^= (found + k) % 3;
+        t2hash[other] ^= hash;
+      }
+    }
+    if (stack == n) {
+      // Assign in reverse peeling order: the slot a key was alone in is still free then
+      for (i=n; i-- > 0;) {
+        hash = order[i];
+        found = found_at[i];
+        slots[0] = fuse_slot(fuse, hash, 0);
+        slots[1] = fuse_slot(fuse, hash, 1);
+        slots[2] = fuse_slot(fuse, hash, 2);
+        slots[3] = slots[0];
+        slots[4] = slots[1];
+        fuse->fingerprints[slots[found]] = fuse_fingerprint(hash) ^ fuse->fingerprints[slots[found + 1]] ^
+          fuse->fingerprints[slots[found + 2]];
+      }
+      result = 0;
+      goto done;
+    }
+  }
+  errno = EAGAIN;
+
+ done:
+  free(order);
+  free(t2hash);
+  free(alone);
+  free(t2count);
+  free(found_at);
+  free(start);
+  return result;
+}
+
+/* A frozen filter file is a header of little endian 64 bit fields and the
+   fingerprints at `fingerprints_offset`, a page boundary.  open() maps it
+   read only, so every process shares one copy through the page cache. */
+
+typedef struct {
+  char magic[24];
+  uint64_t version;
+  uint64_t fingerprints_offset;
+  uint64_t keys;
+  uint64_t hash;
+  uint64_t hash_seed;
+  uint64_t fuse_seed;
+  uint64_t segment_length;
+  uint64_t segment_count;
+  uint64_t array_length;
+  uint64_t padding[3];
+} frozen_header_t;
+
+const char FROZEN_MAGIC[24] = "Peloton Frozen Filter";
+#define FROZEN_VERSION 1
+
+typedef struct {
+  PyObject HEAD;
+  bloomfilter_t hasher; // only hash and seed are set
+  binary_fuse_t fuse;
+  void *mmap;           // the mapped file, NULL when the fingerprints are malloc'd
+  size_t mmap_size;
+} FrozenFilterObject;
+
+static void frozen_lookup_many(PyObject *self, const uint64_t *hashes, Py_ssize_t n, char *out) {
+  const binary_fuse_t *fuse = &((FrozenFilterObject *)self)->fuse;
+  Py_ssize_t i;
+  for (i=0; i<n; ++i)
+    out[i] = fuse_lookup(fuse, hashes[i]);
+}
+
+static FrozenFilterObject *frozen_alloc(PyTypeObject *type, int stable_hash, uint64_t seed) {
+  FrozenFilterObject *ffo = (FrozenFilterObject *)type->tp_alloc(type, 0);
+  if (!ffo)
+    return NULL;
+  memset(&ffo->hasher, 0, sizeof(ffo->hasher));
+  ffo->hasher.hash = stable_hash ? HASH_STABLE : HASH_PYTHON;
+  ffo->hasher.seed = seed;
+  return ffo;
+}
+
+// Builds the filter from n hashes, which it sorts and deduplicates in place
+
+static PyObject *make_frozen_filter(PyTypeObject *type, uint64_t *hashes, Py_ssize_t n, int stable_hash, uint64_t seed) {
+  FrozenFilterObject *ffo;
+  Py_ssize_t i, unique = 0;
+  int populated;
+
+  if (!(ffo = frozen_alloc(type, stable_hash, seed)))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  qsort(hashes, n, sizeof(uint64_t), compare_hashes);
+  for (i=0; i<n; ++i)
+    if (!unique || hashes[i] != hashes[unique - 1])
+      hashes[unique++] = hashes[i];
+  fuse_geometry(&ffo->fuse, unique);
+  populated = (ffo->fuse.fingerprints = calloc(ffo->fuse.array_length, 1)) ? fuse_populate(&ffo->fuse, hashes, unique) : -1;
+  Py_END_ALLOW_THREADS
+  if (populated) {
+    if (errno == ENOMEM)
+      PyErr_NoMemory();
+    else
+      PyErr_SetString(PyExc_RuntimeError, "could not construct the frozen filter");
+    Py_DECREF(ffo);
+    return NULL;
+  }
+  return (PyObject *)ffo;
+}
+
+static PyObject *
+peloton_frozen_filter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"keys", "stable_hash", "seed", NULL};
+  PyObject *keys, *result;
+  int stable_hash = 1;
+  unsigned long long seed = 0;
+  bloomfilter_t hasher;
+  uint64_t *hashes;
+  Py_ssize_t n;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iK", kwlist, &keys, &stable_hash, &seed))
+    return NULL;
+  memset(&hasher, 0, sizeof(hasher));
+  hasher.hash = stable_hash ? HASH_STABLE : HASH_PYTHON;
+  hasher.seed = seed;
+  if (!(hashes = bloomfilter_hash_items(&hasher, keys, &n)))
+    return NULL;
+  result = make_frozen_filter(type, hashes, n, stable_hash, seed);
+  PyMem_Free(hashes);
+  return result;
+}
+
+// from_hashes() takes precomputed hashes, as add_hashes does
+
+static PyObject *
+peloton_frozen_filter_from_hashes(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"hashes", "stable_hash", "seed", NULL};
+  PyObject *buffer, *result;
+  int stable_hash = 1;
+  unsigned long long seed = 0;
+  Py_buffer view;
+  uint64_t *hashes;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iK", kwlist, &buffer, &stable_hash, &seed))
+    return NULL;
+  if (bloomfilter_get_hashes(buffer, &view))
+    return NULL;
+  if (!(hashes = PyMem_Malloc(view.len ? view.len : 1))) {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+  memcpy(hashes, view.buf, view.len);
+  result = make_frozen_filter(type, hashes, view.len / sizeof(uint64_t), stable_hash, seed);
+  PyBuffer_Release(&view);
+  PyMem_Free(hashes);
+  return result;
+}
+
+static PyObject *
+peloton_frozen_filter_save(FrozenFilterObject *ffo, PyObject *args) {
+  const binary_fuse_t *fuse = &ffo->fuse;
+  frozen_header_t header;
+  const char *path;
+  char *tmp_path;
+  int fd, failed, saved_errno;
+
+  if (!PyArg_ParseTuple(args, "s", &path))
+    return NULL;
+  // hash() differs from one process to the next, so its fingerprints mean nothing on disk
+  if (ffo->hasher.hash == HASH_PYTHON) {
+    PyErr_SetString(PyExc_ValueError, "filters built with stable_hash=False cannot be saved");
+    return NULL;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FROZEN_MAGIC, sizeof(header.magic));
+  header.version = FROZEN_VERSION;
+  header.fingerprints_offset = SHARED_PAGE_SIZE;
+  header.keys = fuse->keys;
+  header.hash = ffo->hasher.hash;
+  header.hash_seed = ffo->hasher.seed;
+  header.fuse_seed = fuse->seed;
+  header.segment_length = fuse->segment_length;
+  header.segment_count = fuse->segment_count;
+  header.array_length = fuse->array_length;
+  // Readers map the file, so a new one is renamed over it rather than written in place
+  Py_BEGIN_ALLOW_THREADS
+  failed = (fd = open_temporary(path, ".frozen", 0666, &tmp_path)) == -1;
+  if (!failed) {
+    failed = pwrite_all(fd, &header, sizeof(header), 0) ||
+      pwrite_all(fd, fuse->fingerprints, fuse->array_length, SHARED_PAGE_SIZE) || fsync(fd);
+    failed = close(fd) || failed;
+    failed = failed || rename(tmp_path, path);
+    if (failed) {
+      saved_errno = errno;
+      unlink(tmp_path);
+      errno = saved_errno;
+    }
+    free(tmp_path);
+  }
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_frozen_filter_open(PyTypeObject *type, PyObject *args) {
+  FrozenFilterObject *ffo;
+  frozen_header_t header;
+  struct stat stats;
+  const char *path;
+  void *map;
+  int fd;
+
+  if (!PyArg_ParseTuple(args, "s", &path))
+    return NULL;
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  if (fstat(fd, &stats) || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, FROZEN_MAGIC, sizeof(header.magic)) || header.version != FROZEN_VERSION ||
+      header.fingerprints_offset < sizeof(header) || header.segment_length > FUSE_MAX_SEGMENT_LENGTH ||
+      !header.segment_length || header.segment_length & (header.segment_length - 1) ||
+      // The geometry fits the 32 bit fields of binary_fuse_t, checked before it is multiplied out
+      header.segment_count > UINT32_MAX || header.segment_count * header.segment_length > UINT32_MAX ||
+      header.array_length != (header.segment_count + 2) * header.segment_length ||
+      header.array_length > UINT32_MAX || header.fingerprints_offset > (uint64_t)stats.st_size ||
+      (uint64_t)stats.st_size - header.fingerprints_offset < header.array_length) {
+    close(fd);
+    PyErr_Format(PyExc_ValueError, "%s is not a frozen filter file", path);
+    return NULL;
+  }
+  map = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  if (!(ffo = frozen_alloc(type, header.hash == HASH_STABLE, header.hash_seed))) {
+    munmap(map, stats.st_size);
+    return NULL;
+  }
+  ffo->mmap = map;
+  ffo->mmap_size = stats.st_size;
+  ffo->fuse.seed = header.fuse_seed;
+  ffo->fuse.keys = header.keys;
+  ffo->fuse.segment_length = header.segment_length;
+  ffo->fuse.segment_length_mask = header.segment_length - 1;
+  ffo->fuse.segment_count = header.segment_count;
+  ffo->fuse.segment_count_length = header.segment_count * header.segment_length;
+  ffo->fuse.array_length = header.array_length;
+  ffo->fuse.fingerprints = (uint8_t *)map + header.fingerprints_offset;
+  return (PyObject *)ffo;
+}
+
+static PyObject *
+peloton_frozen_filter_contains_many(FrozenFilterObject *ffo, PyObject *iterable) {
+  return bloomfilter_contains_many((PyObject *)ffo, &ffo->hasher, iterable, frozen_lookup_many);
+}
+
+static PyObject *
+peloton_frozen_filter_contains_hashes(FrozenFilterObject *ffo, FASTCALL_PARAMS) {
+  return bloomfilter_contains_hashes((PyObject *)ffo, FASTCALL_ARGS, frozen_lookup_many);
+}
+
+// Bytes the fingerprints take, about 1.13 per key for large sets
+
+static PyObject *
+peloton_frozen_filter_nbytes(FrozenFilterObject *ffo, PyObject *_) {
+  return PyLong_FromUnsignedLongLong(ffo->fuse.array_length);
+}
+
+static Py_ssize_t
+FrozenFilterObject_len(FrozenFilterObject *ffo) {
+  return ffo->fuse.keys;
+}
+
+static int
+FrozenFilterObject_contains(FrozenFilterObject *ffo, PyObject *item) {
+  uint64_t hash = bloomfilter_hash(&ffo->hasher, item);
+  if (hash == (uint64_t)(-1))
+    return -1;
+  return fuse_lookup(&ffo->fuse, hash);
+}
+
+static PySequenceMethods FrozenFilterObject_sequence_methods = {
+  (lenfunc)FrozenFilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)FrozenFilterObject_contains,	/* sq_contains */
+};
+
+static PyMethodDef peloton_frozen_filter_methods[] = {
+  {"contains_hashes", (PyCFunction)peloton_frozen_filter_contains_hashes, METH_FASTCALL_KEYWORDS, NULL},
+  {"contains_many", (PyCFunction)peloton_frozen_filter_contains_many, METH_O, NULL},
+  {"from_hashes", (PyCFunction)peloton_frozen_filter_from_hashes, METH_VARARGS | METH_KEYWORDS | METH_CLASS, NULL},
+  {"save", (PyCFunction)peloton_frozen_filter_save, METH_VARARGS, NULL},
+  {"open", (PyCFunction)peloton_frozen_filter_open, METH_VARARGS | METH_CLASS, NULL},
+  {"nbytes", (PyCFunction)peloton_frozen_filter_nbytes, METH_NOARGS, NULL},
+  {NULL, NULL}
+};
+
+static void peloton_frozen_filter_type_dealloc(FrozenFilterObject *ffo) {
+  if (ffo->mmap)
+    munmap(ffo->mmap, ffo->mmap_size);
+  else
+    free(ffo->fuse.fingerprints);
+  Py_TYPE(ffo)->tp_free((PyObject *)ffo);
+}
+
+PyTypeObject FrozenFilterType = {
   PyVarObject_HEAD_INIT(&PyType_Type, 0)
-  "BloomFilter", /* tp_name */
-  sizeof(BloomfilterObject), /* tp_basicsize */
+  "peloton_bloomfilters.FrozenFilter", /* tp_name */
+  sizeof(FrozenFilterObject), /* tp_basicsize */
   0, /* tp_itemsize */
-  (destructor)peloton_bloomfilter_type_dealloc, /* tp_dealloc */
+  (destructor)peloton_frozen_filter_type_dealloc, /* tp_dealloc */
   0, /* tp_print */
   0, /* tp_getattr */
   0, /* tp_setattr */
   0, /* tp_cmp */
   0, /* tp_repr */
   0, /* tp_as_number */
-  &SharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
-  0, 
+  &FrozenFilterObject_sequence_methods, /* tp_as_seqeunce */
+  0,
   (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
   0, /* tp_call */
   0, /* tp_str */
@@ -743,48 +6025,129 @@ PyTypeObject BloomfilterType = {
   0, /* tp_weaklistoffset */
   0, /* tp_iter */
   0, /* tp_iternext */
-  peloton_bloomfilter_methods, /* tp_methods */
+  peloton_frozen_filter_methods, /* tp_methods */
   0, /* tp_members */
   0, /* tp_genset */
   0, /* tp_base */
   0, /* tp_dict */
-  0,				/* tp_descr_get */
+  0, /* tp_descr_get */
   0,				/* tp_descr_set */
   0,				/* tp_dictoffset */
   (initproc)peloton_bloomfilter_init,		/* tp_init */
   PyType_GenericAlloc,		/* tp_alloc */
-  peloton_bloomfilter_new,			/* tp_new */
+  peloton_frozen_filter_new,			/* tp_new */
   0,
 };
 
 
-PyObject *
-make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate) {
-  SharedMemoryBloomfilterObject *smbo = PyObject_GC_New(SharedMemoryBloomfilterObject, &SharedMemoryBloomfilterType);;
-  
-  if (!smbo)
-    return NULL;
-  if (!(smbo->bf= create_bloomfilter(fd, capacity, error_rate))) {
+// Test hooks: list the kernels this CPU can run and force one of them
+
+static PyObject *
+peloton_bloomfilter_kernels(PyObject *self, PyObject *_) {
+  const bloomfilter_kernel_t *kernel;
+  PyObject *name;
+  PyObject *retval = PyList_New(0);
+  if (!retval)
     return NULL;
+  for (kernel = bloomfilter_kernels; kernel->name; ++kernel) {
+    if (!bloomfilter_kernel_supported(kernel))
+      continue;
+    #ifdef IS_PY3K
+    name = PyUnicode_FromString(kernel->name);
+    #else
+    name = PyString_FromString(kernel->name);
+    #endif
+    if (!name || PyList_Append(retval, name)) {
+      Py_XDECREF(name);
+      Py_DECREF(retval);
+      return NULL;
+    }
+    Py_DECREF(name);
   }
-  return smbo;
+  return retval;
 }
 
+static PyObject *
+peloton_bloomfilter_use_kernel(PyObject *self, PyObject *args) {
+  const bloomfilter_kernel_t *kernel;
+  const char *name;
+  if (!PyArg_ParseTuple(args, "s", &name))
+    return NULL;
+  for (kernel = bloomfilter_kernels; kernel->name; ++kernel) {
+    if (!strcmp(kernel->name, name) && bloomfilter_kernel_supported(kernel)) {
+      bloomfilter_kernel = kernel;
+      Py_RETURN_NONE;
+    }
+  }
+  PyErr_Format(PyExc_ValueError, "kernel %s is not available", name);
+  return NULL;
+}
 
 static PyMethodDef peloton_bloomfiltermodule_methods[] = {
+  {"upgrade_file", peloton_bloomfilter_upgrade_file, METH_VARARGS, "Rewrite a shared filter file in the current format"},
   {"_compute_unsigned_magic_info", peloton_bloomfilter_compute_unsigned_magic_info, METH_VARARGS | METH_KEYWORDS, "Compute divide by multiply constants"},
+  {"_kernels", peloton_bloomfilter_kernels, METH_NOARGS, "List the batch kernels supported by this CPU"},
+  {"_use_kernel", peloton_bloomfilter_use_kernel, METH_VARARGS, "Select the batch kernel"},
     {NULL, NULL, 0, NULL}
 };
 
+/* The types are static, so one set serves every import; the module
+   object only gets references to them.  Free-threaded builds are told
+   that the module needs no GIL. */
+
+static int
+peloton_bloomfilters_exec(PyObject *m) {
+  if (PyType_Ready(&SharedMemoryBloomfilterType) < 0 ||
+      PyType_Ready(&ThreadSafeBloomfilterType) < 0 ||
+      PyType_Ready(&BloomfilterType) < 0 ||
+      PyType_Ready(&SharedMemoryCountingBloomfilterType) < 0 ||
+      PyType_Ready(&CountingBloomfilterType) < 0 ||
+      PyType_Ready(&SharedMemoryScalableBloomfilterType) < 0 ||
+      PyType_Ready(&ScalableBloomfilterType) < 0 ||
+      PyType_Ready(&FrozenFilterType) < 0)
+    return -1;
+
+  bloomfilter_select_kernel();
+
+  Py_INCREF(&SharedMemoryBloomfilterType);
+  PyModule_AddObject(m, "SharedMemoryBloomFilter", (PyObject *)&SharedMemoryBloomfilterType);
+  Py_INCREF(&ThreadSafeBloomfilterType);
+  PyModule_AddObject(m, "ThreadSafeBloomFilter", (PyObject *)&ThreadSafeBloomfilterType);
+  Py_INCREF(&BloomfilterType);
+  PyModule_AddObject(m, "BloomFilter", (PyObject *)&BloomfilterType);
+  Py_INCREF(&SharedMemoryCountingBloomfilterType);
+  PyModule_AddObject(m, "SharedMemoryCountingBloomFilter", (PyObject *)&SharedMemoryCountingBloomfilterType);
+  Py_INCREF(&CountingBloomfilterType);
+  PyModule_AddObject(m, "CountingBloomFilter", (PyObject *)&CountingBloomfilterType);
+  Py_INCREF(&SharedMemoryScalableBloomfilterType);
+  PyModule_AddObject(m, "SharedMemoryScalableBloomFilter", (PyObject *)&SharedMemoryScalableBloomfilterType);
+  Py_INCREF(&ScalableBloomfilterType);
+  PyModule_AddObject(m, "ScalableBloomFilter", (PyObject *)&ScalableBloomfilterType);
+  Py_INCREF(&FrozenFilterType);
+  PyModule_AddObject(m, "FrozenFilter", (PyObject *)&FrozenFilterType);
+  return 0;
+}
+
 #ifdef IS_PY3K
 
+static PyModuleDef_Slot peloton_bloomfilters_slots[] = {
+  {Py_mod_exec, peloton_bloomfilters_exec},
+#ifdef Py_mod_multiple_interpreters
+  {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+  {0, NULL}
+};
+
 static struct PyModuleDef moduledef = {
         PyModuleDef_HEAD_INIT,
         "peloton_bloomfilters",
         NULL,
         0,
         peloton_bloomfiltermodule_methods,
-        NULL,
+        peloton_bloomfilters_slots,
         NULL,
         NULL,
         NULL
@@ -792,23 +6155,14 @@ static struct PyModuleDef moduledef = {
 
 PyMODINIT_FUNC
 PyInit_peloton_bloomfilters(void) {
-  PyObject *m = PyModule_Create(&moduledef);
+  return PyModuleDef_Init(&moduledef);
+}
 
 #else
 PyMODINIT_FUNC
 initpeloton_bloomfilters(void) {
   PyObject *m = Py_InitModule("peloton_bloomfilters", peloton_bloomfiltermodule_methods);
-
+  if (m)
+    peloton_bloomfilters_exec(m);
+}
 #endif
-
-  Py_INCREF(&SharedMemoryBloomfilterType);
-  PyModule_AddObject(m, "SharedMemoryBloomFilter", (PyObject *)&SharedMemoryBloomfilterType);
-  Py_INCREF(&ThreadSafeBloomfilterType);
-  PyModule_AddObject(m, "ThreadSafeBloomFilter", (PyObject *)&ThreadSafeBloomfilterType);
-  Py_INCREF(&BloomfilterType);
-  PyModule_AddObject(m, "BloomFilter", (PyObject *)&BloomfilterType);
-
- #ifdef IS_PY3K
- return m;
- #endif
-};
@@ -23,5 +23,6 @@ setup(name='peloton_bloomfilters_py3',
           "Programming Language :: Python :: 3",
           "Programming Language :: Python :: 3.5",
           "Programming Language :: Python :: 3.6",
+          "Programming Language :: Python :: Free Threading :: 2 - Beta",
       ]
 )
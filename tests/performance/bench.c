@@ -0,0 +1,266 @@
+/* Native benchmark of the filter kernels, without the interpreter.
+
+   Built from the module source itself, so it times exactly the code the
+   extension runs:
+
+     make -C tests/performance bench
+     tests/performance/bench --json > before.json
+
+   For every capacity, error rate and layout it fills a private filter to
+   capacity and reports ns/op, Mops/s and, where perf_event_open is
+   allowed, last level cache misses per op for add, contains of present
+   keys (hit) and of absent keys (miss), one at a time and batched. */
+
+#include<Python.h>
+
+// There is no interpreter here, so the paths that release the GIL just run
+#undef Py_BEGIN_ALLOW_THREADS
+#undef Py_END_ALLOW_THREADS
+#define Py_BEGIN_ALLOW_THREADS {
+#define Py_END_ALLOW_THREADS }
+
+#include "../../peloton_bloomfiltersmodule.c"
+
+#ifdef __linux__
+#include<linux/perf_event.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#endif
+
+#define BENCH_MIN_OPS ((uint64_t)1 << 22) // keys are replayed until this many ops were timed
+#define BENCH_MAX_CAPACITIES 16
+
+typedef struct {
+  const char *name;
+  int layout;
+  int probing;
+} bench_layout_t;
+
+static const bench_layout_t bench_layouts[] = {
+  {"scatter", LAYOUT_SCATTER, PROBE_CHAIN},
+  {"double", LAYOUT_SCATTER, PROBE_DOUBLE},
+  {"blocked", LAYOUT_BLOCKED, PROBE_CHAIN},
+  {NULL}
+};
+
+enum {BENCH_ADD, BENCH_HIT, BENCH_MISS, BENCH_ADD_MANY, BENCH_HIT_MANY, BENCH_MISS_MANY, BENCH_OPS};
+
+static const char *bench_op_names[BENCH_OPS] = {
+  "add", "contains_hit", "contains_miss", "add_many", "contains_many_hit", "contains_many_miss"
+};
+
+typedef struct {
+  uint64_t ops;
+  uint64_t ns;
+  uint64_t positives;
+  int64_t cache_misses; // -1 without perf_event
+} bench_result_t;
+
+static volatile uint64_t bench_sink;
+
+// Cache misses are counted for this process in user space only, so an unprivileged run can still open them
+
+static int open_cache_misses(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void counter_start(int fd) {
+#ifdef __linux__
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static int64_t counter_stop(int fd) {
+  uint64_t count;
+#ifdef __linux__
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) == sizeof(count))
+      return count;
+  }
+#endif
+  return -1;
+}
+
+static uint64_t *make_hashes(uint64_t first, uint64_t n) {
+  uint64_t *hashes = malloc(n * sizeof(uint64_t));
+  uint64_t i, key;
+  if (!hashes)
+    return NULL;
+  // The hashes stable_hash=True gives 8 byte keys
+  for (i=0; i<n; ++i) {
+    key = first + i;
+    hashes[i] = xxh64_bytes(&key, sizeof(key), 0);
+  }
+  return hashes;
+}
+
+static void run_op(bloomfilter_t *bf, int op, const uint64_t *hashes, uint64_t n, char *out, int fd, bench_result_t *result) {
+  uint64_t rounds = (BENCH_MIN_OPS + n - 1) / n;
+  uint64_t round, i, positives = 0;
+  uint64_t start;
+
+  counter_start(fd);
+  start = monotonic_ns();
+  for (round=0; round<rounds; ++round) {
+    switch (op) {
+    case BENCH_ADD:
+      for (i=0; i<n; ++i)
+        bloomfilter_insert(bf, hashes[i], 0);
+      break;
+    case BENCH_HIT:
+    case BENCH_MISS:
+      for (i=0; i<n; ++i)
+        positives += bloomfilter_lookup(bf, hashes[i]);
+      break;
+    case BENCH_ADD_MANY:
+      bloomfilter_insert_many(bf, hashes, n, 0);
+      break;
+    default:
+      bloomfilter_lookup_many(bf, hashes, n, out);
+      for (i=0; i<n; ++i)
+        positives += out[i];
+    }
+  }
+  result->ns = monotonic_ns() - start;
+  result->cache_misses = counter_stop(fd);
+  result->ops = rounds * n;
+  result->positives = positives;
+  bench_sink += positives;
+}
+
+static void print_result(FILE *stream, int json, int *first, const char *kernel, uint64_t capacity, double error_rate,
+                         const char *layout, int op, const bench_result_t *result) {
+  double ns = (double)result->ns / result->ops;
+  double positives = op == BENCH_HIT || op == BENCH_MISS || op == BENCH_HIT_MANY || op == BENCH_MISS_MANY
+    ? (double)result->positives / result->ops : 0;
+
+  if (json) {
+    fprintf(stream, "%s\n  {\"kernel\": \"%s\", \"capacity\": %llu, \"error_rate\": %g, \"layout\": \"%s\", "
+            "\"op\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f, \"mops\": %.3f, \"positive_ratio\": %.6f, ",
+            *first ? "[" : ",", kernel, (unsigned long long)capacity, error_rate, layout, bench_op_names[op],
+            (unsigned long long)result->ops, ns, 1e3 / ns, positives);
+    if (result->cache_misses < 0)
+      fprintf(stream, "\"cache_misses_per_op\": null}");
+    else
+      fprintf(stream, "\"cache_misses_per_op\": %.4f}", (double)result->cache_misses / result->ops);
+  } else {
+    if (*first)
+      fprintf(stream, "kernel,capacity,error_rate,layout,op,ops,ns_per_op,mops,positive_ratio,cache_misses_per_op\n");
+    fprintf(stream, "%s,%llu,%g,%s,%s,%llu,%.3f,%.3f,%.6f,", kernel, (unsigned long long)capacity, error_rate,
+            layout, bench_op_names[op], (unsigned long long)result->ops, ns, 1e3 / ns, positives);
+    if (result->cache_misses < 0)
+      fprintf(stream, "\n");
+    else
+      fprintf(stream, "%.4f\n", (double)result->cache_misses / result->ops);
+  }
+  *first = 0;
+}
+
+static int usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--json | --csv] [--quick] [--kernel scalar|avx2|avx512] [--capacity N]... [--error-rate E]...\n", argv0);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  uint64_t capacities[BENCH_MAX_CAPACITIES] = {10000, 100000, 1000000, 10000000};
+  double error_rates[BENCH_MAX_CAPACITIES] = {0.01, 0.001};
+  int capacity_count = 4, error_rate_count = 2;
+  int user_capacities = 0, user_error_rates = 0;
+  const bloomfilter_kernel_t *kernel;
+  const bench_layout_t *layout;
+  bloomfilter_options_t options = {.layout = LAYOUT_SCATTER, .hash = HASH_STABLE, .probing = PROBE_CHAIN, .sizing = SIZING_EXACT, .generations = 1};
+  bench_result_t result;
+  bloomfilter_t *bf;
+  uint64_t *present, *absent;
+  char *out;
+  int json = 1, quick = 0, first = 1, fd, c, e, op, i;
+
+  bloomfilter_select_kernel();
+  for (i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "--json"))
+      json = 1;
+    else if (!strcmp(argv[i], "--csv"))
+      json = 0;
+    else if (!strcmp(argv[i], "--quick"))
+      quick = 1;
+    else if (!strcmp(argv[i], "--kernel") && i + 1 < argc) {
+      ++i;
+      for (kernel = bloomfilter_kernels; kernel->name; ++kernel)
+        if (!strcmp(kernel->name, argv[i]) && bloomfilter_kernel_supported(kernel))
+          break;
+      if (!kernel->name) {
+        fprintf(stderr, "%s: kernel %s is not available on this CPU\n", argv[0], argv[i]);
+        return 2;
+      }
+      bloomfilter_kernel = kernel;
+    } else if (!strcmp(argv[i], "--capacity") && i + 1 < argc && user_capacities < BENCH_MAX_CAPACITIES) {
+      capacities[user_capacities++] = strtoull(argv[++i], NULL, 10);
+      capacity_count = user_capacities;
+    } else if (!strcmp(argv[i], "--error-rate") && i + 1 < argc && user_error_rates < BENCH_MAX_CAPACITIES) {
+      error_rates[user_error_rates++] = strtod(argv[++i], NULL);
+      error_rate_count = user_error_rates;
+    } else
+      return usage(argv[0]);
+  }
+  // --quick keeps to a filter in cache and one in memory
+  if (quick && !user_capacities) {
+    capacities[1] = 1000000;
+    capacity_count = 2;
+  }
+
+  if ((fd = open_cache_misses()) < 0)
+    fprintf(stderr, "%s: perf_event_open failed (%s), cache misses are not reported\n", argv[0], strerror(errno));
+  for (c=0; c<capacity_count; ++c) {
+    if (!capacities[c])
+      return usage(argv[0]);
+    present = make_hashes(0, capacities[c]);
+    absent = make_hashes(capacities[c], capacities[c]);
+    out = malloc(capacities[c]);
+    if (!present || !absent || !out) {
+      perror(argv[0]);
+      return 1;
+    }
+    for (e=0; e<error_rate_count; ++e)
+      for (layout = bench_layouts; layout->name; ++layout) {
+        options.layout = layout->layout;
+        options.probing = layout->probing;
+        if (!(bf = create_private_bloomfilter(capacities[c], error_rates[e], &options))) {
+          fprintf(stderr, "%s: cannot create a filter of %llu at %g: %s\n", argv[0],
+                  (unsigned long long)capacities[c], error_rates[e], strerror(errno));
+          return 1;
+        }
+        for (op=0; op<BENCH_OPS; ++op) {
+          // The batched add starts from an empty filter again, so both adds see the same fill
+          if (op == BENCH_ADD_MANY)
+            memset(bf->bits, 0, bloomfilter_words(bf) * sizeof(uint64_t));
+          run_op(bf, op, op == BENCH_MISS || op == BENCH_MISS_MANY ? absent : present, capacities[c], out, fd, &result);
+          print_result(stdout, json, &first, bloomfilter_kernel->name, capacities[c], error_rates[e], layout->name, op, &result);
+        }
+        peloton_bloomfilter_destroy(bf);
+      }
+    free(present);
+    free(absent);
+    free(out);
+  }
+  if (json)
+    printf(first ? "[]\n" : "\n]\n");
+  if (fd >= 0)
+    close(fd);
+  return 0;
+}
@@ -0,0 +1,397 @@
+/* Contention benchmark for shared filters.
+
+     make -C tests/performance contention
+     tests/performance/contention --workers 1,8,48 --batch 1,64 --json > run.json
+
+   For every mode (processes or threads), worker count, operation and
+   batch size it creates a fresh filter file, starts the workers on it
+   together and reports aggregate throughput, the latency percentiles of
+   a sample of calls and the clears and rotations the run caused.
+   Processes each map the file themselves, like separate interpreters;
+   threads share one mapping, like threads sharing one filter object.
+
+   Operations, all with the atomic paths SharedMemoryBloomFilter uses:
+     add       charge the counter, then set the bits (add / add_many)
+     contains  look the key up (in / contains_many)
+     mixed     one add in ten, lookups otherwise
+     counter   only the atomic decrement of the shared counter
+     insert    only the __atomic_or_fetch bit sets
+     plain     the same bit sets without atomics, as the baseline for
+               insert (and racy, so bits may be lost) */
+
+#include<Python.h>
+
+// There is no interpreter here, so the paths that release the GIL just run
+#undef Py_BEGIN_ALLOW_THREADS
+#undef Py_END_ALLOW_THREADS
+#define Py_BEGIN_ALLOW_THREADS {
+#define Py_END_ALLOW_THREADS }
+
+#include "../../peloton_bloomfiltersmodule.c"
+
+#include<sys/wait.h>
+
+#define MAX_WORKERS 256
+#define MAX_LIST 32
+#define SAMPLE_EVERY 64 // one call in this many is timed on its own
+#define KEY_WINDOW 65536 // hashes each worker cycles through
+
+enum {OP_ADD, OP_CONTAINS, OP_MIXED, OP_COUNTER, OP_INSERT, OP_PLAIN, OP_COUNT};
+
+static const char *op_names[OP_COUNT] = {"add", "contains", "mixed", "counter", "insert", "plain"};
+
+// Lives in a MAP_SHARED mapping made before forking, so processes report through it too
+
+typedef struct {
+  volatile int ready;
+  volatile int go;
+  uint64_t start[MAX_WORKERS];
+  uint64_t end[MAX_WORKERS];
+  uint64_t ops[MAX_WORKERS];
+  uint64_t sample_count[MAX_WORKERS];
+  uint64_t samples[]; // samples_per_worker per worker
+} shared_run_t;
+
+typedef struct {
+  const char *path;
+  const bloomfilter_options_t *options;
+  double error_rate;
+  bloomfilter_t *bf; // shared by threads, NULL for processes
+  shared_run_t *run;
+  int worker;
+  int op;
+  uint64_t batch;
+  uint64_t calls;
+  uint64_t samples_per_worker;
+} worker_t;
+
+static uint64_t timer_ns;
+
+static void do_call(bloomfilter_t *bf, int op, const uint64_t *hashes, uint64_t batch, char *out, uint64_t call) {
+  uint64_t i;
+  if (op == OP_MIXED)
+    op = call % 10 ? OP_CONTAINS : OP_ADD;
+  switch (op) {
+  case OP_ADD:
+    if (batch == 1) {
+      bloomfilter_count(bf, 1);
+      bloomfilter_insert(bf, hashes[0], 1);
+    } else {
+      // bloomfilter_add_batch without the GIL handling
+      uint64_t start = 0;
+      for (i=0; i<batch; ++i)
+        if (bloomfilter_count(bf, 1) && !bf->epoch)
+          start = i;
+      bloomfilter_insert_many(bf, hashes + start, batch - start, 1);
+    }
+    break;
+  case OP_CONTAINS:
+    if (batch == 1)
+      out[0] = bloomfilter_lookup(bf, hashes[0]);
+    else
+      bloomfilter_lookup_many(bf, hashes, batch, out);
+    break;
+  case OP_COUNTER:
+    bloomfilter_count(bf, 1);
+    break;
+  case OP_INSERT:
+  case OP_PLAIN:
+    if (batch == 1)
+      bloomfilter_insert(bf, hashes[0], op == OP_INSERT);
+    else
+      bloomfilter_insert_many(bf, hashes, batch, op == OP_INSERT);
+    break;
+  }
+}
+
+static void *run_worker(void *arg) {
+  worker_t *w = arg;
+  shared_run_t *run = w->run;
+  bloomfilter_t *bf = w->bf;
+  uint64_t *hashes, *samples = run->samples + w->worker * w->samples_per_worker;
+  uint64_t call, key, offset = 0, sampled = 0, t;
+  char *out;
+  int fd = -1;
+
+  if (!bf) {
+    if ((fd = open(w->path, O_RDWR)) < 0 || !(bf = create_bloomfilter(fd, 0, w->error_rate, w->options))) {
+      perror(w->path);
+      _exit(1);
+    }
+  }
+  hashes = malloc((KEY_WINDOW + w->batch) * sizeof(uint64_t));
+  out = malloc(w->batch);
+  if (!hashes || !out) {
+    perror("malloc");
+    _exit(1);
+  }
+  for (key=0; key<KEY_WINDOW + w->batch; ++key)
+    hashes[key] = xxh64(((uint64_t)w->worker << 40 | (key % KEY_WINDOW)) + 1);
+
+  __atomic_add_fetch(&run->ready, 1, __ATOMIC_SEQ_CST);
+  while (!__atomic_load_n(&run->go, __ATOMIC_ACQUIRE))
+    sched_yield();
+
+  run->start[w->worker] = monotonic_ns();
+  for (call=0; call<w->calls; ++call) {
+    if (call % SAMPLE_EVERY == 0 && sampled < w->samples_per_worker) {
+      t = monotonic_ns();
+      do_call(bf, w->op, hashes + offset, w->batch, out, call);
+      samples[sampled++] = monotonic_ns() - t;
+    } else {
+      do_call(bf, w->op, hashes + offset, w->batch, out, call);
+    }
+    offset += w->batch;
+    if (offset >= KEY_WINDOW)
+      offset -= KEY_WINDOW;
+  }
+  run->end[w->worker] = monotonic_ns();
+  run->ops[w->worker] = w->calls * w->batch;
+  run->sample_count[w->worker] = sampled;
+
+  free(hashes);
+  free(out);
+  if (!w->bf)
+    peloton_shared_memory_bloomfilter_destroy(bf);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, uint64_t n, double p) {
+  double ns;
+  if (!n)
+    return 0;
+  ns = (double)sorted[(uint64_t)(p * (n - 1))] - timer_ns;
+  return ns > 0 ? ns : 0;
+}
+
+static uint64_t measure_timer(void) {
+  uint64_t best = UINT64_MAX, t, i;
+  for (i=0; i<1000; ++i) {
+    t = monotonic_ns();
+    t = monotonic_ns() - t;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+static int parse_list(const char *arg, uint64_t *list) {
+  int n = 0;
+  char *end;
+  while (*arg && n < MAX_LIST) {
+    list[n++] = strtoull(arg, &end, 10);
+    if (end == arg || !list[n - 1])
+      return 0;
+    arg = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      return 0;
+  }
+  return n;
+}
+
+static int usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--json | --csv] [--file PATH] [--mode process|thread|both] [--workers N,N...]\n"
+          "       [--batch N,N...] [--op add|contains|mixed|counter|insert|plain]... [--calls N]\n"
+          "       [--capacity N] [--error-rate E] [--layout scatter|double|blocked] [--generations G]\n", argv0);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL, *layout_name = "scatter";
+  char default_path[64];
+  uint64_t workers[MAX_LIST], batches[MAX_LIST] = {1, 64};
+  int worker_count = 0, batch_count = 2;
+  int modes[2] = {1, 1}; // processes, threads
+  int ops[OP_COUNT] = {0}, user_ops = 0;
+  uint64_t calls_per_worker = 1 << 20, capacity = 1000000;
+  double error_rate = 0.01;
+  bloomfilter_options_t options = {.layout = LAYOUT_SCATTER, .hash = HASH_STABLE, .probing = PROBE_CHAIN, .sizing = SIZING_EXACT, .generations = 1};
+  int json = 1, first = 1, mode, w, b, op, i, fd;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  bloomfilter_select_kernel();
+  for (i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "--json"))
+      json = 1;
+    else if (!strcmp(argv[i], "--csv"))
+      json = 0;
+    else if (i + 1 == argc)
+      return usage(argv[0]);
+    else if (!strcmp(argv[i], "--file"))
+      path = argv[++i];
+    else if (!strcmp(argv[i], "--mode")) {
+      ++i;
+      modes[0] = !strcmp(argv[i], "process") || !strcmp(argv[i], "both");
+      modes[1] = !strcmp(argv[i], "thread") || !strcmp(argv[i], "both");
+      if (!modes[0] && !modes[1])
+        return usage(argv[0]);
+    } else if (!strcmp(argv[i], "--workers")) {
+      if (!(worker_count = parse_list(argv[++i], workers)))
+        return usage(argv[0]);
+    } else if (!strcmp(argv[i], "--batch")) {
+      if (!(batch_count = parse_list(argv[++i], batches)))
+        return usage(argv[0]);
+    } else if (!strcmp(argv[i], "--op")) {
+      ++i;
+      for (op=0; op<OP_COUNT && strcmp(op_names[op], argv[i]); ++op);
+      if (op == OP_COUNT)
+        return usage(argv[0]);
+      ops[op] = user_ops = 1;
+    } else if (!strcmp(argv[i], "--calls"))
+      calls_per_worker = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--capacity"))
+      capacity = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--error-rate"))
+      error_rate = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "--generations"))
+      options.generations = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--layout")) {
+      layout_name = argv[++i];
+      if (!strcmp(layout_name, "double"))
+        options.probing = PROBE_DOUBLE;
+      else if (!strcmp(layout_name, "blocked"))
+        options.layout = LAYOUT_BLOCKED;
+      else if (strcmp(layout_name, "scatter"))
+        return usage(argv[0]);
+    } else
+      return usage(argv[0]);
+  }
+  if (!calls_per_worker || !capacity || options.generations < 1 || options.generations > MAX_GENERATIONS)
+    return usage(argv[0]);
+  if (!user_ops)
+    for (op=0; op<OP_COUNT; ++op)
+      ops[op] = 1;
+  // Powers of two up to the number of CPUs, and the number of CPUs itself
+  if (!worker_count) {
+    for (w=1; w < cpus && worker_count < MAX_LIST - 1; w *= 2)
+      workers[worker_count++] = w;
+    workers[worker_count++] = cpus > 1 ? cpus : 2;
+  }
+  for (w=0; w<worker_count; ++w)
+    if (workers[w] > MAX_WORKERS)
+      return usage(argv[0]);
+  if (!path) {
+    snprintf(default_path, sizeof(default_path), "%s/peloton_contention.%d",
+             access("/dev/shm", W_OK) ? "/tmp" : "/dev/shm", (int)getpid());
+    path = default_path;
+  }
+  timer_ns = measure_timer();
+
+  if (!json)
+    printf("mode,workers,op,batch,layout,generations,capacity,ops,seconds,mops,ns_per_op,"
+           "p50_ns,p90_ns,p99_ns,p999_ns,clears,rotations\n");
+  for (mode=0; mode<2; ++mode)
+    for (w=0; w<worker_count; ++w)
+      for (op=0; op<OP_COUNT; ++op)
+        for (b=0; b<batch_count; ++b) {
+          uint64_t n = workers[w], samples_per_worker = calls_per_worker / SAMPLE_EVERY + 1;
+          uint64_t calls = (calls_per_worker + batches[b] - 1) / batches[b];
+          size_t run_size = sizeof(shared_run_t) + n * samples_per_worker * sizeof(uint64_t);
+          uint64_t total_ops = 0, start = UINT64_MAX, end = 0, sample_total = 0, *sorted, k, clears, rotations;
+          worker_t jobs[MAX_WORKERS];
+          pthread_t threads[MAX_WORKERS];
+          pid_t pids[MAX_WORKERS];
+          shared_run_t *run;
+          bloomfilter_t *bf;
+          double seconds;
+          int status, failed = 0;
+
+          if (!modes[mode] || !ops[op] || (batches[b] > 1 && (op == OP_COUNTER)))
+            continue;
+          unlink(path);
+          if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 ||
+              !(bf = create_bloomfilter(fd, capacity, error_rate, &options))) {
+            perror(path);
+            return 1;
+          }
+          run = mmap(NULL, run_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+          if (run == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+          }
+          memset(run, 0, run_size);
+          for (i=0; i<(int)n; ++i) {
+            jobs[i] = (worker_t){path, &options, error_rate, mode ? bf : NULL, run, i, op, batches[b], calls, samples_per_worker};
+            if (mode) {
+              if (pthread_create(threads + i, NULL, run_worker, jobs + i)) {
+                perror("pthread_create");
+                return 1;
+              }
+            } else if (!(pids[i] = fork())) {
+              run_worker(jobs + i);
+              _exit(0);
+            } else if (pids[i] < 0) {
+              perror("fork");
+              return 1;
+            }
+          }
+          while (__atomic_load_n(&run->ready, __ATOMIC_ACQUIRE) < (int)n)
+            sched_yield();
+          __atomic_store_n(&run->go, 1, __ATOMIC_RELEASE);
+          for (i=0; i<(int)n; ++i) {
+            if (mode)
+              pthread_join(threads[i], NULL);
+            else if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+              failed = 1;
+          }
+          if (failed) {
+            fprintf(stderr, "%s: a worker failed\n", argv[0]);
+            return 1;
+          }
+
+          for (i=0; i<(int)n; ++i) {
+            total_ops += run->ops[i];
+            start = run->start[i] < start ? run->start[i] : start;
+            end = run->end[i] > end ? run->end[i] : end;
+            sample_total += run->sample_count[i];
+          }
+          if (!(sorted = malloc((sample_total + 1) * sizeof(uint64_t)))) {
+            perror("malloc");
+            return 1;
+          }
+          for (i=0, k=0; i<(int)n; ++i) {
+            memcpy(sorted + k, run->samples + i * samples_per_worker, run->sample_count[i] * sizeof(uint64_t));
+            k += run->sample_count[i];
+          }
+          qsort(sorted, sample_total, sizeof(uint64_t), compare_u64);
+          clears = __atomic_load_n(bf->shared_stats + STAT_CLEARS * STATS_STRIDE, __ATOMIC_RELAXED);
+          rotations = __atomic_load_n(bf->shared_stats + STAT_ROTATIONS * STATS_STRIDE, __ATOMIC_RELAXED);
+          seconds = (end - start) / 1e9;
+
+          if (json)
+            printf("%s\n  {\"mode\": \"%s\", \"workers\": %llu, \"op\": \"%s\", \"batch\": %llu, \"layout\": \"%s\", "
+                   "\"generations\": %d, \"capacity\": %llu, \"ops\": %llu, \"seconds\": %.6f, \"mops\": %.3f, "
+                   "\"ns_per_op\": %.3f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, "
+                   "\"clears\": %llu, \"rotations\": %llu}",
+                   first ? "[" : ",", mode ? "thread" : "process", (unsigned long long)n, op_names[op],
+                   (unsigned long long)batches[b], layout_name, options.generations, (unsigned long long)capacity,
+                   (unsigned long long)total_ops, seconds, total_ops / seconds / 1e6, seconds * 1e9 * n / total_ops,
+                   percentile(sorted, sample_total, 0.5), percentile(sorted, sample_total, 0.9),
+                   percentile(sorted, sample_total, 0.99), percentile(sorted, sample_total, 0.999),
+                   (unsigned long long)clears, (unsigned long long)rotations);
+          else
+            printf("%s,%llu,%s,%llu,%s,%d,%llu,%llu,%.6f,%.3f,%.3f,%.0f,%.0f,%.0f,%.0f,%llu,%llu\n",
+                   mode ? "thread" : "process", (unsigned long long)n, op_names[op], (unsigned long long)batches[b],
+                   layout_name, options.generations, (unsigned long long)capacity, (unsigned long long)total_ops,
+                   seconds, total_ops / seconds / 1e6, seconds * 1e9 * n / total_ops,
+                   percentile(sorted, sample_total, 0.5), percentile(sorted, sample_total, 0.9),
+                   percentile(sorted, sample_total, 0.99), percentile(sorted, sample_total, 0.999),
+                   (unsigned long long)clears, (unsigned long long)rotations);
+          fflush(stdout);
+          first = 0;
+
+          free(sorted);
+          munmap(run, run_size);
+          peloton_shared_memory_bloomfilter_destroy(bf);
+        }
+  if (json)
+    printf(first ? "[]\n" : "\n]\n");
+  unlink(path);
+  return 0;
+}
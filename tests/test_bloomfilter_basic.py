@@ -1,4 +1,13 @@
+import io
+import os
+import pickle
+import struct
+import subprocess
+import sys
 import tempfile
+import threading
+import time
+from array import array
 from unittest import TestCase
 
 import peloton_bloomfilters
@@ -27,6 +36,174 @@ class TestDivideByMultiple(TestCase):
             self.assert_divides(x)
 
 
+class TestKernels(TestCase):
+
+    def test_kernels_agree(self):
+        hashes = array('Q', ((i * 0x9E3779B97F4A7C15) % 2 ** 64 for i in range(1, 1001)))
+        probes = array('Q', ((i * 0xC2B2AE3D27D4EB4F) % 2 ** 64 for i in range(1, 2001)))
+        results = set()
+        try:
+            for kernel in peloton_bloomfilters._kernels():
+                peloton_bloomfilters._use_kernel(kernel)
+                for cls in (peloton_bloomfilters.BloomFilter, peloton_bloomfilters.ThreadSafeBloomFilter):
+                    bf = cls(1000, 0.01, double_hashing=True)
+                    bf.add_hashes(hashes)
+                    self.assertEqual(b"\x01" * 1000, bf.contains_hashes(hashes))
+                    results.add((bf.population(), bf.contains_hashes(probes)))
+        finally:
+            peloton_bloomfilters._use_kernel(peloton_bloomfilters._kernels()[-1])
+        self.assertEqual(1, len(results))
+
+    def test_merge_kernels_agree(self):
+        results = set()
+        try:
+            for kernel in peloton_bloomfilters._kernels():
+                peloton_bloomfilters._use_kernel(kernel)
+                for cls in (peloton_bloomfilters.BloomFilter, peloton_bloomfilters.ThreadSafeBloomFilter):
+                    a, b = cls(1000, 0.01), cls(1000, 0.01)
+                    a.add_many(range(0, 1000, 2))
+                    b.add_many(range(0, 1000, 3))
+                    union, intersection = a | b, a & b
+                    a &= b
+                    results.add((union.population(), intersection.population(), a.population()))
+        finally:
+            peloton_bloomfilters._use_kernel(peloton_bloomfilters._kernels()[-1])
+        self.assertEqual(1, len(results))
+
+    def test_popcount_kernels_agree(self):
+        # Large enough to be split over two threads
+        bf = peloton_bloomfilters.BloomFilter(15000000, 0.01)
+        bf.add_hashes(array('Q', (i * 0x9e3779b97f4a7c15 & 0xffffffffffffffff for i in range(100000))))
+        results = set()
+        try:
+            for kernel in peloton_bloomfilters._kernels():
+                peloton_bloomfilters._use_kernel(kernel)
+                results.add((bf.population(), bf.population(threads=4)))
+        finally:
+            peloton_bloomfilters._use_kernel(peloton_bloomfilters._kernels()[-1])
+        self.assertEqual(1, len(results))
+        population, threaded = results.pop()
+        self.assertEqual(population, threaded)
+        self.assertGreater(population, 90000)
+
+    def test_unknown_kernel(self):
+        self.assertIn("scalar", peloton_bloomfilters._kernels())
+        self.assertRaises(ValueError, peloton_bloomfilters._use_kernel, "mmx")
+
+
+class TestMappingOptions(TestCase):
+
+    def assert_works(self, bloomfilter):
+        bloomfilter.add_many(range(100))
+        self.assertEqual(b"\x01" * 100, bloomfilter.contains_many(range(100)))
+        self.assertNotIn(100, bloomfilter)
+
+    def test_private(self):
+        for cls in (peloton_bloomfilters.BloomFilter, peloton_bloomfilters.ThreadSafeBloomFilter):
+            self.assert_works(cls(1000, 0.001, huge_pages=True, populate=True))
+            self.assert_works(cls(1000, 0.001, populate=True, lock=True))
+            self.assert_works(cls(10 ** 6, 0.001))
+
+    def test_shared(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.001, huge_pages=True, populate=True)
+            self.assert_works(bf)
+            self.assertEqual(0, os.path.getsize(f.name) % (2 << 20))
+            bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.001, populate=True, lock=True)
+            self.assertEqual(b"\x01" * 100, bf2.contains_many(range(100)))
+
+    def test_bad_error_rate(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter, 1000, 1.5)
+        with tempfile.NamedTemporaryFile() as f:
+            self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter, f.name, 1000, 0)
+
+
+class TestFileFormat(TestCase):
+    V2 = struct.Struct("<24sQQQdQQQQQQQ")
+    V1 = struct.Struct("<24sQdQQQQQQ16x")
+
+    def make_v1(self, path, blocked=False):
+        # Rewrite a version 2 file the way earlier releases laid it out
+        with open(path, "rb") as f:
+            data = f.read()
+        (magic, version, bits_offset, capacity, error_rate, probes, bit_count,
+         layout, hash, seed, probing, sizing) = self.V2.unpack_from(data)
+        counter, = struct.unpack_from("<Q", data, 128)
+        header = self.V1.pack(b"SharedMemory BloomFilter", capacity, error_rate, counter,
+                              layout, hash, seed, probing, sizing)
+        if blocked:
+            header += b"\0" * 24
+        with open(path, "wb") as f:
+            f.write(header + data[bits_offset:bits_offset + bit_count // 8])
+
+    def test_v2_header(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, blocked=True, seed=7)
+            bf.add(1)
+            data = open(f.name, "rb").read()
+            fields = self.V2.unpack_from(data)
+            self.assertEqual((b"Peloton Bloom Filter v2\0", 2, 4096, 1000, 0.01, 7), fields[:6])
+            self.assertEqual((1, 1, 7, 0, 0), fields[7:])
+            self.assertEqual(0, fields[6] % 512)
+            self.assertEqual(4096 + fields[6] // 8, len(data))
+            self.assertEqual((999,), struct.unpack_from("<Q", data, 128))
+
+    def test_read_and_upgrade_v1(self):
+        for blocked in (False, True):
+            with tempfile.NamedTemporaryFile() as f:
+                bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, blocked=blocked)
+                bf.add_many(range(100))
+                del bf
+                self.make_v1(f.name, blocked)
+                bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01)
+                self.assertEqual(b"\x01" * 100, bf.contains_many(range(100)))
+                population = bf.population()
+
+                self.assertTrue(peloton_bloomfilters.upgrade_file(f.name))
+                self.assertFalse(peloton_bloomfilters.upgrade_file(f.name))
+                bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01)
+                self.assertEqual(b"\x01" * 100, bf.contains_many(range(100)))
+                self.assertEqual(population, bf.population())
+                self.assertEqual(b"Peloton Bloom Filter v2\0", open(f.name, "rb").read(24))
+                self.assertEqual((900,), struct.unpack_from("<Q", open(f.name, "rb").read(136), 128))
+
+    def test_read_and_upgrade_first_release(self):
+        # The first release wrote magic, capacity, error rate and counter, and mapped its bits at 104
+        with tempfile.NamedTemporaryFile() as f:
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 500, 0.01, stable_hash=False)
+            bf.add_many(range(500))
+            data = open(f.name, "rb").read()
+            bits_offset, bit_count = struct.unpack_from("<Q", data, 32)[0], struct.unpack_from("<Q", data, 64)[0]
+            del bf
+            header = b"SharedMemory BloomFilter" + struct.pack("<QdQ", 500, 0.01, 0)
+            header += b"\0" * (104 - len(header))
+            with open(f.name, "wb") as out:
+                out.write(header + data[bits_offset:bits_offset + bit_count // 8])
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 500, 0.01)
+            self.assertEqual(b"\x01" * 500, bf.contains_many(range(500)))
+            del bf
+            self.assertTrue(peloton_bloomfilters.upgrade_file(f.name))
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 500, 0.01)
+            self.assertEqual(b"\x01" * 500, bf.contains_many(range(500)))
+            self.assertEqual(500, len(bf))
+
+    def test_created_sparse(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 10 ** 8, 0.01)
+            stats = os.stat(f.name)
+            self.assertGreater(stats.st_size, 100 << 20)
+            self.assertLess(stats.st_blocks * 512, 1 << 20)
+            bf.add(1)
+            self.assertIn(1, peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 10 ** 8, 0.01))
+
+    def test_not_a_filter(self):
+        with tempfile.NamedTemporaryFile() as f:
+            f.write(b"x" * 4096)
+            f.flush()
+            self.assertRaises(IOError, peloton_bloomfilters.SharedMemoryBloomFilter, f.name, 1000, 0.01)
+            self.assertRaises(IOError, peloton_bloomfilters.upgrade_file, f.name)
+
+
 class BloomFilterCase(object):
     def test_add(self):
         self.assertEqual(0, len(self.bloomfilter))
@@ -45,15 +222,121 @@ class BloomFilterCase(object):
             self.assertNotIn(i, self.bloomfilter)
         self.assertIn(50, self.bloomfilter)
 
+    def test_add_many(self):
+        self.assertFalse(self.bloomfilter.add_many(range(40)))
+        self.assertEqual(40, len(self.bloomfilter))
+        for i in range(40):
+            self.assertIn(i, self.bloomfilter)
+        self.assertEqual(b"\x01" * 40 + b"\x00" * 10,
+                         self.bloomfilter.contains_many(range(50)))
+        self.assertEqual(b"", self.bloomfilter.contains_many([]))
+
+    def test_add_many_capacity(self):
+        self.assertTrue(self.bloomfilter.add_many(range(60)))
+        for i in range(50):
+            self.assertNotIn(i, self.bloomfilter)
+        for i in range(50, 60):
+            self.assertIn(i, self.bloomfilter)
+
+    def test_add_many_unhashable(self):
+        self.assertRaises(TypeError, self.bloomfilter.add_many, [1, []])
+        self.assertRaises(TypeError, self.bloomfilter.contains_many, 5)
+
+    def test_add_hashes(self):
+        self.assertFalse(self.bloomfilter.add_hashes(array('Q', range(40))))
+        self.assertEqual(40, len(self.bloomfilter))
+        for i in range(40):
+            self.assertIn(i, self.bloomfilter)
+        self.assertEqual(b"\x01" * 40 + b"\x00" * 10,
+                         self.bloomfilter.contains_hashes(array('Q', range(50))))
+        out = bytearray(50)
+        self.assertIs(out, self.bloomfilter.contains_hashes(memoryview(array('q', range(50))), out=out))
+        self.assertEqual(bytearray(b"\x01" * 40 + b"\x00" * 10), out)
+
+    def test_add_hash(self):
+        self.assertFalse(self.bloomfilter.add_hash(7))
+        self.assertFalse(self.bloomfilter.add_hash(-1))
+        self.assertTrue(self.bloomfilter.contains_hash(7))
+        self.assertTrue(self.bloomfilter.contains_hash(2 ** 64 - 1))
+        self.assertFalse(self.bloomfilter.contains_hash(8))
+        self.assertEqual(b"\x01\x01", self.bloomfilter.contains_hashes(array('Q', [7, 2 ** 64 - 1])))
+        self.assertIn(7, self.bloomfilter)
+        self.assertRaises(TypeError, self.bloomfilter.add_hash, "7")
+
+    def test_add_if_absent(self):
+        self.assertTrue(self.bloomfilter.add_if_absent("5"))
+        self.assertFalse(self.bloomfilter.add_if_absent("5"))
+        self.assertIn("5", self.bloomfilter)
+        self.assertEqual(1, len(self.bloomfilter))
+
+    def test_add_if_absent_capacity(self):
+        for i in range(50):
+            self.assertTrue(self.bloomfilter.add_if_absent(i))
+            self.assertFalse(self.bloomfilter.add_if_absent(i))
+        self.assertEqual(50, len(self.bloomfilter))
+        self.assertTrue(self.bloomfilter.add_if_absent(50))
+        self.assertIn(50, self.bloomfilter)
+
+    def test_add_many_if_absent(self):
+        self.bloomfilter.add_many(range(10))
+        self.assertEqual(b"\x00" * 10 + b"\x01" * 20, self.bloomfilter.add_many_if_absent(range(30)))
+        self.assertEqual(b"\x01\x00", self.bloomfilter.add_many_if_absent([30, 30]))
+        self.assertEqual(b"\x00\x01", self.bloomfilter.add_hashes_if_absent(array('Q', [30, 31])))
+        self.assertEqual(b"\x01" * 32, self.bloomfilter.contains_hashes(array('Q', range(32))))
+        self.assertEqual(32, len(self.bloomfilter))
+        self.assertEqual(b"", self.bloomfilter.add_many_if_absent([]))
+
+    def test_add_many_if_absent_capacity(self):
+        self.assertEqual(b"\x01" * 60, self.bloomfilter.add_many_if_absent(range(60)))
+        for i in range(50, 60):
+            self.assertIn(i, self.bloomfilter)
+
+    def test_add_hashes_bad_buffers(self):
+        self.assertRaises(TypeError, self.bloomfilter.add_hashes, array('I', range(4)))
+        self.assertRaises(TypeError, self.bloomfilter.add_hashes, b"12345678")
+        self.assertRaises(ValueError, self.bloomfilter.contains_hashes, array('Q', range(4)), bytearray(3))
+        self.assertRaises(BufferError, self.bloomfilter.contains_hashes, array('Q', range(4)), b"1234")
+
+    def test_contains_hashes_arguments(self):
+        hashes = array('Q', range(4))
+        self.assertEqual(b"\x00" * 4, self.bloomfilter.contains_hashes(hashes=hashes))
+        self.assertRaises(TypeError, self.bloomfilter.contains_hashes)
+        self.assertRaises(TypeError, self.bloomfilter.contains_hashes, hashes, None, None)
+        self.assertRaises(TypeError, self.bloomfilter.contains_hashes, hashes, hashes=hashes)
+        self.assertRaises(TypeError, self.bloomfilter.contains_hashes, hashes, output=None)
+
 
 class TestBloomFilter(TestCase, BloomFilterCase):
     def setUp(self):
         self.bloomfilter = peloton_bloomfilters.BloomFilter(50, 0.001)
 
+class TestStableHashBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.BloomFilter(50, 0.001, stable_hash=True, seed=7)
+
 class TestThreadSafeBloomFilter(TestCase, BloomFilterCase):
     def setUp(self):
         self.bloomfilter = peloton_bloomfilters.ThreadSafeBloomFilter(50, 0.001)
 
+    def test_threads(self):
+        bf = peloton_bloomfilters.ThreadSafeBloomFilter(80000, 0.001, stable_hash=True)
+
+        def add(start):
+            for i in range(start, 80000, 8):
+                bf.add(str(i))
+
+        threads = [threading.Thread(target=add, args=(start,)) for start in range(8)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(80000, len(bf))
+        self.assertEqual(b"\x01" * 80000, bf.contains_many([str(i) for i in range(80000)]))
+
+    def test_no_file_to_flush(self):
+        self.assertFalse(hasattr(self.bloomfilter, "snapshot"))
+        self.assertFalse(hasattr(self.bloomfilter, "flush"))
+
 
 class TestSharedMemoryBloomFilter(TestCase, BloomFilterCase):
     def setUp(self):
@@ -98,3 +381,838 @@ class TestSharedMemoryBloomFilter(TestCase, BloomFilterCase):
         self.assertIn(50, bf1)
         self.assertIn(50, bf2)
 
+    def test_stable_hash_across_processes(self):
+        for seed in ("1", "2"):
+            env = dict(os.environ, PYTHONHASHSEED=seed)
+            subprocess.check_call([
+                sys.executable, "-c",
+                "import sys, peloton_bloomfilters;"
+                "bf = peloton_bloomfilters.SharedMemoryBloomFilter(sys.argv[1], 50, 0.001);"
+                "bf.add(u'text-' + sys.argv[2]); bf.add(b'bytes-' + sys.argv[2].encode())",
+                self.fd.name, seed], env=env)
+        for seed in ("1", "2"):
+            self.assertIn(u"text-" + seed, self.bloomfilter)
+            self.assertIn(b"bytes-" + seed.encode(), self.bloomfilter)
+        self.assertNotIn(u"text-3", self.bloomfilter)
+
+    def test_seed_in_header(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bf1 = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 50, 0.001, seed=1234)
+            bf1.add("x" * 100)
+            bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 50, 0.001)
+            self.assertIn("x" * 100, bf2)
+
+
+class TestBlockedBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.BloomFilter(50, 0.001, blocked=True)
+
+class TestBlockedThreadSafeBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.ThreadSafeBloomFilter(50, 0.001, blocked=True)
+
+
+class TestBlockedSharedMemoryBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001, blocked=True)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_layout_in_header(self):
+        self.bloomfilter.add(1)
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        self.assertIn(1, bf2)
+        bf2.add(2)
+        self.assertIn(2, self.bloomfilter)
+
+
+class TestDoubleHashingBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.BloomFilter(50, 0.001, double_hashing=True)
+
+
+class TestDoubleHashingSharedMemoryBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001, double_hashing=True)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_probing_in_header(self):
+        self.bloomfilter.add_many(range(20))
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        self.assertEqual(b"\x01" * 20, bf2.contains_many(range(20)))
+
+
+class TestPowerOfTwoBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.BloomFilter(50, 0.001, power_of_two=True)
+
+
+class TestPowerOfTwoSharedMemoryBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(
+            self.fd.name, 50, 0.001, double_hashing=True, power_of_two=True)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_sizing_in_header(self):
+        self.bloomfilter.add_many(range(20))
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        self.assertEqual(b"\x01" * 20, bf2.contains_many(range(20)))
+        self.assertEqual(self.bloomfilter.population(), bf2.population())
+
+
+class TestSetAlgebra(TestCase):
+    def setUp(self):
+        self.a = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        self.b = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        self.a.add_many(range(0, 300))
+        self.b.add_many(range(200, 500))
+
+    def test_union(self):
+        union = self.a | self.b
+        self.assertIsInstance(union, peloton_bloomfilters.BloomFilter)
+        self.assertEqual(b"\x01" * 500, union.contains_many(range(500)))
+        self.assertEqual(600, len(union))
+        self.assertEqual(300, len(self.a))
+        self.assertNotIn(400, self.a)
+
+    def test_intersection(self):
+        intersection = self.a & self.b
+        self.assertEqual(b"\x01" * 100, intersection.contains_many(range(200, 300)))
+        self.assertLess(intersection.contains_many(range(500)).count(b"\x01"), 120)
+        self.assertEqual(300, len(intersection))
+
+    def test_inplace(self):
+        a = self.a
+        a |= self.b
+        self.assertIs(self.a, a)
+        self.assertEqual(b"\x01" * 500, a.contains_many(range(500)))
+        a &= self.b
+        self.assertEqual(b"\x01" * 300, a.contains_many(range(200, 500)))
+
+    def test_union_saturates(self):
+        full = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        full.add_many(range(1000, 1999))
+        self.assertEqual(1000, len(self.a | full))
+
+    def test_shared(self):
+        with tempfile.NamedTemporaryFile() as f:
+            shared = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, stable_hash=False)
+            other = peloton_bloomfilters.SharedMemoryBloomFilter(f.name)
+            shared.add(1000)
+            union = shared | self.a
+            self.assertIsInstance(union, peloton_bloomfilters.BloomFilter)
+            self.assertEqual(b"\x01" * 301, union.contains_many(list(range(300)) + [1000]))
+            shared |= self.b
+            self.assertEqual(b"\x01" * 300, other.contains_many(range(200, 500)))
+            self.assertEqual(301, len(other))
+
+    def test_merge_file(self):
+        with tempfile.NamedTemporaryFile() as f:
+            shared = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, stable_hash=False)
+            shared.add_many(range(700, 800))
+            self.a.merge(f.name)
+            self.assertEqual(b"\x01" * 100, self.a.contains_many(range(700, 800)))
+            self.assertEqual(400, len(self.a))
+            self.a.merge(self.b)
+            self.assertEqual(b"\x01" * 500, self.a.contains_many(range(500)))
+            stable = peloton_bloomfilters.BloomFilter(1000, 0.01, stable_hash=True)
+            self.assertRaises(ValueError, stable.merge, f.name)
+        self.assertRaises(IOError, self.a.merge, f.name)
+        self.assertRaises(TypeError, self.a.merge, 42)
+
+    def test_incompatible(self):
+        for other in (peloton_bloomfilters.BloomFilter(2000, 0.01),
+                      peloton_bloomfilters.BloomFilter(1000, 0.001),
+                      peloton_bloomfilters.BloomFilter(1000, 0.01, stable_hash=True),
+                      peloton_bloomfilters.BloomFilter(1000, 0.01, blocked=True),
+                      peloton_bloomfilters.BloomFilter(1000, 0.01, double_hashing=True)):
+            self.assertRaises(ValueError, lambda: self.a | other)
+            self.assertRaises(ValueError, self.a.merge, other)
+        counting = peloton_bloomfilters.CountingBloomFilter(1000, 0.01)
+        self.assertRaises(TypeError, lambda: self.a | counting)
+        self.assertRaises(TypeError, lambda: self.a & 3)
+        with tempfile.NamedTemporaryFile() as f:
+            rotating = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, stable_hash=False, generations=2)
+            self.assertRaises(ValueError, lambda: self.a | rotating)
+            self.assertRaises(ValueError, self.a.merge, f.name)
+
+
+class TestSerialization(TestCase):
+    def test_round_trip(self):
+        for cls in (peloton_bloomfilters.BloomFilter, peloton_bloomfilters.ThreadSafeBloomFilter):
+            for kwargs in ({}, {"blocked": True}, {"double_hashing": True, "power_of_two": True},
+                           {"stable_hash": True, "seed": 7}):
+                bf = cls(1000, 0.01, **kwargs)
+                bf.add_many(range(300))
+                for copy in (cls.from_bytes(bf.to_bytes()), pickle.loads(pickle.dumps(bf, -1))):
+                    self.assertIsInstance(copy, cls)
+                    self.assertEqual(bf.to_bytes(), copy.to_bytes())
+                    self.assertEqual(300, len(copy))
+                    self.assertEqual(b"\x01" * 300, copy.contains_many(range(300)))
+
+    def test_counting(self):
+        cbf = peloton_bloomfilters.CountingBloomFilter(1000, 0.01, counter_bits=8)
+        cbf.add_many(range(100))
+        copy = pickle.loads(pickle.dumps(cbf))
+        self.assertTrue(copy.remove(5))
+        self.assertNotIn(5, copy)
+        self.assertIn(5, cbf)
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter.from_bytes, cbf.to_bytes())
+        self.assertRaises(ValueError, peloton_bloomfilters.CountingBloomFilter.from_bytes,
+                          peloton_bloomfilters.BloomFilter(1000, 0.01).to_bytes())
+
+    def test_buffer(self):
+        bf = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        bf.add_many(range(300))
+        view = memoryview(bf)
+        self.assertTrue(view.readonly)
+        self.assertEqual(bf.to_bytes()[-len(view):], view.tobytes())
+        self.assertEqual(bf.population(), sum(bin(b).count("1") for b in bytearray(view)))
+        view.release()
+        io.BytesIO(b"\xff" * len(bf.to_bytes())).readinto(bf)
+        self.assertIn("anything", bf)
+
+    def test_shared(self):
+        with tempfile.NamedTemporaryFile() as f:
+            smbf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, double_hashing=True)
+            smbf.add_many(range(300))
+            copy = pickle.loads(pickle.dumps(smbf))
+            self.assertIsInstance(copy, peloton_bloomfilters.SharedMemoryBloomFilter)
+            copy.add(1000)
+            self.assertIn(1000, smbf)
+            self.assertEqual(301, len(smbf))
+            with open(f.name, "rb") as data:
+                bf = peloton_bloomfilters.BloomFilter.from_bytes(data.read())
+            self.assertEqual(b"\x01" * 300, bf.contains_many(range(300)))
+            self.assertEqual(smbf.to_bytes(), bf.to_bytes())
+            self.assertEqual(len(smbf.to_bytes()) - 192, len(memoryview(smbf)))
+
+    def test_shared_counting(self):
+        with tempfile.NamedTemporaryFile() as f:
+            cbf = peloton_bloomfilters.SharedMemoryCountingBloomFilter(f.name, 1000, 0.01)
+            cbf.add(1)
+            copy = pickle.loads(pickle.dumps(cbf))
+            copy.remove(1)
+            self.assertNotIn(1, cbf)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter.from_bytes, b"not a filter")
+        data = peloton_bloomfilters.BloomFilter(1000, 0.01).to_bytes()
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter.from_bytes, data[:-8])
+        self.assertRaises(TypeError, peloton_bloomfilters.BloomFilter.from_bytes, 42)
+        with tempfile.NamedTemporaryFile() as f:
+            rotating = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, generations=2)
+            self.assertRaises(ValueError, rotating.to_bytes)
+
+
+class TestCompressed(TestCase):
+    def test_round_trip(self):
+        for keys in (0, 1, 100, 1000, 10000):
+            for kwargs in ({}, {"blocked": True}, {"double_hashing": True, "power_of_two": True}):
+                bf = peloton_bloomfilters.BloomFilter(10000, 0.01, **kwargs)
+                bf.add_many(range(keys))
+                data = bf.export_compressed()
+                copy = peloton_bloomfilters.BloomFilter(10000, 0.01, **kwargs)
+                copy.import_compressed(data)
+                self.assertEqual(bf.to_bytes(), copy.to_bytes())
+                self.assertEqual(keys, len(copy))
+
+    def test_sparse_is_smaller(self):
+        bf = peloton_bloomfilters.BloomFilter(100000, 0.001)
+        raw = len(bf.to_bytes())
+        self.assertLess(len(bf.export_compressed()), 200)
+        bf.add_many(range(1000))
+        self.assertLess(len(bf.export_compressed()), raw / 10)
+        bf.add_many(range(1000, 90000))
+        self.assertGreater(len(bf.export_compressed()), raw - 200)
+
+    def test_merges(self):
+        a = peloton_bloomfilters.ThreadSafeBloomFilter(1000, 0.01)
+        b = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        a.add_many(range(100))
+        b.add_many(range(100, 200))
+        a.import_compressed(b.export_compressed())
+        self.assertEqual(b"\x01" * 200, a.contains_many(range(200)))
+        self.assertEqual(200, len(a))
+        with tempfile.NamedTemporaryFile() as f:
+            smbf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, stable_hash=False)
+            smbf.import_compressed(a.export_compressed())
+            self.assertEqual(b"\x01" * 200, smbf.contains_many(range(200)))
+
+    def test_invalid(self):
+        bf = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        bf.add_many(range(10))
+        data = bf.export_compressed()
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter(2000, 0.01).import_compressed, data)
+        self.assertRaises(ValueError, bf.import_compressed, data[:-8])
+        self.assertRaises(ValueError, bf.import_compressed, bf.to_bytes())
+        self.assertRaises(ValueError, bf.import_compressed, data[:-8] + b"\xff" * 8)
+        with tempfile.NamedTemporaryFile() as f:
+            rotating = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01, generations=2)
+            self.assertRaises(ValueError, rotating.export_compressed)
+
+
+class TestStats(TestCase):
+    def test_counters(self):
+        bf = peloton_bloomfilters.BloomFilter(1000, 0.01)
+        bf.add(1)
+        bf.add_many(range(2, 10))
+        bf.add_hashes(array('Q', [10, 11]))
+        self.assertIn(1, bf)
+        self.assertNotIn(-1, bf)
+        bf.contains_many([1, 2, -2])
+        bf.contains_hashes(array('Q', [10, 12]))
+        stats = bf.stats()
+        self.assertEqual(11, stats["adds"])
+        self.assertEqual(7, stats["lookups"])
+        self.assertEqual(4, stats["positives"])
+        self.assertEqual(0, stats["clears"])
+        bf.add_many(range(1000, 2500))
+        bf.clear()
+        stats = bf.stats()
+        self.assertEqual(2, stats["clears"])
+        self.assertGreater(stats["clear_seconds"], 0)
+        self.assertEqual(0, stats["fill_ratio"])
+
+    def test_estimates(self):
+        for kwargs, delta in (({"double_hashing": True}, 0.02), ({"blocked": True}, 0.02), ({}, 0.1)):
+            bf = peloton_bloomfilters.BloomFilter(100000, 0.01, stable_hash=True, **kwargs)
+            keys = [str(i) for i in range(100000)]
+            bf.add_many(keys)
+            stats = bf.stats()
+            self.assertAlmostEqual(100000, stats["estimated_cardinality"], delta=100000 * delta)
+            fpr = bf.contains_many(str(-i) for i in range(1, 100001)).count(b"\x01") / 100000.0
+            self.assertAlmostEqual(fpr, stats["estimated_fpr"], delta=max(fpr, 0.0005))
+        cbf = peloton_bloomfilters.CountingBloomFilter(10000, 0.01)
+        cbf.add_many(range(10000))
+        self.assertAlmostEqual(10000, cbf.stats()["estimated_cardinality"], delta=500)
+
+    def test_estimators(self):
+        a = peloton_bloomfilters.BloomFilter(100000, 0.01, blocked=True)
+        b = peloton_bloomfilters.BloomFilter(100000, 0.01, blocked=True)
+        a.add_many(range(0, 40000))
+        b.add_many(range(20000, 60000))
+        self.assertAlmostEqual(a.stats()["estimated_cardinality"], a.estimate_cardinality(threads=2))
+        self.assertAlmostEqual(40000, a.estimate_cardinality(), delta=800)
+        self.assertAlmostEqual(60000, a.estimate_union_size(b), delta=1200)
+        self.assertAlmostEqual(60000, b.estimate_union_size(a, threads=8), delta=1200)
+        self.assertAlmostEqual(1 / 3.0, a.estimate_jaccard(b), delta=0.03)
+        self.assertAlmostEqual(1, a.estimate_jaccard(a), delta=0.001)
+        empty = peloton_bloomfilters.BloomFilter(100000, 0.01, blocked=True)
+        self.assertEqual(1, empty.estimate_jaccard(peloton_bloomfilters.BloomFilter(100000, 0.01, blocked=True)))
+        self.assertAlmostEqual(0, a.estimate_jaccard(empty), delta=0.001)
+        self.assertRaises(ValueError, a.estimate_jaccard, peloton_bloomfilters.BloomFilter(100000, 0.01))
+        self.assertRaises(TypeError, a.estimate_union_size, peloton_bloomfilters.CountingBloomFilter(100000, 0.01))
+        self.assertRaises(ValueError, a.population, threads=0)
+
+    def test_shared(self):
+        with tempfile.NamedTemporaryFile() as f:
+            a = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 100, 0.01, generations=2)
+            b = peloton_bloomfilters.SharedMemoryBloomFilter(f.name)
+            a.add_many(range(150))
+            b.add_many(range(150, 160))
+            b.contains_many(range(10))
+            # Every process adds its counts to the file at least every 4096 operations and on stats()
+            self.assertEqual(10, b.stats()["adds"])
+            for bf in (a, b):
+                stats = bf.stats()
+                self.assertEqual(160, stats["adds"])
+                self.assertEqual(10, stats["lookups"])
+                self.assertEqual(1, stats["rotations"])
+            with open(f.name, "rb") as data:
+                header = data.read(640)
+            stats_offset, = struct.unpack("<Q", header[152:160])
+            self.assertEqual(256, stats_offset)
+            self.assertEqual(160, struct.unpack("<Q", header[256:264])[0])
+            self.assertEqual(10, struct.unpack("<Q", header[320:328])[0])
+
+    def test_file_without_stats(self):
+        with tempfile.NamedTemporaryFile() as f:
+            peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 100, 0.01)
+            with open(f.name, "r+b") as data:
+                data.seek(152)
+                data.write(b"\0" * 8)
+            bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name)
+            bf.add(1)
+            del bf
+            with open(f.name, "rb") as data:
+                header = data.read(264)
+            self.assertEqual((256, 1), struct.unpack("<Q", header[152:160]) + struct.unpack("<Q", header[256:264]))
+
+
+class TestFrozenFilter(TestCase):
+    def test_members(self):
+        for n in (0, 1, 10, 1000, 50000):
+            ff = peloton_bloomfilters.FrozenFilter(range(n))
+            self.assertEqual(n, len(ff))
+            self.assertEqual(b"\x01" * n, ff.contains_many(range(n)))
+            self.assertTrue(all(i in ff for i in range(n)))
+        self.assertNotIn(0, peloton_bloomfilters.FrozenFilter([]))
+
+    def test_false_positives(self):
+        ff = peloton_bloomfilters.FrozenFilter(range(100000))
+        self.assertLess(ff.nbytes() * 8 / 100000.0, 10)
+        fpr = ff.contains_many(range(100000, 300000)).count(b"\x01") / 200000.0
+        self.assertAlmostEqual(1 / 256.0, fpr, delta=0.001)
+
+    def test_duplicates(self):
+        ff = peloton_bloomfilters.FrozenFilter(["a", "b", "a"] * 100)
+        self.assertEqual(2, len(ff))
+        self.assertIn("a", ff)
+
+    def test_hashes(self):
+        hashes = array('Q', range(1, 1001))
+        ff = peloton_bloomfilters.FrozenFilter.from_hashes(hashes, stable_hash=False)
+        self.assertEqual(b"\x01" * 1000, ff.contains_hashes(hashes))
+        # Hashes match what add_hashes takes, so small ints line up with their keys
+        self.assertIn(500, ff)
+        self.assertRaises(TypeError, peloton_bloomfilters.FrozenFilter.from_hashes, b"abc")
+
+    def test_stable_hash(self):
+        keys = [str(i) for i in range(1000)]
+        ff = peloton_bloomfilters.FrozenFilter(keys, stable_hash=True, seed=7)
+        self.assertEqual(b"\x01" * 1000, ff.contains_many(keys))
+        self.assertEqual(b"\x01" * 1000, ff.contains_many(k.encode() for k in keys))
+
+    def test_save_and_open(self):
+        ff = peloton_bloomfilters.FrozenFilter([str(i) for i in range(5000)])
+        with tempfile.NamedTemporaryFile() as f:
+            ff.save(f.name)
+            opened = peloton_bloomfilters.FrozenFilter.open(f.name)
+            self.assertEqual(5000, len(opened))
+            self.assertEqual(ff.contains_many(str(i) for i in range(10000)),
+                             opened.contains_many(str(i) for i in range(10000)))
+            self.assertEqual(4096 + ff.nbytes(), os.path.getsize(f.name))
+            script = "import peloton_bloomfilters, sys; ff = peloton_bloomfilters.FrozenFilter.open(sys.argv[1]); print('4999' in ff)"
+            self.assertEqual(b"True", subprocess.check_output([sys.executable, "-c", script, f.name]).strip())
+        with tempfile.NamedTemporaryFile() as f:
+            f.write(b"not a filter" * 1000)
+            f.flush()
+            self.assertRaises(ValueError, peloton_bloomfilters.FrozenFilter.open, f.name)
+        self.assertRaises(IOError, peloton_bloomfilters.FrozenFilter.open, "/nonexistent/frozen")
+
+    def test_malformed_header(self):
+        # (segment_count + 2) * segment_length wraps around to array_length
+        header = struct.pack("<24s11Q", b"Peloton Frozen Filter", 1, 4096, 1, 1, 0, 0, 2 ** 18, 2 ** 46 - 1, 2 ** 18, 0, 0)
+        with tempfile.NamedTemporaryFile() as f:
+            f.write(header)
+            f.truncate(4096 + 2 ** 18)
+            f.flush()
+            self.assertRaises(ValueError, peloton_bloomfilters.FrozenFilter.open, f.name)
+
+    def test_save_over_open_file(self):
+        with tempfile.NamedTemporaryFile() as f:
+            peloton_bloomfilters.FrozenFilter(str(i) for i in range(5000)).save(f.name)
+            opened = peloton_bloomfilters.FrozenFilter.open(f.name)
+            peloton_bloomfilters.FrozenFilter(["a", "b"]).save(f.name)
+            self.assertEqual(b"\x01" * 5000, opened.contains_many(str(i) for i in range(5000)))
+            self.assertEqual(2, len(peloton_bloomfilters.FrozenFilter.open(f.name)))
+            self.assertEqual([os.path.basename(f.name)],
+                             [name for name in os.listdir(os.path.dirname(f.name)) if name.startswith(os.path.basename(f.name))])
+
+    def test_save_across_processes(self):
+        with tempfile.NamedTemporaryFile() as f:
+            save = "import peloton_bloomfilters, sys; peloton_bloomfilters.FrozenFilter('k%d' % i for i in range(1000)).save(sys.argv[1])"
+            check = ("import peloton_bloomfilters, sys; ff = peloton_bloomfilters.FrozenFilter.open(sys.argv[1]); "
+                     "assert ff.contains_many('k%d' % i for i in range(1000)) == b'\\x01' * 1000")
+            subprocess.check_call([sys.executable, "-c", save, f.name], env=dict(os.environ, PYTHONHASHSEED="1"))
+            subprocess.check_call([sys.executable, "-c", check, f.name], env=dict(os.environ, PYTHONHASHSEED="2"))
+            ff = peloton_bloomfilters.FrozenFilter(["k%d" % i for i in range(1000)], stable_hash=False)
+            self.assertRaises(ValueError, ff.save, f.name)
+
+
+class TestRotatingSharedMemoryBloomFilter(TestCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001, generations=2)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_rotation(self):
+        for i in range(50):
+            self.assertFalse(self.bloomfilter.add(i))
+        self.assertTrue(self.bloomfilter.add(50))
+        self.assertEqual(b"\x01" * 51, self.bloomfilter.contains_many(range(51)))
+        for i in range(51, 101):
+            self.assertFalse(self.bloomfilter.add(i))
+        self.assertTrue(self.bloomfilter.add(101))
+        self.assertEqual(b"\x00" * 50, self.bloomfilter.contains_many(range(50)))
+        self.assertEqual(b"\x01" * 52, self.bloomfilter.contains_many(range(50, 102)))
+
+    def test_add_if_absent_rotation(self):
+        self.bloomfilter.add_many(range(40))
+        self.assertTrue(self.bloomfilter.add_many(range(40, 60)))
+        self.assertFalse(self.bloomfilter.add_if_absent(0))
+        self.assertEqual(b"\x00" * 60 + b"\x01", self.bloomfilter.add_many_if_absent(range(61)))
+
+    def test_add_many_rotation(self):
+        self.assertFalse(self.bloomfilter.add_many(range(40)))
+        self.assertTrue(self.bloomfilter.add_many(range(40, 60)))
+        self.assertEqual(b"\x01" * 60, self.bloomfilter.contains_many(range(60)))
+        self.assertEqual(b"\x01" * 60, self.bloomfilter.contains_hashes(array('Q', range(60))))
+
+    def test_shared_rotation(self):
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        bfs = [self.bloomfilter, bf2]
+        for i in range(150):
+            bfs[i % 2].add(i)
+        for bf in bfs:
+            self.assertNotIn(0, bf)
+            self.assertEqual(b"\x01" * 49, bf.contains_many(range(101, 150)))
+            self.assertEqual(self.bloomfilter.population(), bf.population())
+
+    def test_clear(self):
+        self.bloomfilter.add_many(range(120))
+        self.bloomfilter.clear()
+        self.assertEqual(0, self.bloomfilter.population())
+        self.assertEqual(0, len(self.bloomfilter))
+        self.bloomfilter.add(1)
+        self.assertIn(1, self.bloomfilter)
+
+    def test_bad_generations(self):
+        for generations in (0, 65):
+            self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter,
+                              self.fd.name, 50, 0.001, generations=generations)
+
+
+class TestExpiringSharedMemoryBloomFilter(TestCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001, generations=2, window=0.2)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_expiry(self):
+        self.bloomfilter.add(1)
+        self.assertIn(1, self.bloomfilter)
+        time.sleep(0.5)
+        self.assertNotIn(1, self.bloomfilter)
+        self.assertEqual(0, self.bloomfilter.population())
+        self.assertGreater(self.bloomfilter.stats()['rotations'], 0)
+
+    def test_capacity_does_not_rotate(self):
+        self.assertFalse(self.bloomfilter.add_many(range(200)))
+        self.assertEqual(b"\x01" * 200, self.bloomfilter.contains_many(range(200)))
+        self.assertEqual(50, len(self.bloomfilter))
+
+    def test_shared_window(self):
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        self.bloomfilter.add(1)
+        self.assertIn(1, bf2)
+        time.sleep(0.5)
+        self.assertNotIn(1, bf2)
+        bf2.add(2)
+        self.assertIn(2, self.bloomfilter)
+
+    def test_bad_window(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter,
+                          self.fd.name + "-other", 50, 0.001, window=1)
+        self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter,
+                          self.fd.name + "-other", 50, 0.001, generations=2, window=-1)
+        for window in (float("nan"), float("inf"), 2e10):
+            self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter,
+                              self.fd.name + "-other", 50, 0.001, generations=2, window=window)
+
+
+class TestSnapshotSharedMemoryBloomFilter(TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, "filter")
+        self.snapshot = os.path.join(self.dir, "snapshot")
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.path, 100000, 0.01, double_hashing=True,
+                                                                        track_pages=True)
+
+    def tearDown(self):
+        for name in os.listdir(self.dir):
+            os.unlink(os.path.join(self.dir, name))
+        os.rmdir(self.dir)
+
+    def test_snapshot(self):
+        self.bloomfilter.add_many(range(1000))
+        self.assertGreater(self.bloomfilter.snapshot(self.snapshot), 0)
+        self.bloomfilter.add(-1)
+        copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+        self.assertEqual(b"\x01" * 1000, copy.contains_many(range(1000)))
+        self.assertNotIn(-1, copy)
+        self.assertEqual(1000, len(copy))
+        self.assertEqual(os.path.getsize(self.path), os.path.getsize(self.snapshot))
+        self.assertEqual([], [name for name in os.listdir(self.dir) if name.endswith(".snapshot")])
+
+    def test_incremental_flush(self):
+        self.bloomfilter.add_many(range(1000))
+        self.bloomfilter.snapshot(self.snapshot)
+        self.assertEqual(0, self.bloomfilter.flush())
+        self.bloomfilter.add(-1)
+        # Double hashing sets at most one bit per probe
+        self.assertLessEqual(self.bloomfilter.flush(), 7)
+        copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+        self.assertIn(-1, copy)
+        self.assertEqual(1001, len(copy))
+
+    def test_flush_sees_other_processes(self):
+        self.bloomfilter.snapshot(self.snapshot)
+        other = peloton_bloomfilters.SharedMemoryBloomFilter(self.path)
+        other.add_hashes(array("Q", range(100)))
+        self.assertIsNone(self.bloomfilter.flush(wait=False))
+        self.bloomfilter.flush()
+        self.assertEqual(b"\x01" * 100, peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot).contains_hashes(array("Q", range(100))))
+
+    def test_flushes_of_other_handles(self):
+        other = peloton_bloomfilters.SharedMemoryBloomFilter(self.path)
+        other_snapshot = os.path.join(self.dir, "other")
+        self.bloomfilter.snapshot(self.snapshot)
+        other.snapshot(other_snapshot)
+        self.bloomfilter.add_many(range(1000))
+        self.assertGreater(other.flush(), 0)
+        self.assertGreater(self.bloomfilter.flush(), 0)
+        self.assertEqual(0, self.bloomfilter.flush())
+        self.assertEqual(0, other.flush())
+        other.add(-1)
+        self.assertGreater(other.flush(), 0)
+        self.assertGreater(self.bloomfilter.flush(), 0)
+        for path in (self.snapshot, other_snapshot):
+            copy = peloton_bloomfilters.SharedMemoryBloomFilter(path)
+            self.assertEqual(b"\x01" * 1000, copy.contains_many(range(1000)))
+            self.assertIn(-1, copy)
+
+    def test_flush_without_snapshot_keeps_marks(self):
+        self.bloomfilter.snapshot(self.snapshot)
+        other = peloton_bloomfilters.SharedMemoryBloomFilter(self.path)
+        self.bloomfilter.add_many(range(1000))
+        self.assertGreater(other.flush(), 0)
+        self.assertGreater(self.bloomfilter.flush(), 0)
+        copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+        self.assertEqual(b"\x01" * 1000, copy.contains_many(range(1000)))
+
+    def test_flush_to_replaced_snapshot(self):
+        self.bloomfilter.add_many(range(1000))
+        self.bloomfilter.snapshot(self.snapshot)
+        # Another filter of the same geometry put where the snapshot was
+        other = peloton_bloomfilters.SharedMemoryBloomFilter(os.path.join(self.dir, "other"), 100000, 0.01,
+                                                             double_hashing=True, track_pages=True)
+        other.add_many(range(5000, 6000))
+        other.snapshot(self.snapshot)
+        self.bloomfilter.add(-1)
+        self.assertGreater(self.bloomfilter.flush(), 7)
+        copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+        self.assertEqual(b"\x01" * 1000, copy.contains_many(range(1000)))
+        self.assertIn(-1, copy)
+        self.assertEqual(1001, len(copy))
+
+    def test_racing_snapshots(self):
+        other = peloton_bloomfilters.SharedMemoryBloomFilter(self.path)
+        self.bloomfilter.add_many(range(1000))
+        for _ in range(20):
+            self.bloomfilter.snapshot(self.snapshot, wait=False)
+            other.snapshot(self.snapshot, wait=False)
+            self.bloomfilter.flush()
+            other.flush()
+            copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+            self.assertEqual(b"\x01" * 1000, copy.contains_many(range(1000)))
+        self.assertEqual(["filter", "snapshot"], sorted(os.listdir(self.dir)))
+
+    def test_clear_flushes_everything(self):
+        self.bloomfilter.add_many(range(1000))
+        self.bloomfilter.snapshot(self.snapshot)
+        self.bloomfilter.clear()
+        self.assertGreater(self.bloomfilter.flush(), 7)
+        self.assertEqual(0, peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot).population())
+
+    def test_flush_own_file(self):
+        self.bloomfilter.add(1)
+        self.assertLessEqual(self.bloomfilter.flush(), 7)
+        self.assertEqual(0, self.bloomfilter.flush())
+        self.assertGreater(self.bloomfilter.flush(incremental=False), 0)
+
+    def test_untracked(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 1000, 0.01)
+            bloomfilter.add(1)
+            bloomfilter.snapshot(self.snapshot)
+            bloomfilter.add(2)
+            bloomfilter.flush()
+            copy = peloton_bloomfilters.SharedMemoryBloomFilter(self.snapshot)
+            self.assertIn(1, copy)
+            self.assertIn(2, copy)
+
+    def test_snapshot_errors(self):
+        self.assertRaises(IOError, self.bloomfilter.snapshot, self.path)
+        self.assertRaises(IOError, self.bloomfilter.snapshot, os.path.join(self.dir, "missing", "snapshot"))
+        self.bloomfilter.snapshot(os.path.join(self.dir, "missing", "snapshot"), wait=False)
+        self.assertRaises(IOError, self.bloomfilter.flush)
+        self.bloomfilter.flush()
+
+
+class CountingBloomFilterCase(object):
+    def test_add_if_absent(self):
+        self.assertTrue(self.bloomfilter.add_if_absent(1))
+        self.assertFalse(self.bloomfilter.add_if_absent(1))
+        self.assertTrue(self.bloomfilter.remove(1))
+        self.assertNotIn(1, self.bloomfilter)
+
+    def test_add_remove(self):
+        self.assertFalse(self.bloomfilter.add("5"))
+        self.assertFalse(self.bloomfilter.add("5"))
+        self.assertEqual(2, len(self.bloomfilter))
+        self.assertTrue(self.bloomfilter.remove("5"))
+        self.assertIn("5", self.bloomfilter)
+        self.assertTrue(self.bloomfilter.remove("5"))
+        self.assertNotIn("5", self.bloomfilter)
+        self.assertFalse(self.bloomfilter.remove("5"))
+        self.assertEqual(0, len(self.bloomfilter))
+        self.assertEqual(0, self.bloomfilter.population())
+
+    def test_never_clears(self):
+        self.assertFalse(self.bloomfilter.add_many(range(100)))
+        self.assertEqual(100, len(self.bloomfilter))
+        self.assertEqual(b"\x01" * 100, self.bloomfilter.contains_many(range(100)))
+        for i in range(50):
+            self.assertTrue(self.bloomfilter.remove(i))
+        self.assertEqual(b"\x01" * 50, self.bloomfilter.contains_hashes(array('Q', range(50, 100))))
+        self.assertLess(sum(bytearray(self.bloomfilter.contains_many(range(50)))), 3)
+
+    def test_saturation(self):
+        for i in range(300):
+            self.bloomfilter.add(1)
+        for i in range(300):
+            self.bloomfilter.remove(1)
+        self.assertIn(1, self.bloomfilter)
+
+    def test_clear(self):
+        self.bloomfilter.add_many(range(10))
+        self.bloomfilter.clear()
+        self.assertEqual(0, len(self.bloomfilter))
+        self.assertEqual(0, self.bloomfilter.population())
+
+
+class TestCountingBloomFilter(TestCase, CountingBloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.CountingBloomFilter(50, 0.001)
+
+    def test_counter_bits(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.CountingBloomFilter, 50, 0.001, counter_bits=2)
+
+
+class TestWideCountingBloomFilter(TestCase, CountingBloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.CountingBloomFilter(50, 0.001, counter_bits=8)
+
+
+class TestSharedMemoryCountingBloomFilter(TestCase, CountingBloomFilterCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryCountingBloomFilter(self.fd.name, 50, 0.001)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_shared(self):
+        bf2 = peloton_bloomfilters.SharedMemoryCountingBloomFilter(self.fd.name, 50, 0.001, counter_bits=8)
+        self.bloomfilter.add_many(range(20))
+        self.assertEqual(b"\x01" * 20, bf2.contains_many(range(20)))
+        self.assertTrue(bf2.remove(3))
+        self.assertNotIn(3, self.bloomfilter)
+        self.assertEqual(19, len(self.bloomfilter))
+
+    def test_not_a_counting_filter(self):
+        self.assertRaises(IOError, peloton_bloomfilters.SharedMemoryBloomFilter, self.fd.name, 50, 0.001)
+        with tempfile.NamedTemporaryFile() as f:
+            peloton_bloomfilters.SharedMemoryBloomFilter(f.name, 50, 0.001)
+            self.assertRaises(IOError, peloton_bloomfilters.SharedMemoryCountingBloomFilter, f.name, 50, 0.001)
+
+
+class TestScalableBloomFilter(TestCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.ScalableBloomFilter(100, 0.01)
+
+    def test_grows(self):
+        self.assertEqual(1, self.bloomfilter.segments())
+        for i in range(1000):
+            self.assertFalse(self.bloomfilter.add(i))
+        self.assertEqual(4, self.bloomfilter.segments())
+        self.assertEqual(b"\x01" * 1000, self.bloomfilter.contains_many(range(1000)))
+        self.assertLess(sum(bytearray(self.bloomfilter.contains_many(range(1000, 11000)))), 100)
+
+    def test_add_many(self):
+        self.assertFalse(self.bloomfilter.add_many(range(1000)))
+        self.assertFalse(self.bloomfilter.add_hashes(array('Q', range(1000, 2000))))
+        self.assertEqual(5, self.bloomfilter.segments())
+        self.assertEqual(b"\x01" * 2000, self.bloomfilter.contains_hashes(array('Q', range(2000))))
+
+    def test_duplicates(self):
+        for i in range(10):
+            self.bloomfilter.add_many(range(50))
+            self.bloomfilter.add(7)
+        self.assertEqual(1, self.bloomfilter.segments())
+        self.assertEqual(50, len(self.bloomfilter))
+
+    def test_clear(self):
+        self.bloomfilter.add_many(range(1000))
+        self.bloomfilter.clear()
+        self.assertEqual(1, self.bloomfilter.segments())
+        self.assertEqual(0, len(self.bloomfilter))
+        self.assertEqual(0, self.bloomfilter.population())
+        self.bloomfilter.add_many(range(1000))
+        self.assertEqual(4, self.bloomfilter.segments())
+        self.assertEqual(b"\x01" * 1000, self.bloomfilter.contains_many(range(1000)))
+
+    def test_clear_during_lookups(self):
+        hashes = array('Q', range(100000))
+        stop = []
+        def lookup():
+            while not stop:
+                self.bloomfilter.contains_hashes(hashes)
+        threads = [threading.Thread(target=lookup) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for _ in range(200):
+            self.bloomfilter.add_hashes(hashes[:2000])
+            self.bloomfilter.clear()
+        stop.append(True)
+        for thread in threads:
+            thread.join()
+        self.assertEqual(1, self.bloomfilter.segments())
+
+    def test_bad_arguments(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.ScalableBloomFilter, 100, 0.01, growth=0.5)
+        self.assertRaises(ValueError, peloton_bloomfilters.ScalableBloomFilter, 100, 0.01, tightening=1)
+
+
+class TestSharedMemoryScalableBloomFilter(TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, "filter")
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryScalableBloomFilter(self.path, 100, 0.01)
+
+    def tearDown(self):
+        for name in os.listdir(self.dir):
+            os.unlink(os.path.join(self.dir, name))
+        os.rmdir(self.dir)
+
+    def test_sibling_segments(self):
+        bf2 = peloton_bloomfilters.SharedMemoryScalableBloomFilter(self.path, 100, 0.01)
+        for i in range(1000):
+            [self.bloomfilter, bf2][i % 2].add(i)
+        self.assertEqual(["filter", "filter.1", "filter.2", "filter.3"], sorted(os.listdir(self.dir)))
+        bf3 = peloton_bloomfilters.SharedMemoryScalableBloomFilter(self.path)
+        for bf in (self.bloomfilter, bf2, bf3):
+            self.assertEqual(4, bf.segments())
+            self.assertEqual(b"\x01" * 1000, bf.contains_many(range(1000)))
+            self.assertEqual(len(self.bloomfilter), len(bf))
+
+    def test_clear(self):
+        bf2 = peloton_bloomfilters.SharedMemoryScalableBloomFilter(self.path, 100, 0.01)
+        self.bloomfilter.add_many(range(1000))
+        bf2.clear()
+        self.assertEqual(0, len(self.bloomfilter))
+        self.assertNotIn(500, self.bloomfilter)
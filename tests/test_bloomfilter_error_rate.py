@@ -1,7 +1,7 @@
 from tempfile import NamedTemporaryFile
 from unittest import TestCase
 
-from peloton_bloomfilters import BloomFilter, ThreadSafeBloomFilter, SharedMemoryBloomFilter
+from peloton_bloomfilters import BloomFilter, ThreadSafeBloomFilter, SharedMemoryBloomFilter, CountingBloomFilter
 
 
 
@@ -16,6 +16,50 @@ class Case(object):
         self.assert_p_error(0.001, 8)
         self.assert_p_error(0.0000001,0)
 
+class BlockedCase(object):
+    def test(self):
+
+        self.assert_p_error(0.2, 487)
+        self.assert_p_error(0.15, 334)
+        self.assert_p_error(0.1, 133)
+        self.assert_p_error(0.05, 49)
+        self.assert_p_error(0.01, 4)
+        self.assert_p_error(0.001, 1)
+        self.assert_p_error(0.0000001,0)
+
+class DoubleHashingCase(object):
+    def test(self):
+
+        self.assert_p_error(0.2, 2055)
+        self.assert_p_error(0.15, 1540)
+        self.assert_p_error(0.1, 993)
+        self.assert_p_error(0.05, 509)
+        self.assert_p_error(0.01, 90)
+        self.assert_p_error(0.001, 11)
+        self.assert_p_error(0.0000001,0)
+
+class CountingCase(object):
+    def test(self):
+
+        self.assert_p_error(0.2, 495)
+        self.assert_p_error(0.15, 347)
+        self.assert_p_error(0.1, 127)
+        self.assert_p_error(0.05, 48)
+        self.assert_p_error(0.01, 1)
+        self.assert_p_error(0.001, 0)
+        self.assert_p_error(0.0000001,0)
+
+class PowerOfTwoCase(object):
+    def test(self):
+
+        self.assert_p_error(0.2, 244)
+        self.assert_p_error(0.15, 244)
+        self.assert_p_error(0.1, 248)
+        self.assert_p_error(0.05, 276)
+        self.assert_p_error(0.01, 10)
+        self.assert_p_error(0.001, 1)
+        self.assert_p_error(0.0000001,0)
+
 class TestSharedMemoryErrorRate(TestCase, Case):
     def assert_p_error(self, p, errors, count=10000):
         with NamedTemporaryFile() as f:
@@ -44,3 +88,61 @@ class TestErrorRate(TestCase, Case):
             sum(v in bf for v in range(count, count*2)),
             errors)
 
+
+class TestBlockedSharedMemoryErrorRate(TestCase, BlockedCase):
+    def assert_p_error(self, p, errors, count=10000):
+        with NamedTemporaryFile() as f:
+            bf = SharedMemoryBloomFilter(f.name, count + 1, p, blocked=True)
+            for v in range(count):
+                bf.add(v)
+            self.assertEqual(
+                sum(v in bf for v in range(count, count*2)),
+                errors)
+
+class TestBlockedErrorRate(TestCase, BlockedCase):
+    def assert_p_error(self, p, errors, count=10000):
+        bf = BloomFilter(count + 1, p, blocked=True)
+        for v in range(count):
+            bf.add(v)
+        self.assertEqual(
+            sum(v in bf for v in range(count, count*2)),
+            errors)
+
+class TestDoubleHashingSharedMemoryErrorRate(TestCase, DoubleHashingCase):
+    def assert_p_error(self, p, errors, count=10000):
+        with NamedTemporaryFile() as f:
+            bf = SharedMemoryBloomFilter(f.name, count + 1, p, double_hashing=True)
+            for v in range(count):
+                bf.add(v)
+            self.assertEqual(
+                sum(v in bf for v in range(count, count*2)),
+                errors)
+
+class TestDoubleHashingErrorRate(TestCase, DoubleHashingCase):
+    def assert_p_error(self, p, errors, count=10000):
+        bf = BloomFilter(count + 1, p, double_hashing=True)
+        for v in range(count):
+            bf.add(v)
+        self.assertEqual(
+            sum(v in bf for v in range(count, count*2)),
+            errors)
+
+class TestPowerOfTwoErrorRate(TestCase, PowerOfTwoCase):
+    def assert_p_error(self, p, errors, count=10000):
+        bf = BloomFilter(count + 1, p, power_of_two=True)
+        for v in range(count):
+            bf.add(v)
+        self.assertEqual(
+            sum(v in bf for v in range(count, count*2)),
+            errors)
+
+# Counting filters keep twice the counters double hashing keeps bits
+
+class TestCountingErrorRate(TestCase, CountingCase):
+    def assert_p_error(self, p, errors, count=10000):
+        bf = CountingBloomFilter(count + 1, p)
+        for v in range(count):
+            bf.add(v)
+        self.assertEqual(
+            sum(v in bf for v in range(count, count*2)),
+            errors)